@@ -1,5 +1,7 @@
+import binascii
 import struct
 import sys
+import time
 from PySide6.QtCore import QIODeviceBase
 from PySide6.QtWidgets import QLabel, QMainWindow, QMessageBox
 from PySide6.QtWidgets import QApplication
@@ -9,22 +11,154 @@ from PySide6.QtSerialPort import QSerialPort
 from ui_burst_creator import Ui_MainWindow
 from settingsdialog import SettingsDialog
 
-from PySide6.QtCore import QThread, Signal
+from PySide6.QtCore import QThread, QTimer, Signal
+
+# Framed protocol, see NeoDK.h. sync, payload length, type, sequence number, payload, CRC-16/CCITT-FALSE (little endian) over length..payload
+FRAME_SYNC = 0xA5
+FRAME_MAX_PAYLOAD = 48
+FRAME_BURST = 0x00
+FRAME_BURST_NOW = 0x01
+FRAME_STOP = 0x02
+FRAME_LIVE = 0x03
+FRAME_TELEMETRY = 0x09
+FRAME_PROFILE = 0x0A
+FRAME_BAUD = 0x0B
+FRAME_LIVE_DELTA = 0x0C
+# the fields FRAME_LIVE_DELTA can change, in LIVE_ bit order: offset and size in the burst payload
+LIVE_FIELDS = [(4, 1), (5, 2), (7, 1), (8, 1), (9, 2), (11, 1), (12, 1), (13, 2), (15, 1), (16, 1), (17, 2), (19, 2), (21, 1),
+               (26, 1), (27, 2), (29, 1)]
+BAUD_DEFAULT = 115200                   # what the NeoDK starts at, and goes back to when a faster rate isn't working
+BAUD_REPLY_TIMEOUT = 0.25               # seconds to wait for the NeoDK to ACK or NAK a FRAME_BAUD
+FRAME_ACK = 0x80
+FRAME_NAK = 0x81
+FRAME_CREDIT = 0x82
+FRAME_TELEMETRY_DATA = 0x83
+TELEMETRY_FORMAT = '<IHHHHHBBHHHBH'     # the layout over telemetry_send() in NeoDK.c
+FRAME_PROFILE_DATA = 0x84
+PROFILE_FORMAT = '<BIQII10HHHH'         # and over profile_send()
+PROFILE_NAMES = ["main loop", "pulse interrupt", "pulse lateness", "RX interrupt", "TX interrupt"]
+NAK_REASONS = {1: "bad CRC", 2: "queue full", 3: "unknown type", 4: "wrong length", 10: "serial rate not supported"}
+# one byte status codes between frames
+STATUS_CODES = {0x11: "Burst processing... ", 0x12: "Repeating burst. ", 0x13: "Burst complete. ",
+                0x14: "Serial rate back to 115200. ", 0x15: "Saving... ", 0x16: "Saved. ", 0x17: "Save failed. "}
+# the NeoDK stalls while it writes flash, so frames are held from STATUS_SAVING until STATUS_SAVED or STATUS_SAVE_FAILED
+STATUS_SAVING = 0x15
+STATUS_SAVE_DONE = (0x16, 0x17)
+SAVE_HOLD_TIMEOUT_MS = 500              # send them anyway after this, in case the status saying it's done was lost
+
+
+def build_frame(frame_type, seq, payload):
+    body = bytes([len(payload), frame_type, seq & 0xFF]) + bytes(payload)
+    return bytes([FRAME_SYNC]) + body + struct.pack('<H', binascii.crc_hqx(body, 0xFFFF))
+
+
+def live_delta(old, new):
+    """A FRAME_LIVE_DELTA payload for the fields that differ between two burst payloads, or None if none of them do"""
+    fields = 0
+    values = bytearray()
+    for bit, (offset, size) in enumerate(LIVE_FIELDS):
+        if old[offset:offset + size] != new[offset:offset + size]:
+            fields |= 1 << bit
+            values += new[offset:offset + size]
+    return struct.pack('<H', fields) + values if fields else None
+
+
+def describe_frame(frame):
+    frame_type, seq, payload = frame[2], frame[3], frame[4:-2]
+    if frame_type == FRAME_ACK and len(payload) == 1:
+        return f"[ACK {seq}, {payload[0]} free] "
+    if frame_type == FRAME_NAK and len(payload) == 2:
+        return f"[NAK {seq}: {NAK_REASONS.get(payload[0], payload[0])}, {payload[1]} free] "
+    if frame_type == FRAME_CREDIT and len(payload) == 1:
+        return f"[{payload[0]} free] "
+    if frame_type == FRAME_TELEMETRY_DATA and len(payload) == struct.calcsize(TELEMETRY_FORMAT):
+        (ms, batt, cap, setpoint, current, current_max, pot, free,
+         queued, bursts, reps, flags, dropped) = struct.unpack(TELEMETRY_FORMAT, payload)
+        return (f"[{ms} ms: batt {batt} mV, cap {cap}/{setpoint} mV, current {current} (max {current_max}), pot {pot}, "
+                f"{free} free, burst {bursts}, flags {flags:#04x}] ")
+    if frame_type == FRAME_PROFILE_DATA and len(payload) == struct.calcsize(PROFILE_FORMAT):
+        which, count, total, fewest, most, *rest = struct.unpack(PROFILE_FORMAT, payload)
+        overruns, dropped, tx_dropped = rest[-3:]
+        name = PROFILE_NAMES[which] if which < len(PROFILE_NAMES) else which
+        mean = total / count / 32 if count else 0   # 32 core clock cycles a us
+        return (f"[{name}: {count} times, {fewest / 32:.2f} to {most / 32:.2f} us, mean {mean:.2f} us. {overruns} RX overruns, "
+                f"{dropped} frames dropped, {tx_dropped} TX messages dropped] ")
+    return f"[frame type {frame_type:#04x} seq {seq}] "
+
+
+def split_frames(data: bytearray):
+    """Takes the text, status codes and whole frames off the front of data and returns them as a string, whether any of it
+    was garbled, and the status codes. A frame that hasn't all arrived yet is left in data. The NeoDK's text is 7 bit, so a sync
+    byte is always the start of a frame, and text with the top bit set (or a bad frame) means the two ends aren't at the same
+    serial rate."""
+    out = []
+    garbled = False
+    statuses = []
+    while data:
+        if data[0] in STATUS_CODES:
+            out.append(STATUS_CODES[data[0]])
+            statuses.append(data[0])
+            del data[:1]
+            continue
+        if data[0] != FRAME_SYNC:
+            end = next((i for i, c in enumerate(data) if c == FRAME_SYNC or c in STATUS_CODES), len(data))
+            garbled |= any(c & 0x80 for c in data[:end])
+            out.append(data[:end].decode('utf-8', errors='replace'))
+            del data[:end]
+            continue
+        if len(data) < 2:
+            break
+        if data[1] > FRAME_MAX_PAYLOAD:
+            del data[:1]
+            continue
+        size = data[1] + 6
+        if len(data) < size:
+            break
+        frame = bytes(data[:size])
+        del data[:size]
+        if binascii.crc_hqx(frame[1:-2], 0xFFFF) == struct.unpack('<H', frame[-2:])[0]:
+            out.append(describe_frame(frame))
+        else:
+            out.append("[bad frame] ")
+            garbled = True
+    return ''.join(out), garbled, statuses
+
+
+def reply_to(data: bytes, seq):
+    """The type of the first good ACK or NAK for seq in data, or None if there isn't one (yet)"""
+    for i in range(len(data) - 1):
+        if data[i] != FRAME_SYNC:
+            continue
+        frame = data[i:i + data[i + 1] + 6]
+        if (len(frame) == data[i + 1] + 6 and frame[2] in (FRAME_ACK, FRAME_NAK) and frame[3] == seq
+                and binascii.crc_hqx(frame[1:-2], 0xFFFF) == struct.unpack('<H', frame[-2:])[0]):
+            return frame[2]
+    return None
 
 
 class SerialReaderThread(QThread):
     data_received = Signal(str)  # Signal to send data to the UI thread
+    line_garbled = Signal()      # and one for when what came in can't be read
+    saving = Signal(bool)        # and when the NeoDK starts and finishes writing flash
 
     def __init__(self, serial_port: QSerialPort):
         super().__init__()
         self.serial_port = serial_port
         self.running = True  # Control flag for the thread loop
+        self.pending = bytearray()  # bytes of a frame that hasn't all arrived yet
 
     def run(self):
         while self.running:
             if self.serial_port.waitForReadyRead(10):  # Wait for data
-                data = self.serial_port.readAll().data().decode('utf-8')  # Read and decode
-                self.data_received.emit(data)  # Send data to the main thread
+                self.pending.extend(self.serial_port.readAll().data())
+                data, garbled, statuses = split_frames(self.pending)
+                if data:
+                    self.data_received.emit(data)  # Send data to the main thread
+                if garbled:
+                    self.line_garbled.emit()
+                for status in statuses:
+                    if status == STATUS_SAVING or status in STATUS_SAVE_DONE:
+                        self.saving.emit(status == STATUS_SAVING)
 
     def stop(self):
         self.running = False
@@ -43,8 +177,19 @@ class MainWindow(QMainWindow):
         self.NeoWindow.buttonSend.clicked.connect(self.start_listening)
         self.NeoWindow.actionCOM_setting.triggered.connect(self.settingsDialog.show)
         self.buffer = bytearray()
+        self.seq = 0
+        self.live_payload = None  # the burst as the NeoDK has it, once one has been sent
+        self.held = None          # frames waiting for the NeoDK to finish writing flash, or None when they can go straight out
+        self.holds = 0            # saves it has said it's starting, to match each hold's timeout to it
+        ui = self.NeoWindow
+        for slider in (ui.sliderPW, ui.sliderFrequency, ui.sliderVoltage, ui.sliderVoltageWaveform, ui.sliderVoltageModFreq,
+                       ui.sliderVoltageModAmt, ui.sliderPWModWaveform, ui.sliderPWModFreq, ui.sliderPWModAmt,
+                       ui.sliderFrequencyModWaveform, ui.sliderFrequencyModFreq, ui.sliderFrequencyModAmt, ui.sliderPolarity):
+            slider.valueChanged.connect(self.send_live)
         self.reader_thread = SerialReaderThread(self.serialPort)
         self.reader_thread.data_received.connect(self.update_text_box)
+        self.reader_thread.line_garbled.connect(self.baud_fallback)
+        self.reader_thread.saving.connect(self.hold_frames)
 
     def show_status_message(self, msg):
         self.NeoWindow.statusbar.showMessage(msg)
@@ -59,7 +204,48 @@ class MainWindow(QMainWindow):
                 QMessageBox.critical(self, "Critical Error","Com port opening failed")
                 return
             self.show_status_message("port opened")
-        self.serialPort.write(self.buffer)
+        # hardcode to immediate run frames; FRAME_BURST would just add this to the buffer on the neodk, which may be desired in the future.
+        self.send(build_frame(FRAME_BURST_NOW, self.next_seq(), self.buffer))
+        self.live_payload = bytes(self.buffer)
+
+    def send_live(self):
+        """Once a burst has been sent, a slider moved sends just the fields that have changed, and the burst carries on with them
+        from the next pulse rather than starting again"""
+        if self.live_payload is None or not self.serialPort.isOpen():
+            return
+        self.pack_data()
+        delta = live_delta(self.live_payload, self.buffer)
+        if delta:
+            self.send(build_frame(FRAME_LIVE_DELTA, self.next_seq(), delta))
+            self.live_payload = bytes(self.buffer)
+
+    def send(self, frame):
+        if self.held is None:
+            self.serialPort.write(frame)
+        else:
+            self.held.append(frame)
+
+    def hold_frames(self, hold):
+        """While the NeoDK writes flash its core is stalled, and what it would get meanwhile could run over its receive buffer, so
+        frames wait here until it says it's done"""
+        if hold:
+            if self.held is None:
+                self.held = []
+                self.holds += 1
+                QTimer.singleShot(SAVE_HOLD_TIMEOUT_MS, lambda hold=self.holds: self.hold_timeout(hold))
+        elif self.held is not None:
+            held, self.held = self.held, None
+            for frame in held:
+                self.serialPort.write(frame)
+
+    def hold_timeout(self, hold):
+        if hold == self.holds:  # not a timer left over from an earlier save
+            self.hold_frames(False)
+
+    def next_seq(self):
+        seq = self.seq
+        self.seq = (self.seq + 1) & 0xFF
+        return seq
 
     def pack_data(self): #this should be refactored. While compact, it is impossible to debug the conversions - especially converting frequencies to periods with integer decimal etc.
         self.buffer.clear()
@@ -85,7 +271,9 @@ class MainWindow(QMainWindow):
         self.buffer.extend(struct.pack('B', int(self.NeoWindow.sliderPolarity.value())))
         self.buffer.extend(struct.pack('<H', int((self.NeoWindow.sliderPause.value() * 100))))
         self.buffer.extend(struct.pack('<H', int(self.NeoWindow.spinRepeats.value())))
-        self.buffer.extend(struct.pack('B', int(1)))     # hardcode to immediate run packets; 0 would just add this to the buffer on the neodk, which may be desired in the future.
+        self.buffer.extend(struct.pack('B', int(1)))     # output_triacs: hardcode to AB for now. 1=AB, 2=CD, 3=AD, 4=BC, 5=ABC, 6=ABD, 7=CDA, 8=CDB, 9=ABCD
+        self.buffer.extend(struct.pack('<H', int(0)))    # route_mod_routes: bit n set = rotate through route n. 0 = stay on output_triacs
+        self.buffer.extend(struct.pack('B', int(0)))     # route_mod_pulses: pulses on each route when rotating
 
 
     def start_listening(self):
@@ -109,18 +297,46 @@ class MainWindow(QMainWindow):
     def open_serial_port(self):
         s = self.settingsDialog.settings()
         self.serialPort.setPortName(s.name)
-        self.serialPort.setBaudRate(s.baud_rate)
+        self.serialPort.setBaudRate(BAUD_DEFAULT)      # the NeoDK starts at this. A faster rate is negotiated once the port is open
         self.serialPort.setDataBits(s.data_bits)
         self.serialPort.setParity(s.parity)
         self.serialPort.setStopBits(s.stop_bits)
         self.serialPort.setFlowControl(s.flow_control)
         if self.serialPort.open(QIODeviceBase.ReadWrite):
             self.show_status_message("Serial Communication started")
+            if s.baud_rate != BAUD_DEFAULT:
+                self.negotiate_baud(s.baud_rate)
             return True
         else:
             QMessageBox.critical(self, "Error", self.serialPort.errorString())
             self.show_status_message("Serial Communication error")
             return False
+
+    def negotiate_baud(self, rate):
+        """Asks the NeoDK to switch to rate, and follows it there if it ACKs. It switches once the ACK has gone, then goes back to
+        115200 unless a good frame comes in at the new rate within a second, so the burst that is sent next confirms it."""
+        seq = self.next_seq()
+        self.serialPort.write(build_frame(FRAME_BAUD, seq, struct.pack('<I', rate)))
+        self.serialPort.waitForBytesWritten(100)
+        reply = bytearray()
+        deadline = time.monotonic() + BAUD_REPLY_TIMEOUT
+        answer = None
+        while answer is None and time.monotonic() < deadline:
+            if self.serialPort.waitForReadyRead(10):
+                reply.extend(self.serialPort.readAll().data())
+                answer = reply_to(bytes(reply), seq)
+        if answer == FRAME_ACK:
+            self.serialPort.setBaudRate(rate)
+            self.show_status_message(f"Serial Communication started at {rate} baud")
+        else:
+            self.show_status_message(f"NeoDK didn't take {rate} baud, staying at {BAUD_DEFAULT}")
+
+    def baud_fallback(self):
+        # what's coming in can't be read, so the NeoDK has most likely gone back to 115200 (it sends STATUS_BAUD_FALLBACK
+        # there, which can be read once this end follows it). If it hasn't, it will once it can't read what is sent at 115200
+        if self.serialPort.baudRate() != BAUD_DEFAULT:
+            self.serialPort.setBaudRate(BAUD_DEFAULT)
+            self.show_status_message(f"Serial rate back to {BAUD_DEFAULT}")
             
             
 if __name__ == "__main__":
@@ -17,7 +17,7 @@ from ui_settingsdialog import Ui_SettingsDialog
 BLANK_STRING = "N/A"
 
 
-CUSTOM_BAUDRATE_INDEX = 4
+CUSTOM_BAUDRATE_INDEX = 8
 
 
 class Settings():
@@ -110,6 +110,11 @@ class SettingsDialog(QDialog):
         self.m_ui.baudRateBox.addItem("19200", QSerialPort.Baud19200)
         self.m_ui.baudRateBox.addItem("38400", QSerialPort.Baud38400)
         self.m_ui.baudRateBox.addItem("115200", QSerialPort.Baud115200)
+        # the faster rates the NeoDK can be switched to (see FRAME_BAUD). The port opens at 115200 and negotiates up to them
+        self.m_ui.baudRateBox.addItem("230400", 230400)
+        self.m_ui.baudRateBox.addItem("460800", 460800)
+        self.m_ui.baudRateBox.addItem("921600", 921600)
+        self.m_ui.baudRateBox.addItem("1000000", 1000000)
         self.m_ui.baudRateBox.addItem("Custom")
 
         self.m_ui.dataBitsBox.addItem("5", QSerialPort.Data5)
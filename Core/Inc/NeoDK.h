@@ -10,7 +10,27 @@
 #include "main.h"
 
 // FIFO BUFFER FOR BURSTS
-#define BURST_FIFO_BUFFER_SIZE 10
+#define BURST_FIFO_BYTES	512		//a power of 2. Holds at least 13 bursts with everything modulated, and 32 with nothing modulated. See _burst_record
+
+// TIM1 pulse engine (PULSE_ENGINE_TIM1 in NeoDK.c)
+#define TIM1_NO_PULSE		0xFFFF	//a CCR past any ARR the engine uses, so the channel stays off for the period
+#define TIM1_START_DELAY	100		//us from starting the engine to the first update interrupt
+
+// Output routing
+#define ROUTE_DEADTIME_US	100		//least time between the bridge turning off and different triacs being triggered, so the old ones can drop out
+
+// ADC. Each scan is the 4 ranks set up in MX_ADC1_Init, and adc_buffer holds ADC_SCANS of them, see adc_pump()
+#define ADC_CHANNELS		4
+#define ADC_SCANS			2		//the DMA fills one while the main loop reads the other
+#define ADC_CURRENT			0		//ranks, as indexes into a scan
+#define ADC_CAP				1
+#define ADC_BATT			2
+#define ADC_POT				3
+#define ADC_CURRENT_DELAY_US	2		//how far into a pulse the TIM1 engine starts a scan. About where the TIM14 interrupt gets to
+#define ADC_POLL_US			1000	//with no pulses starting scans, the main loop starts one this often
+#define ADC_POLL_BURST_US	20000	//the same in a burst, for pulses too far apart (or too short, for TIM1) to keep the readings coming
+#define ADC_POLL_IDLE_US	100000	//and with the buck off, when only the battery and pot are worth watching
+#define BUCK_IDLE_OFF_MS	2000	//the buck is turned off after this long with nothing to play, see power_idle()
 
 
 typedef struct {
@@ -19,15 +39,15 @@ typedef struct {
 	uint16_t	period;					//in us. not sure if off time or total time is better, might have to refactor later. This is just pulse to pulse, whether polarity changes or not, so not exactly analogous to AC period.
 	uint8_t		volts;					// in .1 volts, eg 113 = 11.3V
 //	uint8_t		polarity;				// 0 or 1. Allows master device to define if the first pulse
-	uint8_t		v_mod_waveform;			//0 = none, 1 = sine, 2 = sawtooth, 3 = triangle, 4 = square
+	uint8_t		v_mod_waveform;			//WAVE_ number. 0 = none, 1 = sine, 2 = sawtooth, 3 = triangle, 4 = square, and more below
 	uint16_t	v_mod_freq;				//milliseconds. actually transmit these as period, so we don't have to do floating point math here, let the PC / ESP32 do it.
 	uint8_t		v_mod_min;				//minimum voltage (in absolute terms, no sense multiplying burst.volts if we don't have to)
 //	uint8_t		v_mod_max;				//maximum voltage (in absolute terms, no sense multiplying burst.volts if we don't have to. should be the same as burst.volts though)
-	uint8_t		pw_mod_waveform;		//0 = none, 1 = sine, 2 = sawtooth, 3 = triangle, 4 = square
+	uint8_t		pw_mod_waveform;		//WAVE_ number. 0 = none, 1 = sine, 2 = sawtooth, 3 = triangle, 4 = square, and more below
 	uint16_t	pw_mod_freq;			//milliseconds. actually transmit these as period, so we don't have to do floating point math here, let the PC / ESP32 do it.
 	uint8_t		pw_mod_min;				//minimum pw (in absolute terms)
 //	uint8_t		pw_mod_max;				//maximum pw (in absolute terms. should be same as burst.pw)
-	uint8_t		period_mod_waveform;	//0 = none, 1 = sine, 2 = sawtooth, 3 = triangle, 4 = square
+	uint8_t		period_mod_waveform;	//WAVE_ number. 0 = none, 1 = sine, 2 = sawtooth, 3 = triangle, 4 = square, and more below
 	uint16_t	period_mod_freq;		//milliseconds. actually transmit these as period, so we don't have to do floating point math here, let the PC / ESP32 do it.
 	uint16_t	period_mod_min;			//minimum deviation % (in absolute terms)
 //	uint16_t	period_mod_max;			//maximum deviation % (in absolute terms. should be the same as burst.period though)
@@ -35,69 +55,536 @@ typedef struct {
 	uint8_t		pol_mod_freq;			//A multiple of burst.period, so you get even changes in polarity,  1= -_-_-_,   2= --_ _--_ _--_ _,   3=  ---_ _ _---_ _ _---_ _ _. Limit to these 3 options for now.
 	uint16_t	pause_after;			//pause after burst. milliseconds
 	uint16_t	repetitions;			//repeat this burst this many times (includes the pause)
+	uint8_t		output_triacs;			//route to start the burst on. Same numbering as pulse_running.output_triacs
+	uint16_t	route_mod_routes;		//routes to rotate through, bit n = route n. 0 = stay on output_triacs for the whole burst
+	uint8_t		route_mod_pulses;		//pulses on each route before moving on to the next one in route_mod_routes
 	uint8_t		packet_type;			//0= normal; 1= empty buffer and run this packet immediately; 2= emergency stop; 3 = just update live settings from burst so they affect the currently running burst and its repetitions
 										//	I think type 1 packets will actually be "normal". This way the PC is always in control. I can't really see a use case for buffering up a bunch of type 0 packets
 } _burst ;
 
-#define USART_BUFFER_SIZE 27
+// A burst as it waits in the queue: a 16 byte header, then a part for each thing the burst modulates, in BURST_PART_ order.
+// Parts that aren't used take no space, so an unmodulated burst is 16 bytes rather than the 36 of a _burst. Every field
+// sits at its natural alignment and records are a multiple of 4 bytes, so the M0+ never has to do an unaligned access.
+// Written by decode_burst_from_usart(), turned back into a _burst by burst_record_unpack().
+#define BURST_RECORD_VERSION	1
+#define BURST_PART_V			0x01		//_burst_mod
+#define BURST_PART_PW			0x02		//_burst_mod
+#define BURST_PART_PERIOD		0x04		//_burst_period_mod
+#define BURST_PART_ROUTE		0x08		//_burst_route
+#define BURST_RECORD_MAX		36			//header and all the parts
+
+typedef struct {
+	uint8_t		format;				//BURST_RECORD_VERSION<<4 | BURST_PART_ bits. 0 = no record here, the queue carries on at the start of its buffer
+	uint8_t		size;				//bytes, header and parts, rounded up to a multiple of 4
+	uint8_t		pw;
+	uint8_t		volts;
+	uint32_t	duration;
+	uint16_t	period;
+	uint16_t	pause_after;
+	uint16_t	repetitions;
+	uint8_t		pol_mod_freq;
+	uint8_t		output_triacs;
+} _burst_record;
+
+typedef struct {
+	uint16_t	mod_ms;				//v_mod_freq or pw_mod_freq
+	uint8_t		waveform;
+	uint8_t		min;
+} _burst_mod;
+
+typedef struct {
+	uint16_t	mod_ms;				//period_mod_freq
+	uint16_t	min;				//period_mod_min
+	uint8_t		waveform;
+	uint8_t		spare;
+} _burst_period_mod;
+
+typedef struct {
+	uint16_t	routes;				//route_mod_routes
+	uint8_t		pulses;				//route_mod_pulses
+	uint8_t		spare;
+} _burst_route;
+
+// LPUART1 RX: the DMA runs round usart_buffer for ever, see usart_rx_poll() in NeoDK.c
+#define USART_BUFFER_SIZE	128		//a power of 2, so the running byte counts below stay in step with it when they wrap. 11ms at 115200 baud
+
+typedef struct {
+	volatile uint32_t	received;	//bytes the DMA has put in usart_buffer so far, as of the last RX event. Only the interrupt changes this
+	uint16_t			dma_pos;	//where in usart_buffer the last RX event said the DMA was. Interrupt only
+	uint32_t			parsed;		//bytes the main loop has taken out. Main loop only
+	uint16_t			overruns;	//times the DMA got a whole buffer ahead of the main loop, and bytes were lost
+	uint16_t			errors;		//framing, noise and overrun errors from the UART
+} _usart_rx;
+
+// LPUART1 TX: a ring the DMA sends from, see uart_buffer_write() in NeoDK.c
+#define TX_BUFFER_SIZE		256		//a power of 2, like USART_BUFFER_SIZE. 22ms at 115200 baud
+
+typedef struct {
+	volatile uint32_t	reserved;	//bytes handed out to writers so far, running counts like _usart_rx's
+	volatile uint32_t	committed;	//bytes written and ready to go: all of them, once no writer is part way through
+	volatile uint32_t	sent;		//bytes the DMA has finished with
+	volatile uint16_t	sending;	//bytes in the transfer under way, 0 = the DMA is idle
+	uint8_t				writers;	//writers between taking room and committing it
+	uint16_t			dropped;	//messages dropped whole for want of room
+	uint32_t			dropped_bytes;
+	uint16_t			most_waiting;	//the fullest the ring has been
+} _usart_tx;
+
+// Framed protocol over LPUART1, see frame_rx_byte() in NeoDK.c. Each frame is
+//   FRAME_SYNC, length of payload, type, sequence number, payload, CRC-16/CCITT (little endian, over length to the end of payload)
+#define FRAME_SYNC			0xA5
+#define FRAME_MAX_PAYLOAD	48
+#define FRAME_OVERHEAD		6		//sync, length, type, sequence number and the two CRC bytes
+#define BURST_PAYLOAD_SIZE	30		//payload of the burst frames, decoded by decode_burst_from_usart()
+
+// frame types from the host. The burst ones are the same numbers as _burst.packet_type
+#define FRAME_BURST			0x00	//queue this burst. Payload is a burst
+#define FRAME_BURST_NOW		0x01	//empty the queue and run this burst now. Payload is a burst
+#define FRAME_STOP			0x02	//empty the queue and stop the outputs. No payload
+#define FRAME_LIVE			0x03	//change the running burst's voltage. Payload is a burst, only volts and v_mod_min are used. FRAME_LIVE_DELTA does more in fewer bytes
+#define FRAME_PATTERN_LOAD	0x04	//put pattern code in place, stopping any pattern that is running. Payload: offset(2), then the code to go there
+#define FRAME_PATTERN_RUN	0x05	//empty the queue and run the pattern loaded. Payload: length of the code(2), its CRC-16(2)
+#define FRAME_PATTERN_SAVE	0x06	//keep the pattern loaded in flash, to run at power up. Payload as FRAME_PATTERN_RUN. Length 0 = don't run one
+#define FRAME_SETTINGS		0x07	//use these settings, and keep them in flash. Payload: a _settings
+#define FRAME_WAVE_LOAD		0x08	//put entries in a wavetable slot. Payload: slot, first entry, then up to 23 entries(2), 0 to 4096 each
+#define FRAME_TELEMETRY		0x09	//send FRAME_TELEMETRY_DATA every interval(2) ms, TELEMETRY_MIN_MS at least, 0 = stop. No payload = send one now
+#define FRAME_PROFILE		0x0A	//send FRAME_PROFILE_DATA. Payload: PROFILE_ stats, + PROFILE_RESET to clear them afterwards
+#define FRAME_BAUD			0x0B	//switch LPUART1 to this rate once the ACK has gone. Payload: baud(4). See baud_poll()
+#define FRAME_LIVE_DELTA	0x0C	//change some of the running burst's settings without restarting it. Payload: LIVE_ fields(2), then their values. See live_apply()
+// frame types to the host. The sequence number is the one from the frame being answered
+#define FRAME_ACK			0x80	//payload: free burst queue slots
+#define FRAME_NAK			0x81	//payload: FRAME_NAK_ reason, free burst queue slots
+#define FRAME_CREDIT		0x82	//sent unasked when a burst is taken off the queue and its room freed. payload: free burst queue slots. Sequence number is the last frame acted on
+#define FRAME_TELEMETRY_DATA	0x83	//asked for with FRAME_TELEMETRY. Payload: TELEMETRY_PAYLOAD_SIZE bytes, see telemetry_send(). Sequence number as FRAME_CREDIT
+#define FRAME_PROFILE_DATA	0x84	//the answer to FRAME_PROFILE. Payload: PROFILE_PAYLOAD_SIZE bytes, see profile_send(). Sequence number as FRAME_CREDIT
+#define FRAME_NAK_CRC		1
+#define FRAME_NAK_FULL		2		//burst queue full, send it again later
+#define FRAME_NAK_TYPE		3		//unknown frame type
+#define FRAME_NAK_LENGTH	4		//wrong payload length for the type
+#define FRAME_NAK_PATTERN	5		//pattern code doesn't fit, doesn't match its CRC, or doesn't check out
+#define FRAME_NAK_BUSY		6		//a pattern is feeding the burst queue (stop it with FRAME_STOP or FRAME_BURST_NOW first), or a pattern save is waiting for the outputs to stop
+#define FRAME_NAK_SETTINGS	7		//settings out of range
+#define FRAME_NAK_WAVE		8		//no such wavetable slot, entries past its end, or an entry over 4096
+#define FRAME_NAK_PROFILE	9		//no such PROFILE_ stats
+#define FRAME_NAK_BAUD		10		//not one of the rates in baud_rates[]
+
+// FRAME_LIVE_DELTA fields. The values follow the bitmap in bit order, little endian, each the size of its _burst field
+// (live_field_size[] in NeoDK.c). The burst's timing (duration, pause and repetitions) takes a new burst to change.
+#define LIVE_PW					0x0001
+#define LIVE_PERIOD				0x0002
+#define LIVE_VOLTS				0x0004
+#define LIVE_V_MOD_WAVEFORM		0x0008
+#define LIVE_V_MOD_FREQ			0x0010
+#define LIVE_V_MOD_MIN			0x0020
+#define LIVE_PW_MOD_WAVEFORM	0x0040
+#define LIVE_PW_MOD_FREQ		0x0080
+#define LIVE_PW_MOD_MIN			0x0100
+#define LIVE_PERIOD_MOD_WAVEFORM	0x0200
+#define LIVE_PERIOD_MOD_FREQ	0x0400
+#define LIVE_PERIOD_MOD_MIN		0x0800
+#define LIVE_POL_MOD_FREQ		0x1000
+#define LIVE_OUTPUT_TRIACS		0x2000
+#define LIVE_ROUTE_MOD_ROUTES	0x4000
+#define LIVE_ROUTE_MOD_PULSES	0x8000
+#define LIVE_FIELDS				16
+// the fields each modulator is set up from
+#define LIVE_V_MODULATOR		(LIVE_VOLTS | LIVE_V_MOD_WAVEFORM | LIVE_V_MOD_FREQ | LIVE_V_MOD_MIN)
+#define LIVE_PW_MODULATOR		(LIVE_PW | LIVE_PW_MOD_WAVEFORM | LIVE_PW_MOD_FREQ | LIVE_PW_MOD_MIN)
+#define LIVE_PERIOD_MODULATOR	(LIVE_PERIOD | LIVE_PERIOD_MOD_WAVEFORM | LIVE_PERIOD_MOD_FREQ | LIVE_PERIOD_MOD_MIN)
+#define LIVE_ROUTE_MODULATOR	(LIVE_OUTPUT_TRIACS | LIVE_ROUTE_MOD_ROUTES | LIVE_ROUTE_MOD_PULSES)
+
+// one byte status codes, sent between frames. Below 0x20, so they can't be mistaken for text or FRAME_SYNC
+#define STATUS_BURST_STARTED	0x11	//a burst has been taken off the queue and its pulses started
+#define STATUS_BURST_REPEATED	0x12	//the running burst has started one of its repetitions
+#define STATUS_BURST_DONE		0x13	//the running burst is over, repetitions and all
+#define STATUS_BAUD_FALLBACK	0x14	//sent at BAUD_DEFAULT, having gone back to it from a faster rate that wasn't working
+#define STATUS_SAVING			0x15	//about to write flash, which stalls the core: hold frames until STATUS_SAVED or STATUS_SAVE_FAILED
+#define STATUS_SAVED			0x16	//what the host asked to be saved is in flash
+#define STATUS_SAVE_FAILED		0x17	//it isn't: writing flash went wrong, or the firmware has grown into the store
+
+typedef struct {
+	uint8_t		buf[FRAME_MAX_PAYLOAD+FRAME_OVERHEAD];	//the frame so far, from its sync byte
+	uint8_t		count;				//bytes in buf. 0 = looking for a sync byte
+	uint8_t		last_seq;			//the last frame acted on, so a resend after a lost ACK is only ACKed again
+	uint16_t	last_crc;
+	uint8_t		have_last;
+} _frame_parser;
+
+// On-device patterns: bytecode, uploaded once and run by pattern_step() in the main loop, which queues its bursts the same way
+// the frame handler does. Each instruction is an opcode and its operands, little endian. Addresses are offsets into the code.
+#define PATTERN_CODE_SIZE	512
+#define PATTERN_LOOPS		4		//how deep loops can nest
+#define PATTERN_STEPS		16		//most instructions per main loop pass, so a pattern that only jumps round doesn't hold the loop up
+
+#define OP_END				0x00	//the pattern is over. Bursts it has queued still play
+#define OP_BURST			0x01	//+ a burst frame payload (BURST_PAYLOAD_SIZE). Queue it, once the burst before it has started
+#define OP_JUMP				0x02	//+ address
+#define OP_LOOP				0x03	//+ count(2). Run what is between here and the OP_NEXT count times
+#define OP_NEXT				0x04
+#define OP_RANDOM			0x05	//+ n, then n addresses. Jump to one of them, picked at random
+#define OP_IF_BUTTON		0x06	//+ address. Jump if the pushbutton is pressed
+#define OP_IF_POT_BELOW		0x07	//+ level (0 to 100, like ADC_pot), address. Jump if the level pot is below it
+
+typedef struct {
+	uint8_t		code[PATTERN_CODE_SIZE];
+	uint16_t	length;				//bytes of code, checked by pattern_check()
+	uint16_t	pc;					//the next instruction
+	uint8_t		running;
+	uint8_t		loops;				//loops open
+	uint16_t	loop_start[PATTERN_LOOPS];	//the instruction after each OP_LOOP
+	uint16_t	loop_count[PATTERN_LOOPS];	//times left round each
+} _pattern;
+
+// Settings kept in flash. Little endian, and the same layout as the FRAME_SETTINGS payload
+#define LEVELS				3		//min, med, max
+typedef struct {
+	uint8_t		level;				//which of levels[] to use
+	uint8_t		levels[LEVELS];		//power levels, 0 to 100% of the burst volts. What the level pot would set
+	uint16_t	vprim_min_mV;		//buck output at the top DAC code. 1202 for the Tokmas buck chip, 1064 for the SGM 61410
+	uint16_t	vprim_max_mV;		//buck output at DAC code 0. 10195 for Tokmas, 10057 for SGM
+	uint16_t	slew_mV_per_ms;		//fastest the primary voltage is moved, 1 to 10000. See vprim_update()
+	uint16_t	charge_per_V;		//constant charge: the current sense reading per volt of primary the pulses are held to, as if into a
+									//reference load, up to 409. 0 = off, the pulses are as long as the burst says. See charge_update()
+} _settings;
+
+// The primary voltage, ramped towards where the pulses want it. See vprim_update()
+typedef struct {
+	uint16_t	setpoint_mV;		//where the ramp has got to
+	uint16_t	dac_code;			//the code last written to the DAC. 0xFFFF = none yet
+	uint32_t	slew_q16;			//ramp owed for the time gone, mV in Q16. Only whole mV are taken off
+	uint64_t	updated_us;			//timebase_us() at the last update
+} _vprim;
+
+// Constant charge regulation, see charge_update()
+typedef struct {
+	uint16_t	gain_q12;			//on time scale, 4096 = as the burst says
+	uint16_t	target;				//current sense reading the last pulse was aimed at
+} _charge;
+
+// Filtered ADC readings, see adc_pump()
+typedef struct {
+	uint32_t	filtered[ADC_CHANNELS];		//IIR filter outputs, as readings (4096 = 3.3V) in Q4
+	uint16_t	cap_mV;				//capacitor bank (primary) voltage
+	uint16_t	batt_mV;
+	uint8_t		pot;				//level pot, 0 to 100
+	uint16_t	current;			//current sense reading in the last pulse. Not filtered, each pulse stands on its own
+	uint16_t	current_max;		//highest in this burst
+	uint32_t	scans;
+	uint32_t	pulse_scans;		//scans started by a pulse, so with a current reading
+	uint64_t	scanned_us;			//timebase_us() when the last scan came in, or adc_poll() last started one
+	volatile uint8_t	polling;			//the scan in progress was started by adc_poll()
+	volatile uint8_t	polled[ADC_SCANS];	//the same, for the scans in adc_buffer
+} _adc;
+
+// Power saving, see power_idle()
+typedef struct {
+	uint32_t	idle_since;			//HAL_GetTick() when the outputs were last used
+	uint8_t		buck_on;			//BUCK_EN
+} _power;
+
+// LPUART1's rate, as negotiated with FRAME_BAUD, see baud_poll() in NeoDK.c
+#define BAUD_DEFAULT			115200	//what MX_LPUART1_UART_Init() starts it at, and what it goes back to
+#define BAUD_CONFIRM_MS			1000	//after a switch, the host has this long to get a good frame through at the new rate
+#define BAUD_ERRORS_MAX			8		//line errors, RX overruns and bad frames in BAUD_ERROR_WINDOW_MS that send it back to BAUD_DEFAULT
+#define BAUD_ERROR_WINDOW_MS	1000
+
+typedef struct {
+	uint32_t	rate;				//what LPUART1 is at
+	uint32_t	pending;			//the rate to switch to once the TX ring is empty, 0 = none
+	uint32_t	switched_at;		//HAL_GetTick() at the last switch
+	uint8_t		confirmed;			//a good frame has come in since then
+	uint32_t	window_start;		//HAL_GetTick() the error count window started at
+	uint16_t	window_errors;		//the errors so far, when it did
+	uint16_t	fallbacks;			//times it has gone back to BAUD_DEFAULT by itself
+} _baud;
+
+// Telemetry, see telemetry_send()
+#define TELEMETRY_PAYLOAD_SIZE	25
+#define TELEMETRY_MIN_MS		10		//100 telemetry frames a second, about a quarter of the link at 115200 baud
+
+typedef struct {
+	uint16_t	interval_ms;		//0 = only when asked
+	uint32_t	due;				//HAL_GetTick() the next one is due at
+	uint8_t		requested;			//send one on the next pass of the main loop
+	uint16_t	bursts;				//bursts started since power up
+} _telemetry;
+
+// Record store in the last STORE_PAGES pages of flash, see store_write() in NeoDK.c. One page is in use at a time: records are
+// added to the end of it, and when it is full the newest record of each key is moved to the next page, which then takes over.
+#define STORE_PAGES			2
+#define STORE_MAGIC			0x4B44454E		//"NEDK"
+#define STORE_KEY_SETTINGS	1				//a _settings
+#define STORE_KEY_PATTERN	2				//pattern code, run at power up
+#define STORE_KEYS			3				//keys are 1 to STORE_KEYS-1
+#define STORE_QUIET_MS		10				//after STATUS_SAVING, flash is written once nothing has come in for this long
+#define STORE_QUIET_MAX_MS	100				//or after this long, for a host that doesn't hold its frames
 
-// Define the FIFO buffer structure
+// Flash is written 8 bytes at a time, once per erase, so the page header, record headers and record data all start on 8 bytes
 typedef struct {
-    _burst buffer[BURST_FIFO_BUFFER_SIZE];  // Array to hold data
-    uint8_t head;                 // Points to the next insertion index
-    uint8_t tail;                 // Points to the next item to remove
-    uint8_t count;                // Number of items in the buffer
+	uint32_t	magic;				//STORE_MAGIC once the page is complete. Written last
+	uint32_t	sequence;			//one more than the page before. The highest is the page in use
+} _store_page;
+
+typedef struct {
+	uint8_t		key;				//STORE_KEY_. 0xFF = erased, no records from here on
+	uint8_t		spare;
+	uint16_t	length;				//bytes of data after this header
+	uint16_t	crc;				//frame_crc() of the data. A record cut short by a power cut doesn't match, and is skipped
+	uint16_t	spare2;
+} _store_record;
+
+typedef struct {
+	const uint8_t	*page;			//the page in use. NULL = nothing saved yet, the first write starts a page
+	uint8_t			index;			//which of the STORE_PAGES it is
+	uint32_t		sequence;
+	uint16_t		used;			//bytes written on the page, its header included
+	uint16_t		record[STORE_KEYS];	//where on the page the newest good record of each key is. 0 = none
+	uint8_t			pending;		//bit per key: to be written the next time the outputs are stopped
+	uint16_t		pattern_length;	//pattern code to save, for STORE_KEY_PATTERN
+	uint8_t			in_image;		//the firmware image reaches into the store's pages, so nothing is read from or written to them
+} _store;
+
+// Define the FIFO buffer structure. Single producer (the frame handler) and single consumer (the burst player), see burst_fifo_reserve()
+// head and tail are byte counts that run freely and wrap at 65536, so head-tail is the number of bytes in use and a full buffer
+// isn't mistaken for an empty one
+typedef struct {
+    uint32_t buffer[BURST_FIFO_BYTES/4];  // _burst_records, one after another. uint32_t to keep them aligned
+    volatile uint16_t head;       // End of the last record queued. Only the producer changes this
+    volatile uint16_t tail;       // Start of the oldest record. Only the consumer changes this
+    uint16_t skip;                // Bytes the last reserve left unused at the end of buffer. Producer only
 } BURST_FIFO_Buffer;
 
 typedef struct {
 	uint8_t 		volts;		//in 0.1 volts. eg 113 = 11.3V
 	uint8_t 		polarity;
 	uint8_t 		output_triacs;	//0=all off, 1="AB", 2="CD", 3="AD", 4="BC", 5="ABC", 6="ABD", 7="CDA", 8="CDB", 9="ABCD"
-	uint8_t			on_time;
-	uint16_t		off_time;
 	uint8_t			currently_on;	//0= false; 1=true
 	uint8_t			stopped;
 	uint8_t			polarity_switch_count;
 } _pulse_running;
 
+// One state of the outputs: a BSRR word for each port. See output_on[] in NeoDK.c
+#define OUTPUT_ROUTES	10		//the values pulse_running.output_triacs can take
+typedef struct {
+	uint32_t		bridge;			//Q1/Q2, on GPIOA
+	uint32_t		triacs;			//TRIAC_1 to TRIAC_4, on GPIOB
+} _output_state;
+
+// The modulated values for one pulse. Worked out by the main loop before the pulse is due, see pulse_slot_fill()
+typedef struct {
+	uint16_t		on_time;		//us. Can be longer than the burst's 8 bit pw: constant charge stretches it up to twice that
+	uint16_t		off_time;		//us
+	uint8_t			volts;			//in 0.1 volts
+	uint8_t			route;			//output_on[] route
+} _pulse_slot;
+
+// Two pulse slots: the pulse interrupt plays slot[active], the main loop fills in the other one and sets ready.
+// The interrupt swaps them over at the start of an on time, so a pulse always gets its on and off time from the same slot.
+typedef struct {
+	_pulse_slot		slot[2];
+	uint8_t			active;			//the slot the pulse interrupt is using. Only the interrupt changes this
+	uint8_t			ready;			//1 = the other slot is filled in. Set by the main loop, cleared by the interrupt when it swaps
+} _pulse_slots;
+
+
+
+// Modulator waveforms. Most are a wavetable: WAVE_TABLE_SIZE steps over one cycle, and one more entry for the end of the
+// cycle so the step between the last entry and the end can be interpolated too. Values are 0 to 4096
+#define WAVE_TABLE_SIZE		256
+#define WAVE_NONE			0
+#define WAVE_SINE			1		//a half sine, 0 up to 4096 and back
+#define WAVE_SAWTOOTH		2
+#define WAVE_TRIANGLE		3
+#define WAVE_SQUARE			4		//4096 for the first half. The edges take 1/256 of a cycle
+#define WAVE_SAWTOOTH_DOWN	5
+#define WAVE_EXPONENTIAL	6		//a ramp up that starts slow and ends steep
+#define WAVE_TABLES			6		//built in tables, WAVE_SINE to here (wave_tables[waveform-1])
+#define WAVE_RANDOM_HOLD	7		//a new random level at the start of each cycle
+#define WAVE_NOISE			8		//a new random level every pulse
+#define WAVE_CUSTOM			16		//+ slot: a table the host uploaded to wave_slots[] with FRAME_WAVE_LOAD
+#define WAVE_SLOTS			4		//514 bytes of RAM each
+
+// One modulator per modulated aspect of a burst. Worked out once when the burst starts, see modulator_init()
+typedef struct {
+	const uint16_t	*table;					//wavetable, or NULL for the random waveforms
+	uint8_t		random;						//WAVE_RANDOM_HOLD or WAVE_NOISE, 0 for a table
+	uint16_t	level;						//the random waveforms' level now, 0 to 4096
+	uint32_t	period_us;					//length of one modulation cycle. 0 = not modulated
+	uint32_t	position_us;				//how far into the cycle we are
+	uint32_t	phase_inc;					//phase step per microsecond. A full cycle is 2^32
+	int32_t		base;						//value when the waveform is at 0 (or the value, if not modulated)
+	int32_t		span;						//how far the value moves when the waveform is at 4096. Can be negative
+} _modulator;
+
+// Steps a burst round its routes, a number of pulses on each. See route_modulator_next()
+typedef struct {
+	uint16_t	routes;			//bit n = route n is in the rotation. 0 = not modulated
+	uint8_t		pulses;			//pulses on each route
+	uint8_t		count;			//pulses left on the current route
+	uint8_t		route;			//the current route
+} _route_modulator;
+
+// Work the interrupts hand to the main loop. They only set a bit with post_event(), and event_pump() does the work
+#define EVENT_USART_RX		0x01		//the RX DMA has moved on, so there are new bytes in usart_buffer
+#define EVENT_ADC_SCAN0		0x02		//a scan has landed in the first half of adc_buffer
+#define EVENT_ADC_SCAN1		0x04		//and the second half
+#define EVENT_USART_ERROR	0x08		//a UART error has stopped the RX DMA, so reception needs starting again
+
+// Profiling: how long the main loop and the interrupts take, and how late the pulse interrupt runs. In core clock cycles, from
+// TIM2, see profile_add(). The host reads them with FRAME_PROFILE
+#define PROFILE_LOOP		0		//a main loop pass, as far as __WFI if it sleeps
+#define PROFILE_PULSE		1		//the pulse interrupt, TIM14 or TIM1, whichever pulse engine is built in
+#define PROFILE_PULSE_LATE	2		//from the pulse timer update to its interrupt running, which is how late the pulse edges it makes are. 1us steps
+#define PROFILE_USART_RX	3		//RX DMA events
+#define PROFILE_USART_TX	4		//TX DMA done
+#define PROFILE_STATS		5
+#define PROFILE_RESET		0x80	//in FRAME_PROFILE: clear the stats once they are sent
+#define PROFILE_BUCKETS		10		//histogram: under 2us, under 4us, and so on doubling to under 512us, then the rest
+#define PROFILE_BUCKET0_LOG2	6	//the first bucket is under 64 cycles
+#define PROFILE_PAYLOAD_SIZE	47
+
+typedef struct {
+	uint32_t	count;
+	uint64_t	total;				//so the mean is total/count. The host divides
+	uint32_t	min;
+	uint32_t	max;
+	uint16_t	buckets[PROFILE_BUCKETS];	//stop at 65535
+} _profile_stats;
+
+typedef struct {
+	_profile_stats	stats[PROFILE_STATS];		//by PROFILE_
+	uint32_t		loop_started;		//TIM2 at the top of this main loop pass
+	uint8_t			slept;				//this pass has got to __WFI, and its time is in the stats already
+	uint16_t		frames_dropped;		//frames thrown away for a bad CRC or length
+	uint8_t			requested;			//FRAME_PROFILE payload + 1, for the main loop to send after the ACK. 0 = nothing asked for
+} _profile;
+
 
 
 //GLOBAL VARIABLES
 extern BURST_FIFO_Buffer burst_buffer;
-extern _pulse_running pulse_running;
-extern uint32_t tick_burst_started_at;
+extern volatile _pulse_running pulse_running;
+extern volatile _pulse_slots pulse_slots;
+extern const _output_state output_on[OUTPUT_ROUTES][2];
+extern const _output_state output_off;
+extern uint64_t burst_started_us;
 extern _burst USART_burst;
 extern _burst current_burst;
 extern uint8_t in_a_burst;
 extern uint32_t LED_timer;
+extern _modulator period_modulator;
+extern _modulator pw_modulator;
+extern _modulator v_modulator;
+extern _route_modulator route_modulator;
+extern const uint16_t wave_tables[WAVE_TABLES][WAVE_TABLE_SIZE+1];
+extern uint16_t wave_slots[WAVE_SLOTS][WAVE_TABLE_SIZE+1];
 
 extern uint8_t rt_ChkFail[11];
 extern uint8_t rt_BufFull[11];
 extern uint8_t rt_Ack[4];
-extern uint8_t usart_buffer[50];
+extern uint8_t usart_buffer[USART_BUFFER_SIZE];
+extern _usart_rx usart_rx;
+extern _usart_tx usart_tx;
+extern uint8_t usart_tx_buffer[TX_BUFFER_SIZE];
+extern _frame_parser frame_rx;
+extern volatile uint32_t pending_events;
+extern _profile profile;
+extern _pattern pattern;
+extern _settings settings;
+extern _vprim vprim;
+extern _adc adc;
+extern _charge charge;
+extern _power power;
+extern _telemetry telemetry;
+extern _baud baud;
+extern volatile uint16_t adc_buffer[ADC_SCANS*ADC_CHANNELS];
+extern _store store;
 
 void Do_User_Code_Begin_While();
 void Do_User_Code_While_1();
 void Do_MX_GPIO_Init_2();
 
 void burst_fifo_init(BURST_FIFO_Buffer *fifo);
-bool burst_fifo_is_full(BURST_FIFO_Buffer *fifo);
+uint8_t burst_fifo_free(BURST_FIFO_Buffer *fifo);
 bool fifo_is_empty(BURST_FIFO_Buffer *fifo);
-bool burst_fifo_enqueue(BURST_FIFO_Buffer *fifo, _burst item);
-bool burst_fifo_dequeue(BURST_FIFO_Buffer *fifo, _burst *item);
+_burst_record *burst_fifo_reserve(BURST_FIFO_Buffer *fifo, uint8_t size);
+void burst_fifo_commit(BURST_FIFO_Buffer *fifo);
+_burst_record *burst_fifo_peek(BURST_FIFO_Buffer *fifo);
+void burst_fifo_release(BURST_FIFO_Buffer *fifo);
+void burst_fifo_flush(BURST_FIFO_Buffer *fifo);
 
 void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size);
 void global_vars_init();
-void decode_burst_from_usart();
+void post_event(uint32_t event);
+void event_pump();
+uint64_t timebase_us();
+void profile_add(_profile_stats *stats, uint32_t cycles);
+void profile_pass_end();
+void isr_time(uint8_t which, uint32_t started);
+uint8_t burst_record_size(const uint8_t *data);
+void decode_burst_from_usart(const uint8_t *data, _burst_record *record);
+bool burst_record_unpack(const _burst_record *record, _burst *burst);
+uint16_t frame_crc(const uint8_t *data, uint16_t len);
+void frame_rx_byte(uint8_t byte);
+void usart_rx_poll();
+void frame_send(uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t len);
+void frame_credit();
+uint16_t random16();
+bool pattern_check(const uint8_t *code, uint16_t length);
+void pattern_start();
+void pattern_stop();
+void pattern_step();
+void pattern_run_saved();
+void settings_init();
+bool settings_apply(const _settings *new_settings);
+void vprim_update(uint16_t target_mV);
+void adc_pump(uint8_t half);
+void adc_poll();
+void charge_update(uint16_t current);
+uint32_t charge_on_time(uint32_t pw, uint32_t period);
+void power_sleep();
+void power_idle();
+void power_wake();
+void telemetry_send();
+void telemetry_poll();
+void profile_send(uint8_t which);
+void profile_poll();
+void usart_rx_restart();
+bool baud_supported(uint32_t rate);
+void usart_set_baud(uint32_t rate);
+void baud_poll();
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
+void HAL_ADC_ConvHalfCpltCallback(ADC_HandleTypeDef *hadc);
+void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef *hadc);
+void store_init();
+const uint8_t *store_find(uint8_t key, uint16_t *length);
+bool store_write(uint8_t key, const void *data, uint16_t length);
+void store_flush();
 
 void uart_buffer_write(const uint8_t* data, uint16_t size);
+void status_send(uint8_t code);
 void start_uart_dma();
 void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart);
 
-uint16_t fast_sine(uint16_t angle);
-uint16_t triangle_wave(uint16_t angle);
-uint16_t sawtooth_wave(uint16_t angle);
-uint16_t square_wave(uint16_t angle);
+void modulator_init(_modulator *mod, uint8_t waveform, uint16_t mod_period_ms, uint16_t unmodulated, uint16_t at_zero, uint16_t at_full);
+void modulators_init(const _burst *burst);
+void modulator_update(_modulator *mod, uint8_t waveform, uint16_t mod_period_ms, uint16_t unmodulated, uint16_t at_zero, uint16_t at_full);
+uint8_t live_delta_length(uint16_t fields);
+void live_apply(uint16_t fields, const uint8_t *values);
+void modulator_advance(_modulator *mod, uint32_t time_us);
+uint32_t modulator_value(const _modulator *mod);
+void route_modulator_init(_route_modulator *mod, const _burst *burst);
+uint8_t route_modulator_next(_route_modulator *mod);
+void pulse_slot_fill();
+void pulse_slot_redo(bool new_route);
+void pulse_slots_restart();
+void power_sleep_while(volatile const uint8_t *busy);
+void pulse_engine_start();
+void pulse_engine_stop();
+void tim1_pulse_engine_init();
+void tim1_pulse_update();
+
+uint16_t wave_lookup(const uint16_t *table, uint32_t phase);
 
 
 #endif /* __NEODK_H */
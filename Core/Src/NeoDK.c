@@ -4,10 +4,8 @@
 #include <string.h>
 
 //TODO:
-// Checksums for data packets
-// Support other packet types, such as emergency stop, whip. Also instead of just sending status packets every 0.5s, maybe only respond to requests for info from the host.
+// Support other packet types, such as whip. Also instead of just sending status packets every 0.5s, maybe only respond to requests for info from the host.
 //  should have more feedback info, like battery status, max voltage setting, watchdog timer
-// Don't tx over usart inside the interrupt. Add to a send buffer, and then tx that from the main loop.
 //
 
 
@@ -16,6 +14,7 @@
  * A burst is a series of identical (except for modulation) pulses, defined by a duration, frequency, pulse_width, voltage, rest period and no_of_repeats. These are streamed from the PC to the NeoDK and kept in a small buffer. Bursts with special magic numbers are used for special purposes, like emergency stop, flush cache so next burst runs immediately etc.
  * Each aspect of a burst can be modulated, using a waveform function, like sine, triangle, sawtooth, square etc. Each modulator has a frequency and min/max values
  * A pattern is a sequence of bursts. These are defined in JSON and interpreted on the PC or ESP32, which will stream the resultant burst information to the NeoDK. They use input from the intensity knob, pushbutton and can do basic calculations with those inputs as well as random numbers.
+ *   Or compiled to bytecode, uploaded, and played by the NeoDK itself, see pattern_step().
  * A program generates patterns, and can use loops, random numbers, variables, inputs from middleware and internet. It allows remote control, response to bio sensors, etc. A program may just be a more fleshed out pattern.
 */
 
@@ -27,30 +26,82 @@ extern UART_HandleTypeDef hlpuart1;
 extern DMA_HandleTypeDef hdma_lpuart1_rx;
 extern DMA_HandleTypeDef hdma_lpuart1_tx;
 extern TIM_HandleTypeDef htim14;
+extern TIM_HandleTypeDef htim2;
 
 
 //GLOBAL VARIABLES
 BURST_FIFO_Buffer burst_buffer;
-_pulse_running pulse_running;
-uint32_t tick_burst_started_at;
+volatile _pulse_running pulse_running;	//shared with the pulse interrupt
+volatile _pulse_slots pulse_slots;		//next pulse handed from the main loop to the pulse interrupt
+uint64_t burst_started_us;		//timebase_us() when the burst (or this repetition of it) started
 _burst USART_burst;
-_burst current_burst;
-uint8_t usart_buffer[50];
+_burst current_burst;		//the burst being played, unpacked from its record in burst_buffer
+uint8_t usart_buffer[USART_BUFFER_SIZE];
+_usart_rx usart_rx;
+_usart_tx usart_tx;
+uint8_t usart_tx_buffer[TX_BUFFER_SIZE];
 uint8_t in_a_burst = 0;			//0=false; 1=true
 uint32_t LED_timer=0;
-volatile uint16_t adc_buffer[4];
-uint8_t rt_Msg[50] = "MSGNOTSET";
+volatile uint16_t adc_buffer[ADC_SCANS*ADC_CHANNELS];		//filled by the DMA a scan at a time, see adc_pump()
+uint8_t rt_Msg[64] = "MSGNOTSET";
 uint8_t rt_Msg_size=0;
-
-
-#define VPRIM_MIN_mV     1202   //  1202 for Tokmas buck chip, 1064 for SGM 61410.
-#define VPRIM_MAX_mV    10195   // 10195 for Tokmas, 10057 for SGM.
+_modulator period_modulator;
+_modulator pw_modulator;
+_modulator v_modulator;
+_route_modulator route_modulator;
+volatile uint32_t pending_events;		//EVENT_ bits, set by interrupts and cleared by event_pump()
+_profile profile;
+_pattern pattern;
+_settings settings;
+_vprim vprim;
+_adc adc;
+_charge charge;
+_power power;
+_telemetry telemetry;
+_baud baud;
+_store store;
+uint16_t wave_slots[WAVE_SLOTS][WAVE_TABLE_SIZE+1];		//the host's wavetables, see FRAME_WAVE_LOAD
+static uint32_t random_state;		//xorshift32, never 0. See random16()
+#if PULSE_ENGINE_TIM1
+TIM_HandleTypeDef htim1;
+static volatile uint8_t tim1_pulse_queued;		//the period set up by the last TIM1 update interrupt has a pulse in it
+#endif
+static uint32_t timebase_cycles;		//TIM2 count that timebase_now_us is up to
+static uint64_t timebase_now_us;
+
+
+#define CORE_CYCLES_PER_US	32		//SYSCLK is 32MHz, and TIM2 counts it
+
+#ifndef PULSE_ENGINE_TIM1
+#define PULSE_ENGINE_TIM1	0	//1 = Q1/Q2 are TIM1 PWM outputs and the timer makes the pulse edges, see tim1_pulse_engine_init(). 0 = the TIM14 interrupt switches them.
+#endif
+
+#define VPRIM_MIN_mV     1202   //  1202 for Tokmas buck chip, 1064 for SGM 61410. Default for settings.vprim_min_mV
+#define VPRIM_MAX_mV    10195   // 10195 for Tokmas, 10057 for SGM. Default for settings.vprim_max_mV
+
+#define VPRIM_SLEW_mV_PER_MS	500		//default for settings.slew_mV_per_ms. 10V in 20ms, about as fast as the buck gets there anyway
+#define VPRIM_BOOST_mV		2000	//furthest vprim_update() aims past the setpoint to get the capacitors there sooner
+#define VPRIM_DEADBAND_mV	100		//closer than this to the setpoint, the capacitors are left to settle. ADC noise is about that size
+#define VPRIM_STEP_MAX_US	4096	//most time one ramp step covers, so slew_q16 can't overflow after a long stall
+
+//IIR filter strength for each rank, as a shift: each scan moves the output 1/2^shift of the way to the new reading. The
+//capacitor voltage is the ramp's feedback, so it is only lightly filtered. Current isn't filtered, see adc_pump()
+static const uint8_t adc_filter_shift[ADC_CHANNELS] = { 0, 1, 4, 3 };
+
+#define CHARGE_GAIN_ONE		4096	//charge.gain_q12 for on times as the burst says
+#define CHARGE_GAIN_MIN		1024	//regulated on times are between a quarter of and twice the burst's
+#define CHARGE_GAIN_MAX		8192
+#define CHARGE_PER_V_MAX	409		//a reading of 4095 (full scale) at 10V
+static uint32_t charge_ref_q16;		//settings.charge_per_V per mV rather than per V, Q16. From settings_apply()
+
+static uint16_t vprim_dac_scale=1865;		//DAC codes per mV of buck output, Q12. From the settings, see settings_apply()
+static uint32_t vprim_slew_q16=32768;		//settings.slew_mV_per_ms as mV per microsecond, Q16. Also from settings_apply()
 
 static uint16_t Vcap_mV_ToDacVal(uint16_t Vcap_mV)
 {
-    if (Vcap_mV < VPRIM_MIN_mV) Vcap_mV = VPRIM_MIN_mV;
-    else if (Vcap_mV > VPRIM_MAX_mV) Vcap_mV = VPRIM_MAX_mV;
-    return (uint16_t)(((1865 * (uint32_t)(VPRIM_MAX_mV - Vcap_mV)) + 2048) / 4096);
+    if (Vcap_mV < settings.vprim_min_mV) Vcap_mV = settings.vprim_min_mV;
+    else if (Vcap_mV > settings.vprim_max_mV) Vcap_mV = settings.vprim_max_mV;
+    return (uint16_t)(((vprim_dac_scale * (uint32_t)(settings.vprim_max_mV - Vcap_mV)) + 2048) / 4096);
 }
 
 
@@ -60,7 +111,7 @@ void Do_MX_GPIO_Init_2()
 	  if (HAL_GPIO_ReadPin(PUSHBUTTON_PIN_GPIO_Port, PUSHBUTTON_PIN_Pin)) {
 	      uint32_t const *const SYS_MEM = (uint32_t *)0x1FFF0000;
 	      __set_MSP(SYS_MEM[0]);                  // Set up the bootloader's stackpointer.
-	      void (*startBootLoader)(void) = (void (*)(void)) SYS_MEM[1];
+	      void (*startBootLoader)(void) = (void (*)(void))(uintptr_t) SYS_MEM[1];	//through uintptr_t, so a 64 bit host build doesn't warn
 	      startBootLoader();                      // This call does not return.
 	  }
 
@@ -72,38 +123,86 @@ void Do_MX_GPIO_Init_2()
 //Implement all the USER CODE sections of the CubeMX generated code here, to make testing on Nucleo board easier.
 void Do_User_Code_Begin_While()
 {
+  ADC_ChannelConfTypeDef adc_channel = {0};
+
   //HAL_TIM_Base_Start_IT(&htim14);		//Tim14 set with /32 prescalar so should be 1us per clock.
 
   global_vars_init();   //TODO Run an Init() for our global variables. Check all variables, esp recently added ones, have been properly initialized.
+  store_init();			//find what is saved in flash
+  settings_init();
+  TRIAC_1_GPIO_Port->BSRR=output_off.triacs;		//MX_GPIO_Init() leaves the triac pins low, which is on
+  //RX DMA goes round usart_buffer without stopping. CubeMX has it as a normal (one shot) channel, so change that here.
+  //The half and full transfer interrupts stay on, they are what tell usart_rx_poll() about bytes in the middle of a long run
+  hdma_lpuart1_rx.Init.Mode = DMA_CIRCULAR;
+  if (HAL_DMA_Init(&hdma_lpuart1_rx) != HAL_OK)
+  {
+	  Error_Handler();
+  }
+  //CubeMX leaves the LPUART1 FIFOs off. They go on here, with the same 1/8 thresholds usart_set_baud() sets at the other rates
+  if (HAL_UARTEx_SetTxFifoThreshold(&hlpuart1, UART_TXFIFO_THRESHOLD_1_8) != HAL_OK ||
+		  HAL_UARTEx_SetRxFifoThreshold(&hlpuart1, UART_RXFIFO_THRESHOLD_1_8) != HAL_OK || HAL_UARTEx_EnableFifoMode(&hlpuart1) != HAL_OK)
+  {
+	  Error_Handler();
+  }
   HAL_UARTEx_ReceiveToIdle_DMA(&hlpuart1, usart_buffer, USART_BUFFER_SIZE);
-  __HAL_DMA_DISABLE_IT(&hdma_lpuart1_rx, DMA_IT_HT);
+  HAL_TIM_Base_Start(&htim2);		//free running at the core clock, for timing the interrupts and for timebase_us()
+
+  //CubeMX has the ADC scanning continuously. Make it one scan per trigger instead, so the current sense (rank 1) is sampled at a
+  //known point in a pulse: the pulses start the scans, see adc_pump(). Each reading is 4 samples averaged in hardware.
+  //Current sense gets a short sampling time so it is measured near the trigger, and the pot joins the other two voltages on
+  //the second one. Those are filtered afterwards, so they don't need the full 160.5 cycles, and at 39.5 a scan takes about
+  //90us. That is short enough for a scan in every pulse up to 10kHz
+  hadc1.Init.ContinuousConvMode = DISABLE;
+  hadc1.Init.SamplingTimeCommon1 = ADC_SAMPLETIME_12CYCLES_5;
+  hadc1.Init.SamplingTimeCommon2 = ADC_SAMPLETIME_39CYCLES_5;
+  hadc1.Init.OversamplingMode = ENABLE;
+  hadc1.Init.Oversampling.Ratio = ADC_OVERSAMPLING_RATIO_4;
+  hadc1.Init.Oversampling.RightBitShift = ADC_RIGHTBITSHIFT_2;		//sum of 4, back to 12 bits
+  hadc1.Init.Oversampling.TriggeredMode = ADC_TRIGGEREDMODE_SINGLE_TRIGGER;
+#if PULSE_ENGINE_TIM1
+  hadc1.Init.ExternalTrigConv = ADC_EXTERNALTRIG_T1_CC4;		//TIM1 channel 4 is set a little way into each pulse, see tim1_pulse_update()
+  hadc1.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_RISING;
+#endif
+  if (HAL_ADC_Init(&hadc1) != HAL_OK)
+  {
+	  Error_Handler();
+  }
+  adc_channel.Channel = ADC_CHANNEL_7;
+  adc_channel.Rank = ADC_REGULAR_RANK_4;
+  adc_channel.SamplingTime = ADC_SAMPLINGTIME_COMMON_2;
+  if (HAL_ADC_ConfigChannel(&hadc1, &adc_channel) != HAL_OK)
+  {
+	  Error_Handler();
+  }
   HAL_ADCEx_Calibration_Start(&hadc1);
   //On NeoDK board: PA0= Current sense; PA1= capacitor bank voltage; PA6=battery voltage; PA7= potentiometer voltage)
   __HAL_ADC_DISABLE_IT(&hadc1, ADC_IT_EOC | ADC_IT_EOS | ADC_IT_OVR); //disable ADC interrupts
-  HAL_ADC_Start_DMA(&hadc1, (uint32_t *)&adc_buffer, 4);		//AFAIK, The DMA is going to cycle through the 4 ADC channels  indefinitely in the background, and we can just get the value from the buffer for the last sampled value, at any time.
+#if !PULSE_ENGINE_TIM1
+  adc.polling=1;		//with software triggering, HAL_ADC_Start_DMA() starts the first scan itself. It isn't a pulse's
+#endif
+  HAL_ADC_Start_DMA(&hadc1, (uint32_t *)adc_buffer, ADC_SCANS*ADC_CHANNELS);		//circular, with the half and full transfer interrupts at the end of each scan. Starts the first one
 
   HAL_DAC_Start(&hdac1, DAC_CHANNEL_2);
+#if PULSE_ENGINE_TIM1
+  tim1_pulse_engine_init();
+#endif
   HAL_Delay(50);	//TODO: Check if this is enough time for the ADC to calibrate and get the first batch of samples.
 
   //enable the buck
-  HAL_GPIO_WritePin(BUCK_EN_GPIO_Port, BUCK_EN_Pin, GPIO_PIN_SET);
+  power_wake();
 
+  pattern_run_saved();	//if there is a pattern in flash, it starts on the first pass of the main loop
 
 }
 
 void Do_User_Code_While_1()
 {
-	uint32_t modulated_period=0;
-	uint32_t modulated_pw=0;
-	uint32_t modulated_v=0;
-	uint32_t angle;
-	uint32_t time_in_burst;
-	uint16_t ADC_batt_voltage=0;
-	uint16_t ADC_cap_voltage=0;
+	uint64_t time_in_burst;			//microseconds
+	uint64_t burst_on_us=0;			//the burst's duration, and its duration and pause, in microseconds. Worked out as it starts
+	uint64_t burst_total_us=0;
 	uint16_t ADC_pot=0;
-//	uint16_t ADC_current=0;
-	uint32_t DAC_value=0;
-	uint32_t loop_count=0;
+
+	profile.loop_started=htim2.Instance->CNT;
 
     // ----------------------
 	// This is the main loop.
@@ -111,170 +210,74 @@ void Do_User_Code_While_1()
 	while (1)		//repeating the while(1) here so we don't end up jumping to this function from main.c every loop.
 	{
 
-		loop_count++;
+		profile_pass_end();		//the last pass, if it didn't end in sleep
+		profile.loop_started=htim2.Instance->CNT;
+		profile.slept=0;
 
-		time_in_burst=HAL_GetTick()-tick_burst_started_at;  //how far along we are in the burst, in milliseconds
-		ADC_batt_voltage=adc_buffer[2] / 31;		// 4096 = 3.3V. Voltage divider is 3:1 or 25%. so / 4096 * 3.3 * 4 = /31.03 (result in 0.1 volts, so 133 - 13.3V)
-		ADC_cap_voltage=adc_buffer[1] / 31;
-		ADC_pot=adc_buffer[3] / 41;		//A level from 0 to 100
-//		ADC_current=adc_buffer[0];  //not sure on the scaling of this yet.
+		event_pump();		//do whatever the interrupts have left for us, like frames that have come in, and ADC scans
+		adc_poll();			//and if the pulses aren't starting scans, start one
+		telemetry_poll();	//the host's readings, if they're due
+		profile_poll();		//and the loop and interrupt timings, if it asked for them
+		baud_poll();		//a serial rate change the host has asked for, or going back from one that isn't working
+		pattern_step();		//if a pattern is running, top the burst queue up from it
 
-		//Set the output voltage. TODO: ramp the voltage up over time.
-		ADC_pot=30;			//hard code this for now. Need to solder a lead onto PA4 on the NeoDK - not an easy task. Then connect that to pot - will need to be in box by then.
-		DAC_value=Vcap_mV_ToDacVal((uint16_t)pulse_running.volts*ADC_pot);  //works out well, because pulse_running.volts is specified in 0.1V, so 15 = 1.5V. To convert to millivolts for the function, we would x100. But we have a 0 to 100 value from the pot, so if we multiply by that instead, we get our maximum voltage limited by the pot
-		HAL_DAC_SetValue(&hdac1, DAC_CHANNEL_2, DAC_ALIGN_12B_R, DAC_value);
+		time_in_burst=timebase_us()-burst_started_us;  //how far along we are in the burst
+		ADC_pot=adc.pot;		//A level from 0 to 100
+
+		//Set the output voltage, ramped
+		ADC_pot=settings.levels[settings.level];	//the saved power level, rather than the pot. Need to solder a lead onto PA4 on the NeoDK - not an easy task. Then connect that to pot - will need to be in box by then.
+		vprim_update((uint16_t)pulse_running.volts*ADC_pot);  //works out well, because pulse_running.volts is specified in 0.1V, so 15 = 1.5V. To convert to millivolts for the function, we would x100. But we have a 0 to 100 value from the pot, so if we multiply by that instead, we get our maximum voltage limited by the pot
 
 		//flash the LED so we know we're not frozen
 		if (HAL_GetTick() > LED_timer) {
 			LED_timer=HAL_GetTick()+500;
+			HAL_GPIO_TogglePin(LED_1_GPIO_Port, LED_1_Pin);		//battery and capacitor voltages go to the host in the telemetry now
 			HAL_GPIO_TogglePin(LED_1_GPIO_Port, LED_1_Pin);
-			//rt_Msg_size=sprintf ((char*)rt_Msg,"Batt V is %u . \n",ADC_batt_voltage);
-			//uart_buffer_write(rt_Msg, rt_Msg_size);
-			//rt_Msg_size=sprintf ((char*)rt_Msg,"Cap V is %u . \n",ADC_cap_voltage);
-			//uart_buffer_write(rt_Msg, rt_Msg_size);
-			HAL_GPIO_TogglePin(LED_1_GPIO_Port, LED_1_Pin);
-
-			//rt_Msg_size=sprintf ((char*)rt_Msg,"We did %u loops. \n",(uint16_t)loop_count);
-			//uart_buffer_write(rt_Msg, rt_Msg_size);
-			loop_count=0;
 		}
 
 		if (in_a_burst) {
 			//has burst time finished?
-			if ((time_in_burst) > (current_burst.duration+current_burst.pause_after))
+			if (time_in_burst > burst_total_us)
 			{
 				if (current_burst.repetitions>0)
 				{
+					//start the modulation over, like the burst itself. Hold the interrupt in its off branch while the slots are redone (it normally is already, from the pause)
+					pulse_running.stopped=1;
+					modulators_init(&current_burst);
+					pulse_slots_restart();
 					pulse_running.stopped=0;
 					current_burst.repetitions--;
-					tick_burst_started_at=HAL_GetTick();
-					rt_Msg_size=sprintf ((char*)rt_Msg,"Repeating burst. ");
-					uart_buffer_write(rt_Msg, rt_Msg_size);
+					burst_started_us=timebase_us();
+					status_send(STATUS_BURST_REPEATED);
 				}	else
 				{
 					in_a_burst=0;
-					rt_Msg_size=sprintf ((char*)rt_Msg,"Burst complete. ");
-					uart_buffer_write(rt_Msg, rt_Msg_size);
+					power.idle_since=HAL_GetTick();
+					status_send(STATUS_BURST_DONE);
 					continue;
 				}
 			}
 			else { //still in burst, but are in pause period at end?
-				if ((time_in_burst) > current_burst.duration)
+				if (time_in_burst > burst_on_us)
 				{
-					//we are in the pause after burst. This will run multiple times throughout the pause,
+					//we are in the pause after burst. This will run multiple times throughout the pause, waking each tick
 					pulse_running.stopped=1;
+					power_sleep();
 				} else
 				{
-					// Do the modulations
-
-					//modulate period (frequency)
-					angle=(time_in_burst % current_burst.period_mod_freq);
-					angle=angle*360;
-					angle=angle / current_burst.period_mod_freq;
-
-					//period_mod_waveform;	//0 = none, 1 = sine, 2 = sawtooth, 3 = triangle, 4 = square
-					//modulated_period :
-					switch (current_burst.period_mod_waveform)	{
-							case 1: {
-								modulated_period = fast_sine (angle);
-								modulated_period=(current_burst.period_mod_min-current_burst.period)*modulated_period;
-								modulated_period=current_burst.period+(modulated_period/1000);
-								break;
-							}
-							case 2: {
-								modulated_period = sawtooth_wave(angle);
-								modulated_period=(current_burst.period_mod_min-current_burst.period)*modulated_period;
-								modulated_period=current_burst.period+(modulated_period/1000);
-								break;
-							}
-							case 3: {
-								modulated_period = triangle_wave(angle);
-								modulated_period=(current_burst.period_mod_min-current_burst.period)*modulated_period;
-								modulated_period=current_burst.period+(modulated_period/1000);
-								break; }
-							case 4: {
-								modulated_period = square_wave(angle);
-								modulated_period=(current_burst.period_mod_min-current_burst.period)*modulated_period;
-								modulated_period=current_burst.period+(modulated_period/1000);
-								break; }
-							default: {modulated_period=current_burst.period; }
-					}
-
-					//pulse_running.off_time=modulated_period-current_burst.pw;
-
-					//modulate pulse width
-					angle=(time_in_burst % current_burst.pw_mod_freq);
-					angle=angle*360;
-					angle=angle / current_burst.pw_mod_freq;
-
-					//period_mod_waveform;	//0 = none, 1 = sine, 2 = sawtooth, 3 = triangle, 4 = square
-					//modulated_period :
-					switch (current_burst.pw_mod_waveform)	{
-							case 1: {
-								modulated_pw = fast_sine (angle);
-								modulated_pw=(current_burst.pw-current_burst.pw_mod_min)*modulated_pw;
-								modulated_pw=current_burst.pw_mod_min+(modulated_pw/1000);
-								break;
-							}
-							case 2: {
-								modulated_pw = sawtooth_wave(angle);
-								modulated_pw=(current_burst.pw-current_burst.pw_mod_min)*modulated_pw;
-								modulated_pw=current_burst.pw_mod_min+(modulated_pw/1000);
-								break;
-							}
-							case 3: {
-								modulated_pw = triangle_wave(angle);
-								modulated_pw=(current_burst.pw-current_burst.pw_mod_min)*modulated_pw;
-								modulated_pw=current_burst.pw_mod_min+(modulated_pw/1000);
-								break; }
-							case 4: {
-								modulated_pw = square_wave(angle);
-								modulated_pw=(current_burst.pw-current_burst.pw_mod_min)*modulated_pw;
-								modulated_pw=current_burst.pw_mod_min+(modulated_pw/1000);
-								break; }
-							default: {modulated_pw=current_burst.pw; }
-					}
-					pulse_running.on_time=modulated_pw;
-					pulse_running.off_time=modulated_period-modulated_pw;
-
-					//modulate voltage
-					//TODO voltage can't be changed quickly, so some limits may need to be imposed on the frequency of the modulator. Even 1Hz is probably too fast.
-					angle=(time_in_burst % current_burst.v_mod_freq);
-					angle=angle*360;
-					angle=angle / current_burst.v_mod_freq;
-
-					//waveform;	//0 = none, 1 = sine, 2 = sawtooth, 3 = triangle, 4 = square
-					switch (current_burst.v_mod_waveform)	{
-							case 1: {
-								modulated_v = fast_sine (angle);
-								modulated_v=(current_burst.volts-current_burst.v_mod_min)*modulated_v;
-								modulated_v=current_burst.v_mod_min+(modulated_v/1000);
-								break;
-							}
-							case 2: {
-								modulated_v = sawtooth_wave(angle);
-								modulated_v=(current_burst.volts-current_burst.v_mod_min)*modulated_v;
-								modulated_v=current_burst.v_mod_min+(modulated_v/1000);
-								break;
-							}
-							case 3: {
-								modulated_v = triangle_wave(angle);
-								modulated_v=(current_burst.volts-current_burst.v_mod_min)*modulated_v;
-								modulated_v=current_burst.v_mod_min+(modulated_v/1000);
-								break; }
-							case 4: {
-								modulated_v = square_wave(angle);
-								modulated_v=(current_burst.volts-current_burst.v_mod_min)*modulated_v;
-								modulated_v=current_burst.v_mod_min+(modulated_v/1000);
-								break; }
-							default: {modulated_v=current_burst.volts; }
-					}
-					pulse_running.volts=modulated_v;
+					// Do the modulations. These are worked out one pulse ahead, for the time that pulse will start, and handed to the pulse interrupt in the spare slot.
+					// The interrupt takes it at the start of the next on time, and then the slot is free for the pulse after that.
+					// Voltage rides along in the slot too, the interrupt copies it to pulse_running.volts for the DAC code above.
+					//Voltage can't be changed quickly: the DAC setpoint ramps at settings.slew_mV_per_ms (see vprim_update()), so fast voltage modulation comes out smoothed.
+					if (!pulse_slots.ready) pulse_slot_fill();
 
 					//TODO: modulate polarity
 					// for now, I think polarity should be alternated by default, and then either 2 or 3 consecutive pulses of the same polarity and then the same number in reverse. Theoretically this could be achieved with one of the modulators
 					// so if pol_mod_frequency:  1= -_-_-_,   2= --_ _--_ _--_ _,   3=  ---_ _ _---_ _ _---_ _ _. Limit to these 3 options for now.
 					// Okay, based on the above decision, polarity modulation is done in the pulse interrupt, with a counter that counts down and resets to current_buffer.pol_mod_freq.
+
+					//nothing else to do until the interrupt takes the slot (or the next tick), so sleep rather than spin
+					power_sleep_while(&pulse_slots.ready);
 				}
 			}
 		} else
@@ -283,26 +286,36 @@ void Do_User_Code_While_1()
 				//nothing to do - make sure all outputs are off
 				pulse_running.stopped=1;
 				pulse_running.volts=5;
-				while (pulse_running.currently_on) {};	//wait until interrupt timer turns off before disabling interrupt.
-				HAL_TIM_Base_Stop_IT(&htim14);
+				//wait until interrupt timer turns off before disabling interrupt. With TIM1 that can be a couple of periods, so keep
+				//taking frames meanwhile: at the faster serial rates the receive buffer doesn't last that long
+				while (pulse_running.currently_on) { event_pump(); power_sleep_while(&pulse_running.currently_on); };
+				pulse_engine_stop();
+				pulse_running.output_triacs=0;	//the last pulse was a while ago, so the triacs are released and have dropped out
+				store_flush();		//with nothing switching, it's safe to stall on flash
+				if (!pattern.running) power_idle();		//a pattern that left the queue empty is only part way through its instructions
 				continue;
 			} else
 			{
-				burst_fifo_dequeue(&burst_buffer, &current_burst);
+				pulse_running.stopped=1;		//keep the interrupt away from the slots until the first pulse is in place
+				burst_record_unpack(burst_fifo_peek(&burst_buffer), &current_burst);
+				burst_fifo_release(&burst_buffer);
+				if (!pattern.running) frame_credit();		//tell the host there's room for another one. Not while the pattern is the one filling the queue
+				telemetry.bursts++;
+				modulators_init(&current_burst);
+				pulse_slots_restart();
 				in_a_burst=1;
-				tick_burst_started_at=HAL_GetTick();
-				pulse_running.currently_on=0;
-				pulse_running.on_time=current_burst.pw;
-				pulse_running.off_time=current_burst.period-current_burst.pw;
-				pulse_running.output_triacs=1; //AB
+				burst_on_us=(uint64_t)current_burst.duration*1000;
+				burst_total_us=burst_on_us+(uint32_t)current_burst.pause_after*1000;
+				adc.current_max=0;
+				burst_started_us=timebase_us();		//currently_on is left alone: with bursts back to back a pulse can be on right now, and the interrupt has to see that to end it
 				pulse_running.polarity=1;
 				pulse_running.volts=current_burst.volts;
 				pulse_running.stopped=0;
 
-				HAL_TIM_Base_Start_IT(&htim14);
+				power_wake();
+				pulse_engine_start();
 
-				strcpy((char*)rt_Msg, "Burst processing... ");
-				uart_buffer_write(rt_Msg, 20);
+				status_send(STATUS_BURST_STARTED);
 
 			}
 		}
@@ -317,45 +330,80 @@ void Do_User_Code_While_1()
 // FIFO buffer for bursts coming in over USART
 // ---------------------------------------------
 
+// Bursts are queued as _burst_records of varying size, one after another in a byte ring. The producer reserves room for the
+// next record, the frame decoder writes it straight in, and commit hands it over. The consumer peeks at the oldest record and
+// releases it once it has been unpacked. A record is never split round the end of the buffer: if it doesn't fit in what's left,
+// that bit is marked unused and the record goes at the start. Each index has one writer, so neither side needs to mask interrupts.
+
+static _burst_record *burst_fifo_at(BURST_FIFO_Buffer *fifo, uint16_t index) {
+    return (_burst_record *)((uint8_t *)fifo->buffer + (index & (BURST_FIFO_BYTES-1)));
+}
+
 // Initialize the FIFO buffer
 void burst_fifo_init(BURST_FIFO_Buffer *fifo) {
     fifo->head = 0;
     fifo->tail = 0;
-    fifo->count = 0;
+    fifo->skip = 0;
 }
 
-// Check if the buffer is full
-bool burst_fifo_is_full(BURST_FIFO_Buffer *fifo) {
-    return fifo->count == BURST_FIFO_BUFFER_SIZE;
+// Free slots, as told to the host: how many of the biggest records are sure to fit. Smaller ones can only do better
+uint8_t burst_fifo_free(BURST_FIFO_Buffer *fifo) {
+    uint16_t free_bytes = BURST_FIFO_BYTES - (uint16_t)(fifo->head - fifo->tail);
+    uint16_t to_end = BURST_FIFO_BYTES - (fifo->head & (BURST_FIFO_BYTES-1));
+
+    if (free_bytes <= to_end) {
+        return free_bytes / BURST_RECORD_MAX;
+    }
+    return to_end / BURST_RECORD_MAX + (free_bytes - to_end) / BURST_RECORD_MAX;		//records before the end, and from the start up to tail
 }
 
 // Check if the buffer is empty
 bool fifo_is_empty(BURST_FIFO_Buffer *fifo) {
-    return fifo->count == 0;
+    return fifo->head == fifo->tail;
 }
 
-// Add an item to the buffer (returns true if successful, false if buffer is full)
-uint8_t rt_Ack2[5] = "ACK2";
-bool burst_fifo_enqueue(BURST_FIFO_Buffer *fifo, _burst item) {
-    if (burst_fifo_is_full(fifo)) {
-        return false;  // Buffer overflow
+// Producer: room for a record of size bytes (see burst_record_size()), or NULL if the buffer is full. It isn't queued until burst_fifo_commit()
+_burst_record *burst_fifo_reserve(BURST_FIFO_Buffer *fifo, uint8_t size) {
+    uint16_t to_end = BURST_FIFO_BYTES - (fifo->head & (BURST_FIFO_BYTES-1));
+
+    fifo->skip = (to_end < size) ? to_end : 0;
+    if ((uint16_t)(fifo->head - fifo->tail) + fifo->skip + size > BURST_FIFO_BYTES) {
+        return NULL;  // Buffer overflow
     }
-    fifo->buffer[fifo->head] = item;
-    fifo->head = (fifo->head + 1) % BURST_FIFO_BUFFER_SIZE;
-    fifo->count++;
-	HAL_UART_Transmit_DMA(&hlpuart1, &rt_Ack2[0], 4);
-    return true;
+    if (fifo->skip) burst_fifo_at(fifo, fifo->head)->format = 0;		//past head, so the consumer won't look until the commit
+    return burst_fifo_at(fifo, fifo->head + fifo->skip);
+}
+
+// Producer: queue the record written into the reserved room
+void burst_fifo_commit(BURST_FIFO_Buffer *fifo) {
+    uint16_t size = burst_fifo_at(fifo, fifo->head + fifo->skip)->size;
+
+    __DMB();			//the record has to be all there before the consumer can see the new head
+    fifo->head += fifo->skip + size;
 }
 
-// Remove an item from the buffer (returns true if successful, false if buffer is empty)
-bool burst_fifo_dequeue(BURST_FIFO_Buffer *fifo, _burst *item) {
+// Consumer: the oldest record, or NULL if there's nothing queued
+_burst_record *burst_fifo_peek(BURST_FIFO_Buffer *fifo) {
     if (fifo_is_empty(fifo)) {
-        return false;  // Buffer underflow
+        return NULL;  // Buffer underflow
     }
-    *item = fifo->buffer[fifo->tail];
-    fifo->tail = (fifo->tail + 1) % BURST_FIFO_BUFFER_SIZE;
-    fifo->count--;
-    return true;
+    if (!burst_fifo_at(fifo, fifo->tail)->format) {
+        fifo->tail += BURST_FIFO_BYTES - (fifo->tail & (BURST_FIFO_BYTES-1));		//unused to the end, the record is at the start
+    }
+    return burst_fifo_at(fifo, fifo->tail);
+}
+
+// Consumer: finished with the record burst_fifo_peek() gave, the producer can have its room
+void burst_fifo_release(BURST_FIFO_Buffer *fifo) {
+    uint16_t size = burst_fifo_at(fifo, fifo->tail)->size;
+
+    __DMB();			//done reading it before the producer can write over it
+    fifo->tail += size;
+}
+
+// Consumer: drop everything, including the burst that is playing. Only from the main loop, where the consumer runs
+void burst_fifo_flush(BURST_FIFO_Buffer *fifo) {
+    fifo->tail = fifo->head;
 }
 
 
@@ -366,319 +414,2097 @@ bool burst_fifo_dequeue(BURST_FIFO_Buffer *fifo, _burst *item) {
 // ------------------------------
 //It turns the outputs on, and then resets the timer for itself for the duration of the pulse width, then turns off and sets the timer for the off time.
 //It handles polarity, and will turn off if pulse_running.stopped is set.
-void HAL_TIM_PeriodElapsedCallback (TIM_HandleTypeDef *htim)
+//At the start of each on time it swaps in the next pulse slot, if the main loop has filled it in. If not, the last pulse is repeated.
+//When the next slot is on other triacs and the off time was too short for the old ones to drop out, it stays off a bit longer first.
+static void pulse_timer_interrupt(TIM_HandleTypeDef *htim)
 {
+	const _output_state *out;
+	volatile _pulse_slot *next;
+
+#if PULSE_ENGINE_TIM1
+	if (htim == &htim1) tim1_pulse_update();
+#endif
 	if (htim == &htim14) // pulse on/off timer
 	{
 		HAL_TIM_Base_Stop(&htim14);			//stop the timer. we will restart it manually later
 		if (pulse_running.currently_on  || pulse_running.stopped)
 		{
 			//HAL_GPIO_WritePin(LED_1_GPIO_Port, LED_1_Pin, GPIO_PIN_RESET); //simple feedback through LED for now. TODO: invent a better visual feedback system, possibly with bar LEDs.
-			//switch off. just turn off triacs and Q1 and Q2
-			HAL_GPIO_WritePin(TRIAC_1_GPIO_Port, TRIAC_1_Pin, GPIO_PIN_RESET);
-			HAL_GPIO_WritePin(TRIAC_2_GPIO_Port, TRIAC_2_Pin, GPIO_PIN_RESET);
-			HAL_GPIO_WritePin(TRIAC_3_GPIO_Port, TRIAC_2_Pin, GPIO_PIN_RESET);
-			HAL_GPIO_WritePin(TRIAC_4_GPIO_Port, TRIAC_2_Pin, GPIO_PIN_RESET);
-			HAL_GPIO_WritePin(Q1_GPIO_Port, Q1_Pin, GPIO_PIN_RESET);
-			HAL_GPIO_WritePin(Q2_GPIO_Port, Q2_Pin, GPIO_PIN_RESET);
+			//switch off. just turn off Q1 and Q2, then the triacs
+			Q1_GPIO_Port->BSRR=output_off.bridge;
+			TRIAC_1_GPIO_Port->BSRR=output_off.triacs;
 
 			pulse_running.currently_on=0;
 			//restart Timer
-			htim14.Instance->ARR = pulse_running.off_time;
+			htim14.Instance->ARR = pulse_slots.slot[pulse_slots.active].off_time;
 			HAL_TIM_Base_Start(&htim14); HAL_TIM_Base_Start_IT(&htim14);
 		} else
 		{
 			//HAL_GPIO_WritePin(LED_1_GPIO_Port, LED_1_Pin, GPIO_PIN_SET); //debugging //debugging
 			//switch on
 
-			if (! pulse_running.polarity_switch_count-- )
+			if (pulse_slots.ready)
 			{
-				pulse_running.polarity_switch_count=current_burst.pol_mod_freq;
-				pulse_running.polarity=pulse_running.polarity^1;
+				next=&pulse_slots.slot[pulse_slots.active^1];
+				//break before make. The triacs were released at the off edge, and count as route 0 (all off) once they've had ROUTE_DEADTIME_US
+				if (next->route!=pulse_running.output_triacs && pulse_running.output_triacs && pulse_slots.slot[pulse_slots.active].off_time<ROUTE_DEADTIME_US)
+				{
+					pulse_running.output_triacs=0;
+					htim14.Instance->ARR = ROUTE_DEADTIME_US-pulse_slots.slot[pulse_slots.active].off_time;
+					HAL_TIM_Base_Start(&htim14); HAL_TIM_Base_Start_IT(&htim14);
+					return;
+				}
+				pulse_slots.active^=1;
+				pulse_slots.ready=0;
+				pulse_running.volts=next->volts;
+				pulse_running.output_triacs=next->route;
 			}
 
-
-			if (pulse_running.polarity)
-			{
-				HAL_GPIO_WritePin(Q2_GPIO_Port, Q2_Pin, GPIO_PIN_RESET);
-				HAL_GPIO_WritePin(Q1_GPIO_Port, Q1_Pin, GPIO_PIN_SET);
-
-			} else
+			if (! pulse_running.polarity_switch_count-- )
 			{
-				HAL_GPIO_WritePin(Q1_GPIO_Port, Q1_Pin, GPIO_PIN_RESET);
-				HAL_GPIO_WritePin(Q2_GPIO_Port, Q2_Pin, GPIO_PIN_SET);
+				pulse_running.polarity_switch_count=current_burst.pol_mod_freq;
+				pulse_running.polarity=pulse_running.polarity^1;
 			}
 
-			// turn triacs on (for now just hardcode A and B). Triacs are wired active low, so reset pins to turn on.
-			// not sure if this should be done here, as I assume the triacs will retrigger themselves as long as the optoisolating LED is on
-			// If in future we do modulation between outputs, then we'd need to turn off the triacs and the mosfets to break the triac holding current, then turn on the triacs we want before turning the mosfets on.
 
-			HAL_GPIO_WritePin(TRIAC_3_GPIO_Port, TRIAC_2_Pin, GPIO_PIN_SET);
-			HAL_GPIO_WritePin(TRIAC_4_GPIO_Port, TRIAC_2_Pin, GPIO_PIN_SET);
-			HAL_GPIO_WritePin(TRIAC_1_GPIO_Port, TRIAC_1_Pin, GPIO_PIN_RESET);
-			HAL_GPIO_WritePin(TRIAC_2_GPIO_Port, TRIAC_2_Pin, GPIO_PIN_RESET);
+			//triacs first, then the side of the H-bridge for this polarity
+			out=&output_on[pulse_running.output_triacs][pulse_running.polarity];
+			TRIAC_1_GPIO_Port->BSRR=out->triacs;
+			Q1_GPIO_Port->BSRR=out->bridge;
+			LL_ADC_REG_StartConversion(hadc1.Instance);		//current sense is first in the scan, so it is sampled a couple of us in. Does nothing if a scan is still going
 
 			pulse_running.currently_on=1;
 
 			//set the timer to trigger this interrupt again
-			htim14.Instance->ARR = pulse_running.on_time;
+			htim14.Instance->ARR = pulse_slots.slot[pulse_slots.active].on_time;
 			HAL_TIM_Base_Start(&htim14); HAL_TIM_Base_Start_IT(&htim14);
 		}
 
 	}
 }
 
+void HAL_TIM_PeriodElapsedCallback (TIM_HandleTypeDef *htim)
+{
+	uint32_t started=htim2.Instance->CNT;
+	uint16_t late_us=htim->Instance->CNT;		//the counter went back to 0 at the update, and has been counting in us since
 
+	pulse_timer_interrupt(htim);
+	profile_add(&profile.stats[PROFILE_PULSE_LATE], (uint32_t)late_us*CORE_CYCLES_PER_US);
+	isr_time(PROFILE_PULSE, started);
+}
 
+// Output states, as BSRR words. Q1/Q2 are both on GPIOA and the four triacs are all on GPIOB, so any state of the
+// outputs is one store to each port, and nothing passes through a half switched state in between.
+// Triacs are wired active low, so reset pins to turn on. The letters in the routes are the triacs: A = TRIAC_1 ... D = TRIAC_4.
+// A triac stays on while current flows through it, whatever its gate is doing. So to move to other triacs, the bridge goes off and the
+// triacs are released, and the new ones aren't triggered until ROUTE_DEADTIME_US later. Both pulse engines do that, see the route checks in them.
+#define TRIAC_A		TRIAC_1_Pin
+#define TRIAC_B		TRIAC_2_Pin
+#define TRIAC_C		TRIAC_3_Pin
+#define TRIAC_D		TRIAC_4_Pin
+#define TRIACS_ALL	(TRIAC_A|TRIAC_B|TRIAC_C|TRIAC_D)
+
+#define TRIACS_BSRR(on)		((uint32_t)(on) << 16 | (TRIACS_ALL & ~(on)))		//reset (turn on) the ones we want, set (release) the rest
+#define BRIDGE_BSRR(on, off)	((uint32_t)(off) << 16 | (on))
+#define ROUTE(triacs)		{ { BRIDGE_BSRR(Q2_Pin, Q1_Pin), TRIACS_BSRR(triacs) }, { BRIDGE_BSRR(Q1_Pin, Q2_Pin), TRIACS_BSRR(triacs) } }		//[polarity]: 0 = Q2, 1 = Q1
+
+//[pulse_running.output_triacs][pulse_running.polarity]
+const _output_state output_on[OUTPUT_ROUTES][2] = {
+	ROUTE(0),								//all off
+	ROUTE(TRIAC_A|TRIAC_B),
+	ROUTE(TRIAC_C|TRIAC_D),
+	ROUTE(TRIAC_A|TRIAC_D),
+	ROUTE(TRIAC_B|TRIAC_C),
+	ROUTE(TRIAC_A|TRIAC_B|TRIAC_C),
+	ROUTE(TRIAC_A|TRIAC_B|TRIAC_D),
+	ROUTE(TRIAC_C|TRIAC_D|TRIAC_A),
+	ROUTE(TRIAC_C|TRIAC_D|TRIAC_B),
+	ROUTE(TRIAC_A|TRIAC_B|TRIAC_C|TRIAC_D),
+};
 
+const _output_state output_off = { BRIDGE_BSRR(0, Q1_Pin|Q2_Pin), TRIACS_BSRR(0) };
 
+//start and stop whichever pulse engine is built in. Starting one that is already going does nothing.
+void pulse_engine_start()
+{
+#if PULSE_ENGINE_TIM1
+	if (htim1.Instance->CR1 & TIM_CR1_CEN) return;
+	tim1_pulse_queued=0;
+	htim1.Instance->ARR=TIM1_START_DELAY;
+	htim1.Instance->CCR1=TIM1_NO_PULSE;
+	htim1.Instance->CCR2=TIM1_NO_PULSE;
+	htim1.Instance->EGR=TIM_EGR_UG;			//load those and clear the counter. URS is set, so this doesn't interrupt
+	__HAL_TIM_ENABLE_IT(&htim1, TIM_IT_UPDATE);
+	htim1.Instance->CR1|=TIM_CR1_CEN;
+#else
+	HAL_TIM_Base_Start_IT(&htim14);
+#endif
+}
 
-void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
+void pulse_engine_stop()
 {
+#if PULSE_ENGINE_TIM1
+	__HAL_TIM_DISABLE_IT(&htim1, TIM_IT_UPDATE);
+	htim1.Instance->CR1&=~TIM_CR1_CEN;		//not __HAL_TIM_DISABLE(), which leaves a timer with enabled channels running. The outputs stay enabled, and off.
+#else
+	HAL_TIM_Base_Stop_IT(&htim14);
+#endif
+}
 
-	if (huart->Instance==LPUART1)
+
+#if PULSE_ENGINE_TIM1
+// ---------------------------------------------------
+// Hardware pulse engine: TIM1 makes the Q1/Q2 edges
+// ---------------------------------------------------
+// TIM1 counts in us like TIM14. Channels 1 and 2 drive Q1 (PA8) and Q2 (PA9) in PWM mode 2, so in every timer period the
+// output is off until the counter reaches CCR, then on until the end of the period. So CCR = off time and ARR+1 = off + on time.
+// ARR and the CCRs are preloaded, which means what the update interrupt writes is only picked up at the next update. The interrupt
+// is always setting up the period after the one that has just started, and however late it runs the edges stay where they are.
+// The channel for the other polarity gets a CCR past the end of the period, so it never turns on.
+
+void tim1_pulse_engine_init()
+{
+	GPIO_InitTypeDef GPIO_InitStruct = {0};
+	TIM_OC_InitTypeDef sConfigOC = {0};
+
+	__HAL_RCC_TIM1_CLK_ENABLE();
+	htim1.Instance = TIM1;
+	htim1.Init.Prescaler = 32 -1;		//1us per count, same as TIM14
+	htim1.Init.CounterMode = TIM_COUNTERMODE_UP;
+	htim1.Init.Period = TIM1_START_DELAY;
+	htim1.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+	htim1.Init.RepetitionCounter = 0;
+	htim1.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
+	if (HAL_TIM_PWM_Init(&htim1) != HAL_OK)
+	{
+		Error_Handler();
+	}
+	sConfigOC.OCMode = TIM_OCMODE_PWM2;
+	sConfigOC.Pulse = TIM1_NO_PULSE;
+	sConfigOC.OCPolarity = TIM_OCPOLARITY_HIGH;
+	sConfigOC.OCNPolarity = TIM_OCNPOLARITY_HIGH;
+	sConfigOC.OCFastMode = TIM_OCFAST_DISABLE;
+	sConfigOC.OCIdleState = TIM_OCIDLESTATE_RESET;
+	sConfigOC.OCNIdleState = TIM_OCNIDLESTATE_RESET;
+	if (HAL_TIM_PWM_ConfigChannel(&htim1, &sConfigOC, TIM_CHANNEL_1) != HAL_OK)
+	{
+		Error_Handler();
+	}
+	if (HAL_TIM_PWM_ConfigChannel(&htim1, &sConfigOC, TIM_CHANNEL_2) != HAL_OK)
+	{
+		Error_Handler();
+	}
+	//channel 4 has no pin. Its compare starts the ADC scans, ADC_CURRENT_DELAY_US into each pulse
+	if (HAL_TIM_PWM_ConfigChannel(&htim1, &sConfigOC, TIM_CHANNEL_4) != HAL_OK)
 	{
-		strcpy((char*)rt_Msg, "Got a packet. ");
-		uart_buffer_write(rt_Msg, 14);
+		Error_Handler();
+	}
+	htim1.Instance->CR1|=TIM_CR1_URS;		//only counter overflows make an update interrupt, not us setting UG
+	htim1.Instance->EGR=TIM_EGR_UG;			//the CCRs are preloaded, so until an update they are still 0, which is on in PWM mode 2. On both channels at once.
+
+	//enable the outputs (and MOE). This starts the counter too, so stop it again until there's a burst
+	HAL_TIM_PWM_Start(&htim1, TIM_CHANNEL_1);
+	HAL_TIM_PWM_Start(&htim1, TIM_CHANNEL_2);
+	htim1.Instance->CR1&=~TIM_CR1_CEN;
+
+	//hand Q1 and Q2 over from GPIO to TIM1
+	GPIO_InitStruct.Pin = Q1_Pin|Q2_Pin;
+	GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+	GPIO_InitStruct.Pull = GPIO_NOPULL;
+	GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+	GPIO_InitStruct.Alternate = GPIO_AF2_TIM1;
+	HAL_GPIO_Init(Q1_GPIO_Port, &GPIO_InitStruct);
+
+	HAL_NVIC_SetPriority(TIM1_BRK_UP_TRG_COM_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(TIM1_BRK_UP_TRG_COM_IRQn);
+}
 
-		if (Size==USART_BUFFER_SIZE)
-		{
-			if (1==1) 	//TODO: do checksum
-			{
-				if (usart_buffer[26]==0x01)	// is a special packet.  clear buffer and run this one immediately.
-				{
-					burst_fifo_init(&burst_buffer);
-					decode_burst_from_usart();
-					burst_fifo_enqueue (&burst_buffer, USART_burst);
-					in_a_burst=0;			//force this burst to run immediately
+//TIM1 isn't set up in CubeMX (it is done in tim1_pulse_engine_init()), so its interrupt handler lives here rather than in stm32g0xx_it.c
+void TIM1_BRK_UP_TRG_COM_IRQHandler(void)
+{
+	HAL_TIM_IRQHandler(&htim1);
+}
 
-					strcpy((char*)rt_Msg, "got quick packet. executing ");
-					uart_buffer_write(rt_Msg, 28);
+//Called once per pulse, at the start of each timer period, which is the start of the off time.
+void tim1_pulse_update()
+{
+	volatile _pulse_slot *pulse;
+	uint32_t off_time;
 
-					HAL_UARTEx_ReceiveToIdle_DMA(&hlpuart1, usart_buffer, USART_BUFFER_SIZE);
-					__HAL_DMA_DISABLE_IT(&hdma_lpuart1_rx, DMA_IT_HT);
-					return;
+	//the period that has just started was set up last time round. Its off time is now running, so this is when the triacs can change
+	pulse_running.currently_on=tim1_pulse_queued;
+	if (pulse_running.currently_on) TRIAC_1_GPIO_Port->BSRR=output_on[pulse_running.output_triacs][pulse_running.polarity].triacs;
+	else TRIAC_1_GPIO_Port->BSRR=output_off.triacs;
 
-				}
-				if (usart_buffer[26]==0x02)	// is a special packet.  emergency stop
-				{
-					//TODO: Emergency stop
-					return;
-				}
-				if (usart_buffer[26]==0x02)	// is a special packet.  update live parameters. At this stage just voltage.
-				{
-					decode_burst_from_usart();
-					current_burst.volts=USART_burst.volts;
-					current_burst.v_mod_min=USART_burst.v_mod_min;
+	if (!pulse_running.stopped && pulse_slots.ready)
+	{
+		pulse=&pulse_slots.slot[pulse_slots.active^1];
+		//break before make. If the next pulse is on other triacs and this period ends in a pulse on the old ones, put an empty period
+		//of ROUTE_DEADTIME_US in first. The old triacs are released at its update, and the new ones triggered at the update after
+		if (pulse->route!=pulse_running.output_triacs && pulse_running.output_triacs && pulse_running.currently_on)
+		{
+			pulse_running.output_triacs=0;
+			htim1.Instance->ARR=ROUTE_DEADTIME_US-1;
+			htim1.Instance->CCR1=TIM1_NO_PULSE;
+			htim1.Instance->CCR2=TIM1_NO_PULSE;
+			htim1.Instance->CCR4=TIM1_NO_PULSE;
+			tim1_pulse_queued=0;
+			return;
+		}
+		pulse_slots.active^=1;
+		pulse_slots.ready=0;
+		pulse_running.volts=pulse->volts;
+		pulse_running.output_triacs=pulse->route;
+	}
+	pulse=&pulse_slots.slot[pulse_slots.active];
 
+	off_time=pulse->off_time;
+	if (off_time < 1) off_time=1;			//the outputs have to drop at the update, or the triacs would be switched under load
+	if (off_time + pulse->on_time > TIM1_NO_PULSE) off_time=TIM1_NO_PULSE-pulse->on_time;	//16 bit timer, and keep ARR below TIM1_NO_PULSE
+	htim1.Instance->ARR=off_time+pulse->on_time-1;
 
-					HAL_UARTEx_ReceiveToIdle_DMA(&hlpuart1, usart_buffer, USART_BUFFER_SIZE);
-					__HAL_DMA_DISABLE_IT(&hdma_lpuart1_rx, DMA_IT_HT);
-					return;
-				}
-				if (burst_fifo_is_full(&burst_buffer))
-				{
-					strcpy((char*)rt_Msg, "Buffer full. Dropping data. ");
-					uart_buffer_write(rt_Msg, 28);
+	if (pulse_running.stopped)
+	{
+		//keep ticking over at the pulse rate with the outputs off
+		htim1.Instance->CCR1=TIM1_NO_PULSE;
+		htim1.Instance->CCR2=TIM1_NO_PULSE;
+		htim1.Instance->CCR4=TIM1_NO_PULSE;
+		tim1_pulse_queued=0;
+		return;
+	}
 
-					HAL_UARTEx_ReceiveToIdle_DMA(&hlpuart1, usart_buffer, USART_BUFFER_SIZE);
-					__HAL_DMA_DISABLE_IT(&hdma_lpuart1_rx, DMA_IT_HT);
-					return;
-				} else
-				{
-					decode_burst_from_usart();
-					burst_fifo_enqueue (&burst_buffer, USART_burst);
+	if (! pulse_running.polarity_switch_count-- )
+	{
+		pulse_running.polarity_switch_count=current_burst.pol_mod_freq;
+		pulse_running.polarity=pulse_running.polarity^1;
+	}
 
-					strcpy((char*)rt_Msg, "Adding to queue. ");
-					uart_buffer_write(rt_Msg, 17);
+	if (pulse_running.polarity)
+	{
+		htim1.Instance->CCR1=off_time;
+		htim1.Instance->CCR2=TIM1_NO_PULSE;
+	} else
+	{
+		htim1.Instance->CCR1=TIM1_NO_PULSE;
+		htim1.Instance->CCR2=off_time;
+	}
+	htim1.Instance->CCR4=off_time+ADC_CURRENT_DELAY_US;		//past ARR for a pulse shorter than that, so no scan
+	tim1_pulse_queued=(pulse->on_time!=0);
+}
+#endif
 
-					HAL_UARTEx_ReceiveToIdle_DMA(&hlpuart1, usart_buffer, USART_BUFFER_SIZE);
-					  __HAL_DMA_DISABLE_IT(&hdma_lpuart1_rx, DMA_IT_HT);
-					return;
-				}
-			} else
-			{
-				strcpy((char*)rt_Msg, "Failed Checksum. ");
-				uart_buffer_write(rt_Msg, 17);
 
-				HAL_UARTEx_ReceiveToIdle_DMA(&hlpuart1, usart_buffer, USART_BUFFER_SIZE);
-				  __HAL_DMA_DISABLE_IT(&hdma_lpuart1_rx, DMA_IT_HT);
-				return;
-			}
-		}
-		else
-		{
-			//packet wrong size
-			strcpy((char*)rt_Msg, "Bad sized packet. ");
-			uart_buffer_write(rt_Msg, 18);
 
-			HAL_UARTEx_ReceiveToIdle_DMA(&hlpuart1, usart_buffer, USART_BUFFER_SIZE);
-			  __HAL_DMA_DISABLE_IT(&hdma_lpuart1_rx, DMA_IT_HT);
-		}
 
-	}
 
-}
 
+// ----------------------------------------------
+// Work handed from the interrupts to the main loop
+// ----------------------------------------------
+// The interrupts keep to what can't wait: switching outputs, and noting where the DMA has got to. Anything that can wait a
+// main loop pass (parsing, queueing bursts, replies and messages) they leave for the main loop by posting an event. That keeps
+// them short, and they can't hold up the pulse interrupt for long.
 
-void global_vars_init()
+//from an interrupt. Masked, as the UART and DMA interrupts can be at different priorities, and one could land in the middle of another's |=
+void post_event(uint32_t event)
 {
-	USART_burst.duration=0;
-	USART_burst.pw=0;
-	USART_burst.period=0;
-	USART_burst.volts=0;
-//	USART_burst.polarity=0;
-	USART_burst.v_mod_waveform=0;
-	USART_burst.v_mod_freq=0;
-	USART_burst.v_mod_min=0;
-//	USART_burst.v_mod_max=0;
-	USART_burst.pw_mod_waveform=0;
-	USART_burst.pw_mod_freq=0;
-	USART_burst.pw_mod_min=0;
-//	USART_burst.pw_mod_max=0;
-	USART_burst.period_mod_waveform=0;
-	USART_burst.period_mod_freq=0;
-	USART_burst.period_mod_min=0;
-//	USART_burst.period_mod_max=0;
-//	USART_burst.pol_mod_waveform=0;
-	USART_burst.pol_mod_freq=0;
-	USART_burst.repetitions=0;
-	USART_burst.pause_after=0;
+	__disable_irq();
+	pending_events|=event;
+	__enable_irq();
+}
 
-	pulse_running.volts=5;		// or 0.5 volts
-	pulse_running.polarity=1;
-	pulse_running.output_triacs=1;	//0=all off, 1="AB", 2="CD", 3="AD", 4="BC", 5="ABC", 6="ABD", 7="CDA", 8="CDB", 9="ABCD"
-	pulse_running.on_time=0;
-	pulse_running.off_time=65000;
-	pulse_running.currently_on=0;	//0= false; 1=true
-	pulse_running.stopped=1;
-	pulse_running.polarity_switch_count=0;
+//main loop: do the work for every event posted since last time
+void event_pump()
+{
+	uint32_t events;
+
+	if (!pending_events) return;		//nearly every pass, so don't mask interrupts just to find that out
+	__disable_irq();
+	events=pending_events;
+	pending_events=0;
+	__enable_irq();
+
+	if (events & EVENT_USART_RX) usart_rx_poll();
+	if (events & EVENT_USART_ERROR) usart_rx_restart();
+	if (events & EVENT_ADC_SCAN0) adc_pump(0);
+	if (events & EVENT_ADC_SCAN1) adc_pump(1);
 }
 
+//add a time to its stats. The histogram bucket is found by shifting, as the M0+ has no count leading zeros instruction. Each
+//of the stats is only added to from one place, so this doesn't need interrupts masked
+void profile_add(_profile_stats *stats, uint32_t cycles)
+{
+	uint32_t rest=cycles >> PROFILE_BUCKET0_LOG2;
+	uint8_t bucket=0;
 
+	while (rest && bucket<PROFILE_BUCKETS-1)
+	{
+		rest>>=1;
+		bucket++;
+	}
+	if (stats->buckets[bucket]!=0xFFFF) stats->buckets[bucket]++;
+	if (!stats->count || cycles<stats->min) stats->min=cycles;
+	if (cycles>stats->max) stats->max=cycles;
+	stats->count++;
+	stats->total+=cycles;
+}
 
-void decode_burst_from_usart()
+//main loop: the work in this pass is done, either because it is about to sleep or it's back at the top. Only the first call counts
+void profile_pass_end()
 {
-	USART_burst.duration = (uint32_t)usart_buffer[3] << 24 | (uint32_t)usart_buffer[2] << 16 | (uint32_t)usart_buffer[1] << 8 | (uint32_t)usart_buffer[0];
-	USART_burst.pw=(uint8_t)usart_buffer[4];
-	USART_burst.period=(uint16_t)usart_buffer[6] << 8 | (uint16_t)usart_buffer[5];
-	USART_burst.volts=(uint8_t)usart_buffer[7];
-//	USART_burst.polarity=(uint8_t)usart_buffer[8];
-	USART_burst.v_mod_waveform=(uint8_t)usart_buffer[8];
-	USART_burst.v_mod_freq=(uint16_t)usart_buffer[10] << 8 | (uint16_t)usart_buffer[9];
-	USART_burst.v_mod_min=(uint8_t)usart_buffer[11];
-	//USART_burst.v_mod_max=(uint8_t)usart_buffer[13];
-	USART_burst.pw_mod_waveform=(uint8_t)usart_buffer[12];
-	USART_burst.pw_mod_freq=(uint16_t)usart_buffer[14] << 8 | (uint16_t)usart_buffer[13];
-	USART_burst.pw_mod_min=(uint8_t)usart_buffer[15];
-	//USART_burst.pw_mod_max=(uint8_t)usart_buffer[18];
-	USART_burst.period_mod_waveform=(uint8_t)usart_buffer[16];
-	USART_burst.period_mod_freq=(uint16_t)usart_buffer[18] << 8 | (uint16_t)usart_buffer[17];
-	USART_burst.period_mod_min=(uint16_t)usart_buffer[20] << 8 | (uint16_t)usart_buffer[19];
-	//USART_burst.period_mod_max=(uint16_t)usart_buffer[25] << 8 | (uint16_t)usart_buffer[24];
-	//USART_burst.pol_mod_waveform=(uint8_t)usart_buffer[26];
-	USART_burst.pol_mod_freq=(uint8_t)usart_buffer[21];
-	USART_burst.pause_after=(uint16_t)usart_buffer[23] << 8 | (uint16_t)usart_buffer[22];
-	USART_burst.repetitions=(uint16_t)usart_buffer[25] << 8 | (uint16_t)usart_buffer[24];
-
+	if (profile.slept) return;
+	profile_add(&profile.stats[PROFILE_LOOP], htim2.Instance->CNT-profile.loop_started);
+	profile.slept=1;
+}
 
+//at the end of an interrupt: add it to the PROFILE_ stats. started is TIM2 at the start of the interrupt. TIM2 runs at the
+//core clock, so this is cycles, 31.25ns each.
+void isr_time(uint8_t which, uint32_t started)
+{
+	profile_add(&profile.stats[which], htim2.Instance->CNT-started);
 }
 
+//microseconds since power up, for burst timing. Made from TIM2 rather than the 1ms tick, so a burst ends within a pulse or so of
+//its time rather than up to a millisecond late. TIM2 wraps every 134s, which is fine as long as this is called more often than that.
+//Only whole microseconds are taken off the count, so none of the cycles in between are lost. Main loop only
+uint64_t timebase_us()
+{
+	uint32_t cycles=htim2.Instance->CNT-timebase_cycles;
 
+	cycles-=cycles%CORE_CYCLES_PER_US;		//a power of 2, so no divide
+	timebase_cycles+=cycles;
+	timebase_now_us+=cycles/CORE_CYCLES_PER_US;
+	return timebase_now_us;
+}
 
-// -----------------------------
-// modulator waveform functions
-// -----------------------------
 
-#define TABLE_SIZE 361
-const uint16_t sine_table[TABLE_SIZE] = {
-		0, 9, 17, 26, 35, 44, 52, 61, 70, 78, 87, 96, 105, 113, 122, 131, 139, 148, 156, 165, 174, 182, 191, 199, 208, 216, 225, 233, 242, 250, 259, 267, 276, 284, 292, 301, 309, 317, 326, 334, 342, 350, 358, 367, 375, 383, 391, 399, 407, 415, 423, 431, 438, 446, 454, 462, 469, 477, 485, 492, 500, 508, 515, 522, 530, 537, 545, 552, 559, 566, 574, 581, 588, 595, 602, 609, 616, 623, 629, 636, 643, 649, 656, 663, 669, 676, 682, 688, 695, 701, 707, 713, 719, 725, 731, 737, 743, 749, 755, 760, 766, 772, 777, 783, 788, 793, 799, 804, 809, 814, 819, 824, 829, 834, 839, 843, 848, 853, 857, 862, 866, 870, 875, 879, 883, 887, 891, 895, 899, 903, 906, 910, 914, 917, 921, 924, 927, 930, 934, 937, 940, 943, 946, 948, 951, 954, 956, 959, 961, 964, 966, 968, 970, 972, 974, 976, 978, 980, 982, 983, 985, 986, 988, 989, 990, 991, 993, 994, 995, 995, 996, 997, 998, 998, 999, 999, 999, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 999, 999, 999, 998, 998, 997, 996, 995, 995, 994, 993, 991, 990, 989, 988, 986, 985, 983, 982, 980, 978, 976, 974, 972, 970, 968, 966, 964, 961, 959, 956, 954, 951, 948, 946, 943, 940, 937, 934, 930, 927, 924, 921, 917, 914, 910, 906, 903, 899, 895, 891, 887, 883, 879, 875, 870, 866, 862, 857, 853, 848, 843, 839, 834, 829, 824, 819, 814, 809, 804, 799, 793, 788, 783, 777, 772, 766, 760, 755, 749, 743, 737, 731, 725, 719, 713, 707, 701, 695, 688, 682, 676, 669, 663, 656, 649, 643, 636, 629, 623, 616, 609, 602, 595, 588, 581, 574, 566, 559, 552, 545, 537, 530, 522, 515, 508, 500, 492, 485, 477, 469, 462, 454, 446, 438, 431, 423, 415, 407, 399, 391, 383, 375, 367, 358, 350, 342, 334, 326, 317, 309, 301, 292, 284, 276, 267, 259, 250, 242, 233, 225, 216, 208, 199, 191, 182, 174, 165, 156, 148, 139, 131, 122, 113, 105, 96, 87, 78, 70, 61, 52, 44, 35, 26, 17, 9, 0
-};
 
-//these functions are doing integer math, so results are in percent, or 0 to 1000.
-uint16_t fast_sine(uint16_t angle) {
-    //angle %= 360;  // Handle angles > 360
-    //if (angle < 0) angle += 360;  // Handle negative angles
+// -------------------------------
+// Framed protocol over LPUART1
+// -------------------------------
+// The RX DMA fills usart_buffer round and round, and the RX event interrupt just notes how far it has got. The main loop takes
+// the new bytes out in usart_rx_poll() and they go through frame_rx_byte() a byte at a time, so a frame can arrive in pieces,
+// or several in one go. All the frame handling is in the main loop, none of it in the interrupt.
+// Each frame the NeoDK acts on is answered with an ACK carrying its sequence number, and anything it can't use with a NAK saying why, both with the number of free slots in the burst queue. The host can keep several frames in flight and resend
+// just the ones that were NAKed or never answered.
 
-       return sine_table[angle];
+_frame_parser frame_rx;
 
-}
+//Idle line, half full and full events. Size is where the DMA has got to in usart_buffer (USART_BUFFER_SIZE at the full event,
+//after which it carries on from 0). There is an event at least every half buffer, so the distance from the last one is never ambiguous.
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
+{
+	uint32_t started=htim2.Instance->CNT;
 
-uint16_t triangle_wave(uint16_t angle) {
-    //angle %= 360;  // Handle angles > 360
-    //if (angle < 0) angle += 360;  // Handle negative angles
-    if (angle <= 180) {
-        return ((angle*100) / 18);
-    } else {
-        return ( (36000-(angle*100)) / 18 );
-    }
+	if (huart->Instance==LPUART1)
+	{
+		usart_rx.received+=(uint16_t)(Size-usart_rx.dma_pos) % USART_BUFFER_SIZE;
+		usart_rx.dma_pos=Size % USART_BUFFER_SIZE;
+		post_event(EVENT_USART_RX);
+	}
+	isr_time(PROFILE_USART_RX, started);
 }
 
-uint16_t sawtooth_wave(uint16_t angle) {
-    //angle %= 360;  // Handle angles > 360
-    //if (angle < 0) angle += 360;  // Handle negative angles
-        return ((angle*100) / 36);
+//With DMA reception the HAL stops the RX DMA on an error and puts RxState back to ready, so the main loop restarts it. If
+//RxState shows reception still running, the HAL has carried on and there is nothing to restart
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+	if (huart->Instance==LPUART1)
+	{
+		usart_rx.errors++;
+		if (huart->RxState==HAL_UART_STATE_READY) post_event(EVENT_USART_ERROR);
+	}
 }
 
-uint16_t square_wave(uint16_t angle) {
-    //angle %= 360;  // Handle angles > 360
-   // if (angle < 0) angle += 360;  // Handle negative angles
-    if (angle <= 180) {
-        return (1000);
-    } else {
-        return (0) ;
-    }
+//main loop, with the RX DMA stopped: start it again from the beginning of usart_buffer. Anything that came in since the last RX
+//event is lost, and so is a frame part way through
+void usart_rx_restart()
+{
+	usart_rx_poll();
+	usart_rx.received=0;
+	usart_rx.dma_pos=0;
+	usart_rx.parsed=0;
+	frame_rx.count=0;
+	HAL_UARTEx_ReceiveToIdle_DMA(&hlpuart1, usart_buffer, USART_BUFFER_SIZE);
 }
 
+//main loop: parse whatever has arrived since last time
+void usart_rx_poll()
+{
+	uint32_t received=usart_rx.received;		//read it once, the interrupt can move it on while we're here
 
+	if (received-usart_rx.parsed > USART_BUFFER_SIZE)
+	{
+		//the DMA has gone right round and written over bytes we hadn't got to. Skip to the newest, the frame parser drops the
+		//broken frame and finds the next one
+		usart_rx.overruns++;
+		usart_rx.parsed=received-USART_BUFFER_SIZE;
+	}
+	while (usart_rx.parsed!=received)
+	{
+		frame_rx_byte(usart_buffer[usart_rx.parsed % USART_BUFFER_SIZE]);
+		usart_rx.parsed++;
+	}
+}
 
+//CRC-16/CCITT-FALSE (poly 0x1021, starts at 0xFFFF), a byte at a time without a table
+uint16_t frame_crc(const uint8_t *data, uint16_t len)
+{
+	uint16_t crc=0xFFFF;
+	uint8_t x;
 
+	while (len--)
+	{
+		x=(crc >> 8) ^ *data++;
+		x^=x >> 4;
+		crc=(crc << 8) ^ ((uint16_t)x << 12) ^ ((uint16_t)x << 5) ^ x;
+	}
+	return crc;
+}
 
+void frame_send(uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t len)
+{
+	uint8_t frame[FRAME_MAX_PAYLOAD+FRAME_OVERHEAD];
+	uint16_t crc;
+
+	frame[0]=FRAME_SYNC;
+	frame[1]=len;
+	frame[2]=type;
+	frame[3]=seq;
+	memcpy(&frame[4], payload, len);
+	crc=frame_crc(&frame[1], len+3);
+	frame[len+4]=crc & 0xFF;
+	frame[len+5]=crc >> 8;
+	uart_buffer_write(frame, len+FRAME_OVERHEAD);
+}
 
+//the queue is the pattern's while one is running, so there's no room for the host's bursts
+static uint8_t frame_free_slots()
+{
+	return pattern.running ? 0 : burst_fifo_free(&burst_buffer);
+}
 
-// ----------------
-//  USART TX Stuff
-// ----------------
+static void frame_ack(uint8_t seq)
+{
+	uint8_t free_slots=frame_free_slots();
+	frame_send(FRAME_ACK, seq, &free_slots, 1);
+}
 
-#define TX_BUFFER_SIZE 64
-uint8_t tx_buffer[TX_BUFFER_SIZE];
-volatile uint16_t head = 0;
-volatile uint16_t tail = 0;
-volatile uint8_t dma_active = 0;  // Flag for DMA status
-volatile uint16_t tx_size=0;
-
-void uart_buffer_write(const uint8_t* data, uint16_t size) {
-    for (uint16_t i = 0; i < size; i++) {
-        tx_buffer[head] = data[i];
-        head = (head + 1) % TX_BUFFER_SIZE;
-        if (head == tail) { // Buffer full condition
-            // Handle overflow (e.g., drop data, signal error, etc.)
-        }
-    }
-    if (!dma_active) {
-        start_uart_dma();
-    }
+//Credit based flow control: every reply to the host says how many free slots the burst queue has, and so does a FRAME_CREDIT
+//whenever a burst is taken off the queue, or a pattern ends. The host can keep that many bursts in flight and the queue never overflows.
+void frame_credit()
+{
+	uint8_t free_slots=frame_free_slots();
+	frame_send(FRAME_CREDIT, frame_rx.last_seq, &free_slots, 1);
 }
 
-void start_uart_dma()
+static void frame_nak(uint8_t seq, uint8_t reason)
 {
-    if (head != tail)
-    { // Check if data is available
-        dma_active = 1;
-        tx_size = (head > tail) ? (head - tail) : (TX_BUFFER_SIZE - tail);
-        HAL_UART_Transmit_DMA(&hlpuart1, &tx_buffer[tail], tx_size);
-    }
+	uint8_t payload[2]={reason, frame_free_slots()};
+	frame_send(FRAME_NAK, seq, payload, 2);
 }
 
-void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+//act on a good frame. crc is only used to spot a resend of the last one
+static void frame_handle(uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t len, uint16_t crc)
 {
-    tail = (tail + tx_size) % TX_BUFFER_SIZE; // Update tail pointer
-    if (tail != head) {
-        start_uart_dma(); // Continue sending if more data remains
-    } else
-    {
-        dma_active = 0;
-    }
+	_burst_record *slot;
+	uint8_t live[2];
+	uint16_t offset, length, i;
+	_settings new_settings;
+	uint32_t rate;
+
+	baud.confirmed=1;		//whatever it is, it got through at this rate
+	if (frame_rx.have_last && seq==frame_rx.last_seq && crc==frame_rx.last_crc)
+	{
+		frame_ack(seq);		//we did this one already, the host just didn't hear the ACK
+		return;
+	}
+
+	switch (type)
+	{
+		case FRAME_BURST:
+		case FRAME_BURST_NOW:
+		case FRAME_LIVE:
+			if (len!=BURST_PAYLOAD_SIZE)
+			{
+				frame_nak(seq, FRAME_NAK_LENGTH);
+				return;
+			}
+			break;
+		case FRAME_STOP:
+			break;
+		case FRAME_PATTERN_LOAD:
+			if (len<3)
+			{
+				frame_nak(seq, FRAME_NAK_LENGTH);
+				return;
+			}
+			break;
+		case FRAME_PATTERN_RUN:
+		case FRAME_PATTERN_SAVE:
+			if (len!=4)
+			{
+				frame_nak(seq, FRAME_NAK_LENGTH);
+				return;
+			}
+			break;
+		case FRAME_SETTINGS:
+			if (len!=sizeof(_settings))
+			{
+				frame_nak(seq, FRAME_NAK_LENGTH);
+				return;
+			}
+			break;
+		case FRAME_WAVE_LOAD:
+			if (len<4 || (len & 1))
+			{
+				frame_nak(seq, FRAME_NAK_LENGTH);
+				return;
+			}
+			break;
+		case FRAME_TELEMETRY:
+			if (len!=0 && len!=2)
+			{
+				frame_nak(seq, FRAME_NAK_LENGTH);
+				return;
+			}
+			break;
+		case FRAME_PROFILE:
+			if (len!=1)
+			{
+				frame_nak(seq, FRAME_NAK_LENGTH);
+				return;
+			}
+			if ((payload[0] & ~PROFILE_RESET)>=PROFILE_STATS)
+			{
+				frame_nak(seq, FRAME_NAK_PROFILE);
+				return;
+			}
+			break;
+		case FRAME_BAUD:
+			if (len!=4)
+			{
+				frame_nak(seq, FRAME_NAK_LENGTH);
+				return;
+			}
+			rate=payload[0] | (uint32_t)payload[1] << 8 | (uint32_t)payload[2] << 16 | (uint32_t)payload[3] << 24;
+			if (!baud_supported(rate))
+			{
+				frame_nak(seq, FRAME_NAK_BAUD);
+				return;
+			}
+			break;
+		case FRAME_LIVE_DELTA:
+			if (len<2 || len!=2+live_delta_length((uint16_t)payload[1] << 8 | payload[0]))
+			{
+				frame_nak(seq, FRAME_NAK_LENGTH);
+				return;
+			}
+			break;
+		default:
+			frame_nak(seq, FRAME_NAK_TYPE);
+			return;
+	}
+
+	switch (type)
+	{
+		case FRAME_BURST:
+			if (pattern.running)
+			{
+				frame_nak(seq, FRAME_NAK_BUSY);
+				return;
+			}
+			slot=burst_fifo_reserve(&burst_buffer, burst_record_size(payload));
+			if (!slot)
+			{
+				frame_nak(seq, FRAME_NAK_FULL);
+				return;
+			}
+			decode_burst_from_usart(payload, slot);
+			burst_fifo_commit(&burst_buffer);
+			break;
+		case FRAME_BURST_NOW:		//clear buffer and run this one immediately
+			pattern_stop();
+			burst_fifo_flush(&burst_buffer);
+			slot=burst_fifo_reserve(&burst_buffer, burst_record_size(payload));
+			decode_burst_from_usart(payload, slot);
+			burst_fifo_commit(&burst_buffer);
+			in_a_burst=0;			//force this burst to run immediately
+			break;
+		case FRAME_STOP:			//the main loop finds nothing to do, and stops the pulse engine once the outputs are off
+			pattern_stop();
+			burst_fifo_flush(&burst_buffer);
+			pulse_running.stopped=1;
+			in_a_burst=0;
+			break;
+		case FRAME_LIVE:			//update live parameters. Just the voltage, from where it is in a whole burst payload
+			live[0]=payload[7];
+			live[1]=payload[11];
+			live_apply(LIVE_VOLTS | LIVE_V_MOD_MIN, live);
+			break;
+		case FRAME_LIVE_DELTA:
+			live_apply((uint16_t)payload[1] << 8 | payload[0], &payload[2]);
+			break;
+		case FRAME_PATTERN_LOAD:	//the code is changing under any pattern that is running, so stop it. Bursts it has queued still play
+			offset=(uint16_t)payload[1] << 8 | payload[0];
+			if (offset+len-2 > PATTERN_CODE_SIZE)
+			{
+				frame_nak(seq, FRAME_NAK_PATTERN);
+				return;
+			}
+			if (store.pending & 1<<STORE_KEY_PATTERN)
+			{
+				frame_nak(seq, FRAME_NAK_BUSY);		//the code is still to go to flash
+				return;
+			}
+			pattern_stop();
+			memcpy(&pattern.code[offset], &payload[2], len-2);
+			break;
+		case FRAME_PATTERN_RUN:		//like FRAME_BURST_NOW, the pattern's first burst runs straight away
+			length=(uint16_t)payload[1] << 8 | payload[0];
+			if (length>PATTERN_CODE_SIZE || frame_crc(pattern.code, length)!=((uint16_t)payload[3] << 8 | payload[2])
+					|| !pattern_check(pattern.code, length))
+			{
+				frame_nak(seq, FRAME_NAK_PATTERN);
+				return;
+			}
+			burst_fifo_flush(&burst_buffer);
+			in_a_burst=0;
+			pattern.length=length;
+			pattern_start();
+			break;
+		case FRAME_PATTERN_SAVE:	//written once the outputs are stopped, see store_flush()
+			length=(uint16_t)payload[1] << 8 | payload[0];
+			if (length && (length>PATTERN_CODE_SIZE || frame_crc(pattern.code, length)!=((uint16_t)payload[3] << 8 | payload[2])
+					|| !pattern_check(pattern.code, length)))
+			{
+				frame_nak(seq, FRAME_NAK_PATTERN);
+				return;
+			}
+			store.pattern_length=length;
+			store.pending|=1<<STORE_KEY_PATTERN;
+			break;
+		case FRAME_SETTINGS:		//used straight away, saved once the outputs are stopped
+			new_settings.level=payload[0];
+			new_settings.levels[0]=payload[1];
+			new_settings.levels[1]=payload[2];
+			new_settings.levels[2]=payload[3];
+			new_settings.vprim_min_mV=(uint16_t)payload[5] << 8 | payload[4];
+			new_settings.vprim_max_mV=(uint16_t)payload[7] << 8 | payload[6];
+			new_settings.slew_mV_per_ms=(uint16_t)payload[9] << 8 | payload[8];
+			new_settings.charge_per_V=(uint16_t)payload[11] << 8 | payload[10];
+			if (!settings_apply(&new_settings))
+			{
+				frame_nak(seq, FRAME_NAK_SETTINGS);
+				return;
+			}
+			store.pending|=1<<STORE_KEY_SETTINGS;
+			break;
+		case FRAME_WAVE_LOAD:		//a burst using the slot picks the new entries up as they arrive
+			offset=payload[1];
+			length=(len-2)/2;
+			if (payload[0]>=WAVE_SLOTS || offset+length > WAVE_TABLE_SIZE)
+			{
+				frame_nak(seq, FRAME_NAK_WAVE);
+				return;
+			}
+			for (i=0; i<length; i++)
+				if (((uint16_t)payload[3+2*i] << 8 | payload[2+2*i]) > 4096)
+				{
+					frame_nak(seq, FRAME_NAK_WAVE);
+					return;
+				}
+			for (i=0; i<length; i++) wave_slots[payload[0]][offset+i]=(uint16_t)payload[3+2*i] << 8 | payload[2+2*i];
+			wave_slots[payload[0]][WAVE_TABLE_SIZE]=wave_slots[payload[0]][0];		//the cycle ends where it starts
+			break;
+		case FRAME_TELEMETRY:		//sent from the main loop, after the ACK
+			if (!len) telemetry.requested=1;
+			else
+			{
+				telemetry.interval_ms=(uint16_t)payload[1] << 8 | payload[0];
+				if (telemetry.interval_ms && telemetry.interval_ms<TELEMETRY_MIN_MS) telemetry.interval_ms=TELEMETRY_MIN_MS;
+				telemetry.due=HAL_GetTick();
+			}
+			break;
+		case FRAME_PROFILE:		//sent from the main loop too
+			profile.requested=payload[0]+1;
+			break;
+		case FRAME_BAUD:		//and switched to from there, once this ACK is out at the old rate. Asking for the rate it's at already just confirms it
+			baud.pending=rate!=baud.rate ? rate : 0;
+			break;
+	}
+	frame_rx.last_seq=seq;
+	frame_rx.last_crc=crc;
+	frame_rx.have_last=1;
+	frame_ack(seq);
+}
+
+//Bytes are collected in frame_rx.buf until there is a whole frame. If it turns out to be bad (length out of range or wrong CRC),
+//only its sync byte is dropped, and the bytes after it are searched for the next one. So a lost or corrupted byte costs the frame
+//it was in, and the stream is back in step by the next frame.
+void frame_rx_byte(uint8_t byte)
+{
+	uint8_t size, i;
+	uint16_t crc;
+
+	if (!frame_rx.count && byte!=FRAME_SYNC) return;		//between frames, skip anything that isn't the start of one
+	frame_rx.buf[frame_rx.count++]=byte;
+
+	while (frame_rx.count>=2)
+	{
+		i=1;
+		if (frame_rx.buf[1]<=FRAME_MAX_PAYLOAD)
+		{
+			size=frame_rx.buf[1]+FRAME_OVERHEAD;
+			if (frame_rx.count<size) return;		//wait for the rest of it
+			crc=frame_crc(&frame_rx.buf[1], size-3);
+			if (crc==(frame_rx.buf[size-2] | (uint16_t)frame_rx.buf[size-1] << 8))
+			{
+				frame_handle(frame_rx.buf[2], frame_rx.buf[3], &frame_rx.buf[4], frame_rx.buf[1], crc);
+				i=size;
+			} else
+			{
+				frame_nak(frame_rx.buf[3], FRAME_NAK_CRC);
+				profile.frames_dropped++;
+			}
+		} else profile.frames_dropped++;
+		//drop what's been used, and anything after it that can't be the start of a frame
+		while (i<frame_rx.count && frame_rx.buf[i]!=FRAME_SYNC) i++;
+		frame_rx.count-=i;
+		memmove(frame_rx.buf, &frame_rx.buf[i], frame_rx.count);
+	}
+}
+
+
+
+// -----------
+// Telemetry
+// -----------
+// A fixed layout snapshot for the host, every telemetry.interval_ms or when it asks. Little endian, like the frames coming in:
+//   0 HAL_GetTick() (4), 4 battery mV (2), 6 capacitor mV (2), 8 primary voltage setpoint mV (2),
+//   10 current sense of the last pulse (2), 12 highest in this burst (2), 14 pot 0-100, 15 free burst queue slots,
+//   16 bytes in the burst queue (2), 18 bursts started since power up (2, wraps), 20 repetitions left (2),
+//   22 flags: 1 in a burst, 2 pattern running, 4 buck on, 8 constant charge on, 23 TX messages dropped (2)
+
+void telemetry_send()
+{
+	uint8_t p[TELEMETRY_PAYLOAD_SIZE];
+	uint32_t now=HAL_GetTick();
+	uint16_t queued=(uint16_t)(burst_buffer.head-burst_buffer.tail);
+	uint16_t repetitions=in_a_burst ? current_burst.repetitions : 0;
+
+	p[0]=now; p[1]=now >> 8; p[2]=now >> 16; p[3]=now >> 24;
+	p[4]=adc.batt_mV; p[5]=adc.batt_mV >> 8;
+	p[6]=adc.cap_mV; p[7]=adc.cap_mV >> 8;
+	p[8]=vprim.setpoint_mV; p[9]=vprim.setpoint_mV >> 8;
+	p[10]=adc.current; p[11]=adc.current >> 8;
+	p[12]=adc.current_max; p[13]=adc.current_max >> 8;
+	p[14]=adc.pot;
+	p[15]=frame_free_slots();
+	p[16]=queued; p[17]=queued >> 8;
+	p[18]=telemetry.bursts; p[19]=telemetry.bursts >> 8;
+	p[20]=repetitions; p[21]=repetitions >> 8;
+	p[22]=(in_a_burst ? 1 : 0) | (pattern.running ? 2 : 0) | (power.buck_on ? 4 : 0) | (settings.charge_per_V ? 8 : 0);
+	p[23]=usart_tx.dropped; p[24]=usart_tx.dropped >> 8;
+	frame_send(FRAME_TELEMETRY_DATA, frame_rx.last_seq, p, TELEMETRY_PAYLOAD_SIZE);
+}
+
+//main loop, each pass. If it falls behind (flash writes stall it for 22ms) it picks up from now, rather than sending a bunch to catch up
+void telemetry_poll()
+{
+	uint32_t now;
+
+	if (telemetry.requested)
+	{
+		telemetry.requested=0;
+		telemetry_send();
+	}
+	if (!telemetry.interval_ms) return;
+	now=HAL_GetTick();
+	if ((int32_t)(now-telemetry.due) < 0) return;
+	telemetry_send();
+	telemetry.due+=telemetry.interval_ms;
+	if ((int32_t)(now-telemetry.due) >= 0) telemetry.due=now+telemetry.interval_ms;
+}
+
+
+
+// -----------
+// Profiling
+// -----------
+// One of the PROFILE_ stats and the error counters, little endian:
+//   0 which PROFILE_ stats, 1 count (4), 5 total cycles (8), 13 fewest (4), 17 most (4), 21 PROFILE_BUCKETS histogram buckets (2 each),
+//   41 RX ring overruns (2), 43 frames dropped for a bad CRC or length (2), 45 TX messages dropped (2)
+
+void profile_send(uint8_t which)
+{
+	uint8_t p[PROFILE_PAYLOAD_SIZE];
+	_profile_stats stats;
+	uint8_t i;
+
+	__disable_irq();		//the interrupts add to theirs as they go
+	stats=profile.stats[which & ~PROFILE_RESET];
+	if (which & PROFILE_RESET) memset(&profile.stats[which & ~PROFILE_RESET], 0, sizeof(stats));
+	__enable_irq();
+
+	p[0]=which & ~PROFILE_RESET;
+	for (i=0; i<4; i++)
+	{
+		p[1+i]=stats.count >> 8*i;
+		p[13+i]=stats.min >> 8*i;
+		p[17+i]=stats.max >> 8*i;
+	}
+	for (i=0; i<8; i++) p[5+i]=stats.total >> 8*i;
+	for (i=0; i<PROFILE_BUCKETS; i++)
+	{
+		p[21+2*i]=stats.buckets[i];
+		p[22+2*i]=stats.buckets[i] >> 8;
+	}
+	p[41]=usart_rx.overruns; p[42]=usart_rx.overruns >> 8;
+	p[43]=profile.frames_dropped; p[44]=profile.frames_dropped >> 8;
+	p[45]=usart_tx.dropped; p[46]=usart_tx.dropped >> 8;
+	frame_send(FRAME_PROFILE_DATA, frame_rx.last_seq, p, sizeof(p));
+}
+
+//main loop, each pass
+void profile_poll()
+{
+	if (!profile.requested) return;
+	profile_send(profile.requested-1);
+	profile.requested=0;
+}
+
+
+
+// ------------
+// Serial rate
+// ------------
+// The host asks for a faster rate with FRAME_BAUD. The ACK goes at the old rate, then the NeoDK switches, and the host
+// follows when it sees the ACK. If no good frame comes in at the new rate within BAUD_CONFIRM_MS, or the line errors and bad
+// frames come too thick and fast after that, it goes back to BAUD_DEFAULT and says so with STATUS_BAUD_FALLBACK. A host
+// still at the faster rate gets that as garbage, and a host that hears nothing back should go back to BAUD_DEFAULT too.
+
+static const uint32_t baud_rates[]={BAUD_DEFAULT, 230400, 460800, 921600, 1000000};	//rates the FT232R makes. LPUART1 runs from the 32MHz PCLK, so it can do any of them
+
+bool baud_supported(uint32_t rate)
+{
+	uint8_t i;
+
+	for (i=0; i<sizeof(baud_rates)/sizeof(baud_rates[0]); i++)
+		if (baud_rates[i]==rate) return true;
+	return false;
+}
+
+//main loop. The FIFOs are on at every rate, from start up (Do_User_Code_Begin_While()) and after every switch, the one back to
+//115200 too: the DMA still moves a byte as soon as there is one (or room for one), and the thresholds are at 1/8 so a FIFO
+//interrupt, if one is ever turned on, comes a byte in. The FIFOs are 8 bytes of slack for when the DMA is late getting to the
+//UART, which at 1Mbaud is 10us a byte. Bytes part way in are lost, and the TX ring carries on
+void usart_set_baud(uint32_t rate)
+{
+	usart_rx_poll();
+	HAL_UART_Abort(&hlpuart1);
+	hlpuart1.Init.BaudRate=rate;
+	if (HAL_UART_Init(&hlpuart1)!=HAL_OK || HAL_UARTEx_SetTxFifoThreshold(&hlpuart1, UART_TXFIFO_THRESHOLD_1_8)!=HAL_OK ||
+			HAL_UARTEx_SetRxFifoThreshold(&hlpuart1, UART_RXFIFO_THRESHOLD_1_8)!=HAL_OK || HAL_UARTEx_EnableFifoMode(&hlpuart1)!=HAL_OK)
+	{
+		Error_Handler();
+	}
+	usart_rx_restart();
+
+	__disable_irq();
+	usart_tx.sent+=usart_tx.sending;		//cut short by the abort
+	usart_tx.sending=0;
+	start_uart_dma();
+	__enable_irq();
+
+	baud.rate=rate;
+	baud.switched_at=HAL_GetTick();
+	baud.confirmed=0;
+	baud.window_start=baud.switched_at;
+	baud.window_errors=usart_rx.errors+usart_rx.overruns+profile.frames_dropped;
+}
+
+//main loop, each pass
+void baud_poll()
+{
+	uint32_t now;
+	uint16_t errors;
+
+	if (baud.pending)
+	{
+		if (usart_tx.sending || usart_tx.sent!=usart_tx.committed) return;		//the ACK, and anything before it, has to go at the old rate
+		usart_set_baud(baud.pending);
+		baud.pending=0;
+		return;
+	}
+	if (baud.rate==BAUD_DEFAULT) return;
+	now=HAL_GetTick();
+	errors=usart_rx.errors+usart_rx.overruns+profile.frames_dropped;
+	if ((!baud.confirmed && now-baud.switched_at>=BAUD_CONFIRM_MS) || (uint16_t)(errors-baud.window_errors)>=BAUD_ERRORS_MAX)
+	{
+		baud.fallbacks++;
+		usart_set_baud(BAUD_DEFAULT);
+		baud.confirmed=1;
+		status_send(STATUS_BAUD_FALLBACK);
+		return;
+	}
+	if (now-baud.window_start>=BAUD_ERROR_WINDOW_MS)
+	{
+		baud.window_start=now;
+		baud.window_errors=errors;
+	}
+}
+
+
+void global_vars_init()
+{
+	USART_burst.duration=0;
+	USART_burst.pw=0;
+	USART_burst.period=0;
+	USART_burst.volts=0;
+//	USART_burst.polarity=0;
+	USART_burst.v_mod_waveform=0;
+	USART_burst.v_mod_freq=0;
+	USART_burst.v_mod_min=0;
+//	USART_burst.v_mod_max=0;
+	USART_burst.pw_mod_waveform=0;
+	USART_burst.pw_mod_freq=0;
+	USART_burst.pw_mod_min=0;
+//	USART_burst.pw_mod_max=0;
+	USART_burst.period_mod_waveform=0;
+	USART_burst.period_mod_freq=0;
+	USART_burst.period_mod_min=0;
+//	USART_burst.period_mod_max=0;
+//	USART_burst.pol_mod_waveform=0;
+	USART_burst.pol_mod_freq=0;
+	USART_burst.repetitions=0;
+	USART_burst.pause_after=0;
+	USART_burst.output_triacs=1;
+	USART_burst.route_mod_routes=0;
+	USART_burst.route_mod_pulses=0;
+
+	pulse_running.volts=5;		// or 0.5 volts
+	pulse_running.polarity=1;
+	pulse_running.output_triacs=0;	//0=all off, 1="AB", 2="CD", 3="AD", 4="BC", 5="ABC", 6="ABD", 7="CDA", 8="CDB", 9="ABCD". Set from the pulse slots
+	pulse_running.currently_on=0;	//0= false; 1=true
+	pulse_running.stopped=1;
+	pulse_running.polarity_switch_count=0;
+
+	pulse_slots.slot[0].on_time=0;
+	pulse_slots.slot[0].off_time=65000;
+	pulse_slots.slot[0].volts=5;
+	pulse_slots.slot[0].route=0;
+	pulse_slots.active=0;
+	pulse_slots.ready=0;
+
+	frame_rx.count=0;
+	frame_rx.have_last=0;
+	usart_rx.received=0;
+	usart_rx.dma_pos=0;
+	usart_rx.parsed=0;
+	usart_rx.overruns=0;
+	memset(&usart_tx, 0, sizeof(usart_tx));
+	pending_events=0;
+	memset(&profile, 0, sizeof(profile));
+	memset(&baud, 0, sizeof(baud));
+	baud.rate=BAUD_DEFAULT;
+	usart_rx.errors=0;
+	pattern.length=0;
+	pattern.running=0;
+	random_state=0x2545F491;
+	vprim.setpoint_mV=0;		//the buck is off, so the ramp starts from nothing
+	vprim.dac_code=0xFFFF;
+	vprim.slew_q16=0;
+	vprim.updated_us=0;
+	memset(&adc, 0, sizeof(adc));
+	charge.gain_q12=CHARGE_GAIN_ONE;
+	charge.target=0;
+	power.idle_since=0;
+	power.buck_on=0;
+	memset(&telemetry, 0, sizeof(telemetry));
+}
+
+
+
+//Burst frame payload (little endian):
+//   0 duration(4)  4 pw  5 period(2)  7 volts  8 v_mod_waveform  9 v_mod_freq(2)  11 v_mod_min  12 pw_mod_waveform  13 pw_mod_freq(2)
+//  15 pw_mod_min  16 period_mod_waveform  17 period_mod_freq(2)  19 period_mod_min(2)  21 pol_mod_freq  22 pause_after(2)
+//  24 repetitions(2)  26 output_triacs  27 route_mod_routes(2)  29 route_mod_pulses
+
+//the record decode_burst_from_usart() will make of this payload, in bytes
+uint8_t burst_record_size(const uint8_t *data)
+{
+	uint8_t size=sizeof(_burst_record);
+
+	if (data[8]) size+=sizeof(_burst_mod);
+	if (data[12]) size+=sizeof(_burst_mod);
+	if (data[16]) size+=sizeof(_burst_period_mod);
+	if (data[27] || data[28]) size+=sizeof(_burst_route);
+	return (size+3) & ~3;
+}
+
+//straight into the burst's record in burst_buffer, which has room for burst_record_size(data)
+void decode_burst_from_usart(const uint8_t *data, _burst_record *record)
+{
+	uint8_t *part=(uint8_t *)(record+1);
+	_burst_mod *mod;
+	_burst_period_mod *period_mod;
+	_burst_route *route;
+
+	record->format=BURST_RECORD_VERSION<<4;
+	record->size=burst_record_size(data);
+	record->duration = (uint32_t)data[3] << 24 | (uint32_t)data[2] << 16 | (uint32_t)data[1] << 8 | (uint32_t)data[0];
+	record->pw=(uint8_t)data[4];
+	record->period=(uint16_t)data[6] << 8 | (uint16_t)data[5];
+	record->volts=(uint8_t)data[7];
+	record->pol_mod_freq=(uint8_t)data[21];
+	record->pause_after=(uint16_t)data[23] << 8 | (uint16_t)data[22];
+	record->repetitions=(uint16_t)data[25] << 8 | (uint16_t)data[24];
+	record->output_triacs=(uint8_t)data[26];
+
+	if (data[8])
+	{
+		mod=(_burst_mod *)part;
+		mod->waveform=data[8];
+		mod->mod_ms=(uint16_t)data[10] << 8 | (uint16_t)data[9];
+		mod->min=data[11];
+		record->format|=BURST_PART_V;
+		part+=sizeof(_burst_mod);
+	}
+	if (data[12])
+	{
+		mod=(_burst_mod *)part;
+		mod->waveform=data[12];
+		mod->mod_ms=(uint16_t)data[14] << 8 | (uint16_t)data[13];
+		mod->min=data[15];
+		record->format|=BURST_PART_PW;
+		part+=sizeof(_burst_mod);
+	}
+	if (data[16])
+	{
+		period_mod=(_burst_period_mod *)part;
+		period_mod->waveform=data[16];
+		period_mod->mod_ms=(uint16_t)data[18] << 8 | (uint16_t)data[17];
+		period_mod->min=(uint16_t)data[20] << 8 | (uint16_t)data[19];
+		period_mod->spare=0;
+		record->format|=BURST_PART_PERIOD;
+		part+=sizeof(_burst_period_mod);
+	}
+	if (data[27] || data[28])
+	{
+		route=(_burst_route *)part;
+		route->routes=(uint16_t)data[28] << 8 | (uint16_t)data[27];
+		route->pulses=data[29];
+		route->spare=0;
+		record->format|=BURST_PART_ROUTE;
+	}
+}
+
+//back to a whole _burst, with everything a record leaves out at 0. False if the record is from some other version of this code
+bool burst_record_unpack(const _burst_record *record, _burst *burst)
+{
+	const uint8_t *part=(const uint8_t *)(record+1);
+	const _burst_mod *mod;
+	const _burst_period_mod *period_mod;
+	const _burst_route *route;
+
+	memset(burst, 0, sizeof(*burst));
+	if (record->format>>4 != BURST_RECORD_VERSION) return false;
+	burst->duration=record->duration;
+	burst->pw=record->pw;
+	burst->period=record->period;
+	burst->volts=record->volts;
+	burst->pol_mod_freq=record->pol_mod_freq;
+	burst->pause_after=record->pause_after;
+	burst->repetitions=record->repetitions;
+	burst->output_triacs=record->output_triacs;
+
+	if (record->format & BURST_PART_V)
+	{
+		mod=(const _burst_mod *)part;
+		burst->v_mod_waveform=mod->waveform;
+		burst->v_mod_freq=mod->mod_ms;
+		burst->v_mod_min=mod->min;
+		part+=sizeof(_burst_mod);
+	}
+	if (record->format & BURST_PART_PW)
+	{
+		mod=(const _burst_mod *)part;
+		burst->pw_mod_waveform=mod->waveform;
+		burst->pw_mod_freq=mod->mod_ms;
+		burst->pw_mod_min=mod->min;
+		part+=sizeof(_burst_mod);
+	}
+	if (record->format & BURST_PART_PERIOD)
+	{
+		period_mod=(const _burst_period_mod *)part;
+		burst->period_mod_waveform=period_mod->waveform;
+		burst->period_mod_freq=period_mod->mod_ms;
+		burst->period_mod_min=period_mod->min;
+		part+=sizeof(_burst_period_mod);
+	}
+	if (record->format & BURST_PART_ROUTE)
+	{
+		route=(const _burst_route *)part;
+		burst->route_mod_routes=route->routes;
+		burst->route_mod_pulses=route->pulses;
+	}
+	return true;
+}
+
+
+
+
+// --------------------
+// On-device patterns
+// --------------------
+// A pattern is uploaded once (FRAME_PATTERN_LOAD, a piece at a time) and started with FRAME_PATTERN_RUN, after which the NeoDK
+// plays it without the host: pattern_step() runs its instructions in the main loop and queues each burst the way the frame
+// handler would, so the burst player doesn't know the difference. It keeps one burst ahead: the next burst is queued as soon as
+// the player takes the last one off the queue, so bursts go back to back, but the button and pot are read no more than a burst
+// early. Filling the whole queue would have them read seconds before the bursts they choose.
+// The code is checked once before it runs (pattern_check()), so pattern_step() can trust every operand and address in it.
+
+static uint16_t pattern_u16(const uint8_t *data)
+{
+	return (uint16_t)data[1] << 8 | data[0];
+}
+
+//length of the instruction at code[pc], or 0 if it isn't one or doesn't all fit before length
+static uint16_t pattern_op_size(const uint8_t *code, uint16_t pc, uint16_t length)
+{
+	uint16_t size;
+
+	switch (code[pc])
+	{
+		case OP_END:
+		case OP_NEXT: size=1; break;
+		case OP_BURST: size=1+BURST_PAYLOAD_SIZE; break;
+		case OP_JUMP:
+		case OP_LOOP:
+		case OP_IF_BUTTON: size=3; break;
+		case OP_IF_POT_BELOW: size=4; break;
+		case OP_RANDOM: size=(pc+1<length && code[pc+1]) ? 2+2*code[pc+1] : 0; break;
+		default: size=0;
+	}
+	return (pc+size<=length) ? size : 0;
+}
+
+//true if code is all whole, known instructions, and every address in it is the start of one
+bool pattern_check(const uint8_t *code, uint16_t length)
+{
+	uint8_t starts[PATTERN_CODE_SIZE/8]={0};		//bit per byte of code: an instruction starts here
+	uint16_t pc, size, target, first, n;
+
+	if (!length || length>PATTERN_CODE_SIZE) return false;
+	for (pc=0; pc<length; pc+=size)
+	{
+		size=pattern_op_size(code, pc, length);
+		if (!size) return false;
+		starts[pc>>3]|=1<<(pc&7);
+	}
+	for (pc=0; pc<length; pc+=pattern_op_size(code, pc, length))
+	{
+		first=pc+1;
+		n=1;
+		switch (code[pc])
+		{
+			case OP_JUMP:
+			case OP_IF_BUTTON: break;
+			case OP_IF_POT_BELOW: first=pc+2; break;
+			case OP_RANDOM: first=pc+2; n=code[pc+1]; break;
+			default: n=0;
+		}
+		while (n--)
+		{
+			target=pattern_u16(&code[first+2*n]);
+			if (target>=length || !(starts[target>>3] & 1<<(target&7))) return false;
+		}
+	}
+	return true;
+}
+
+//xorshift32, for patterns and the random waveforms. The top half is the best half
+uint16_t random16()
+{
+	uint32_t x=random_state;
+
+	x^=x << 13;
+	x^=x >> 17;
+	x^=x << 5;
+	random_state=x;
+	return x >> 16;
+}
+
+//run pattern.code from the top. Seeded from the time and the current sense noise, so each run goes its own way
+void pattern_start()
+{
+	pattern.pc=0;
+	pattern.loops=0;
+	random_state^=HAL_GetTick() ^ (uint32_t)adc_buffer[0] << 16;
+	if (!random_state) random_state=1;
+	pattern.running=1;
+}
+
+//the host has taken over. Whatever the pattern queued is the host's to keep or flush
+void pattern_stop()
+{
+	pattern.running=0;
+}
+
+//the pattern finished by itself (or did something it can't, like OP_NEXT with no loop open). The host can have the queue back
+static void pattern_end()
+{
+	pattern.running=0;
+	frame_credit();
+}
+
+//at power up: run the pattern saved in flash, if there is one, so the NeoDK is some use without a host
+void pattern_run_saved()
+{
+	uint16_t length;
+	const uint8_t *code=store_find(STORE_KEY_PATTERN, &length);
+
+	if (!code || !pattern_check(code, length)) return;		//none, or saved as length 0 to say none
+	memcpy(pattern.code, code, length);
+	pattern.length=length;
+	pattern_start();
+}
+
+//main loop: run the pattern on until it has a burst that can't be queued yet, or for PATTERN_STEPS instructions
+void pattern_step()
+{
+	uint8_t steps=PATTERN_STEPS;
+	const uint8_t *op;
+	_burst_record *slot;
+
+	while (pattern.running && steps--)
+	{
+		if (pattern.pc>=pattern.length)
+		{
+			pattern_end();		//ran off the end, same as OP_END
+			return;
+		}
+		op=&pattern.code[pattern.pc];
+		switch (op[0])
+		{
+			case OP_BURST:
+				if (!fifo_is_empty(&burst_buffer)) return;		//already a burst ahead. Try again next time round
+				slot=burst_fifo_reserve(&burst_buffer, burst_record_size(&op[1]));
+				decode_burst_from_usart(&op[1], slot);
+				burst_fifo_commit(&burst_buffer);
+				pattern.pc+=1+BURST_PAYLOAD_SIZE;
+				break;
+			case OP_JUMP:
+				pattern.pc=pattern_u16(&op[1]);
+				break;
+			case OP_LOOP:
+				if (pattern.loops==PATTERN_LOOPS)
+				{
+					pattern_end();
+					return;
+				}
+				pattern.loop_start[pattern.loops]=pattern.pc+3;
+				pattern.loop_count[pattern.loops]=pattern_u16(&op[1]) ? pattern_u16(&op[1]) : 1;	//0 runs it once, like 1
+				pattern.loops++;
+				pattern.pc+=3;
+				break;
+			case OP_NEXT:
+				if (!pattern.loops)
+				{
+					pattern_end();
+					return;
+				}
+				if (--pattern.loop_count[pattern.loops-1]) pattern.pc=pattern.loop_start[pattern.loops-1];
+				else
+				{
+					pattern.loops--;
+					pattern.pc++;
+				}
+				break;
+			case OP_RANDOM:		//n addresses, pick one with a multiply and shift rather than a %
+				pattern.pc=pattern_u16(&op[2+2*((random16()*(uint32_t)op[1]) >> 16)]);
+				break;
+			case OP_IF_BUTTON:	//pressed reads high, see Do_MX_GPIO_Init_2()
+				pattern.pc=HAL_GPIO_ReadPin(PUSHBUTTON_PIN_GPIO_Port, PUSHBUTTON_PIN_Pin) ? pattern_u16(&op[1]) : pattern.pc+3;
+				break;
+			case OP_IF_POT_BELOW:	//same 0 to 100 level as ADC_pot in the main loop
+				pattern.pc=(adc.pot < op[1]) ? pattern_u16(&op[2]) : pattern.pc+4;
+				break;
+			default:		//OP_END. pattern_check() lets nothing else through
+				pattern_end();
+				return;
+		}
+	}
+}
+
+
+
+
+// ----------------------
+// Primary voltage ramp
+// ----------------------
+// The DAC sets the buck's target, and the capacitors take tens of milliseconds to follow it. A step in the DAC code makes the buck
+// rush there (or sit idle while the pulses drain the capacitors), so the setpoint is moved in a ramp instead, no faster than
+// settings.slew_mV_per_ms. The capacitor voltage (CAP_VOLT_SENSE) is the feedback: the DAC is aimed past the setpoint by as far as
+// the capacitors are behind it, which pulls them along faster, and makes up for any error in the calibration or sag under load.
+
+//main loop, each pass. The DAC is only written when the code changes
+void vprim_update(uint16_t target_mV)
+{
+	uint64_t now=timebase_us();
+	uint32_t elapsed=(uint32_t)(now-vprim.updated_us < VPRIM_STEP_MAX_US ? now-vprim.updated_us : VPRIM_STEP_MAX_US);
+	uint32_t step;
+	int32_t error, aim;
+	uint16_t code;
+
+	vprim.updated_us=now;
+	if (vprim.setpoint_mV==target_mV) vprim.slew_q16=0;		//there already, so don't save ramp up for the next change
+	else
+	{
+		vprim.slew_q16+=elapsed*vprim_slew_q16;
+		step=vprim.slew_q16 >> 16;
+		vprim.slew_q16&=0xFFFF;
+		if (target_mV>vprim.setpoint_mV) vprim.setpoint_mV=(target_mV-vprim.setpoint_mV > step) ? vprim.setpoint_mV+step : target_mV;
+		else vprim.setpoint_mV=(vprim.setpoint_mV-target_mV > step) ? vprim.setpoint_mV-step : target_mV;
+	}
+
+	error=(int32_t)vprim.setpoint_mV-(int32_t)adc.cap_mV;
+	aim=vprim.setpoint_mV;
+	if (error>VPRIM_DEADBAND_mV || error<-VPRIM_DEADBAND_mV)
+	{
+		if (error>VPRIM_BOOST_mV) error=VPRIM_BOOST_mV;
+		else if (error<-VPRIM_BOOST_mV) error=-VPRIM_BOOST_mV;
+		aim+=error;
+		if (aim<0) aim=0;
+		else if (aim>0xFFFF) aim=0xFFFF;
+	}
+	code=Vcap_mV_ToDacVal((uint16_t)aim);
+	if (code!=vprim.dac_code)
+	{
+		HAL_DAC_SetValue(&hdac1, DAC_CHANNEL_2, DAC_ALIGN_12B_R, code);
+		vprim.dac_code=code;
+	}
+}
+
+
+
+// -------------
+// ADC readings
+// -------------
+// The ADC does one scan of its 4 ranks per trigger, and the DMA puts the scans in adc_buffer, first one half then the other, with
+// an interrupt after each. Pulses start the scans (the TIM14 interrupt as it turns a pulse on, or TIM1 channel 4 in hardware), so
+// the current sense reading is always from the same point in a pulse. With no pulses, adc_poll() starts them instead.
+// The interrupts only note which half is done, and adc_pump() does the filtering in the main loop while the DMA fills the other half.
+
+static void adc_scan_done(uint8_t half)
+{
+	adc.polled[half]=adc.polling;
+	adc.polling=0;
+	post_event(half ? EVENT_ADC_SCAN1 : EVENT_ADC_SCAN0);
+}
+
+void HAL_ADC_ConvHalfCpltCallback(ADC_HandleTypeDef *hadc)
+{
+	adc_scan_done(0);
+}
+
+void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef *hadc)
+{
+	adc_scan_done(1);
+}
+
+//main loop: filter a scan that has come in. Scans come at the pulse rate, or every ADC_POLL_US without pulses, so how much
+//time the filters average over goes with that. Nothing here divides
+void adc_pump(uint8_t half)
+{
+	const volatile uint16_t *scan=&adc_buffer[half*ADC_CHANNELS];
+	uint8_t i;
+
+	for (i=0; i<ADC_CHANNELS; i++)
+	{
+		if (!adc.scans) adc.filtered[i]=(uint32_t)scan[i] << 4;		//start from the first reading, not from 0
+		else adc.filtered[i]+=((int32_t)((uint32_t)scan[i] << 4)-(int32_t)adc.filtered[i]) >> adc_filter_shift[i];
+	}
+	adc.scans++;
+	adc.scanned_us=timebase_us();
+
+	//4096 = 3.3V, through a 4:1 divider, so mV = reading * 3300 * 4 / 4096 = * 825/256. And the filter outputs are Q4
+	adc.cap_mV=(uint16_t)((adc.filtered[ADC_CAP]*825) >> 12);
+	adc.batt_mV=(uint16_t)((adc.filtered[ADC_BATT]*825) >> 12);
+	adc.pot=(uint8_t)((adc.filtered[ADC_POT]*100+0x8000) >> 16);
+
+	if (!adc.polled[half])
+	{
+		adc.current=scan[ADC_CURRENT];
+		if (adc.current>adc.current_max) adc.current_max=adc.current;
+		adc.pulse_scans++;
+		charge_update(adc.current);
+	}
+}
+
+//main loop, each pass. Starts a scan if none has come in for ADC_POLL_US, so the readings keep coming between bursts and in pauses.
+//While the pulses are running it leaves them to it for longer, as a poll that lands on a pulse takes its current reading away
+void adc_poll()
+{
+	uint64_t now=timebase_us();
+
+	if (now-adc.scanned_us < (!power.buck_on ? ADC_POLL_IDLE_US : pulse_running.stopped ? ADC_POLL_US : ADC_POLL_BURST_US)) return;
+	adc.scanned_us=now;		//once per interval, even if a pulse got the ADC first
+	__disable_irq();		//so a pulse can't start a scan between the check and the start, and have it taken as this one
+#if PULSE_ENGINE_TIM1
+	if (!adc.polling)
+	{
+		//the ADC only takes TIM1 channel 4 as a trigger, so make a compare event by hand
+		adc.polling=1;
+		htim1.Instance->EGR=TIM_EGR_CC4G;
+	}
+#else
+	if (!(hadc1.Instance->CR & ADC_CR_ADSTART))
+	{
+		adc.polling=1;
+		LL_ADC_REG_StartConversion(hadc1.Instance);
+	}
+#endif
+	__enable_irq();
+}
+
+
+
+// -----------------
+// Constant charge
+// -----------------
+// Open loop, how much a pulse delivers depends on the load: the same volts push more current through wet electrodes than dry
+// ones. With settings.charge_per_V set, the pulses' on times are scaled to hold the charge per pulse where it would be into a
+// reference load, the one that reads charge_per_V per volt on the current sense. The voltage is still set by the burst and the
+// level, so they still set the intensity. Charge is taken as the current sense reading (from early in the pulse) times the on time.
+
+//main loop, with the current sense reading of each pulse. The on time has to go up by target/current, and rather than divide,
+//each pulse moves the gain by how far current*gain is from the target. Each step closes the gap by current/4096 of itself,
+//so for a strong reading it is there in a pulse or two, and for a weak one in some tens of pulses. The reading doesn't depend
+//on the on time, so the pulse the slot code has already filled in doesn't upset it
+void charge_update(uint16_t current)
+{
+	int32_t gain;
+
+	if (!settings.charge_per_V) return;
+	charge.target=(uint16_t)((vprim.setpoint_mV*charge_ref_q16) >> 16);
+	gain=(int32_t)charge.gain_q12+(int32_t)charge.target-(int32_t)(((uint32_t)current*charge.gain_q12) >> 12);
+	if (gain<CHARGE_GAIN_MIN) gain=CHARGE_GAIN_MIN;
+	else if (gain>CHARGE_GAIN_MAX) gain=CHARGE_GAIN_MAX;
+	charge.gain_q12=(uint16_t)gain;
+}
+
+//the on time for a pulse the burst wants pw long, in a period that long. It is only lengthened as far as half the period
+//(or pw, if that is already more), so the off time is never squeezed to nothing. That keeps it within the slot's 16 bit on_time
+uint32_t charge_on_time(uint32_t pw, uint32_t period)
+{
+	uint32_t on=(pw*charge.gain_q12) >> 12;
+	uint32_t limit=period >> 1;
+
+	if (on>pw && on>limit) on=(pw>limit) ? pw : limit;
+	return on;
+}
+
+
+
+// --------------
+// Power saving
+// --------------
+// Off batteries, the NeoDK spends most of its time waiting, for the host or for the next pulse. Everything it waits for comes with
+// an interrupt (frames through the UART DMA, ADC scans, the pulse timer, and the 1ms SysTick for anything timed), so the main loop
+// sleeps in __WFI whenever it has caught up. Sleep rather than Stop: Stop would halt the DMA the frames come in through, and the
+// pulse timers and ADC with it. Between bursts the buck is the bigger draw, so it is turned off once the outputs have been idle
+// for BUCK_IDLE_OFF_MS, and the ADC is polled less often while it is.
+
+//main loop, when it has nothing to do until an interrupt. Interrupts are masked from the check to the WFI, so one that comes in
+//between still wakes it (a pending interrupt does, masked or not) and is taken as soon as they are unmasked again
+void power_sleep()
+{
+	__disable_irq();
+	if (!pending_events)
+	{
+		profile_pass_end();
+		__WFI();
+	}
+	__enable_irq();
+}
+
+//main loop, with the outputs stopped and nothing queued
+void power_idle()
+{
+	if (power.buck_on && HAL_GetTick()-power.idle_since >= BUCK_IDLE_OFF_MS)
+	{
+		HAL_GPIO_WritePin(BUCK_EN_GPIO_Port, BUCK_EN_Pin, GPIO_PIN_RESET);
+		power.buck_on=0;
+	}
+	power_sleep();
+}
+
+//as the outputs start. The buck charges the capacitors at its own pace, and vprim_update() follows them up from wherever they are
+void power_wake()
+{
+	power.idle_since=HAL_GetTick();
+	if (power.buck_on) return;
+	HAL_GPIO_WritePin(BUCK_EN_GPIO_Port, BUCK_EN_Pin, GPIO_PIN_SET);
+	power.buck_on=1;
+}
+
+
+
+// ------------------------
+// Settings kept in flash
+// ------------------------
+
+//take new settings into use, if they make sense
+bool settings_apply(const _settings *new_settings)
+{
+	uint8_t i;
+
+	if (new_settings->level>=LEVELS) return false;
+	for (i=0; i<LEVELS; i++) if (new_settings->levels[i]>100) return false;
+	if (new_settings->vprim_max_mV < new_settings->vprim_min_mV+1000) return false;		//keeps vprim_dac_scale in 16 bits
+	if (new_settings->slew_mV_per_ms<1 || new_settings->slew_mV_per_ms>10000) return false;		//keeps vprim.slew_q16 in 32 bits
+	if (new_settings->charge_per_V>CHARGE_PER_V_MAX) return false;		//and charge.target in 16 bits
+	settings=*new_settings;
+	vprim_dac_scale=(4095u*4096u) / (settings.vprim_max_mV-settings.vprim_min_mV);		//once here, rather than each time the DAC is set
+	vprim_slew_q16=((uint32_t)settings.slew_mV_per_ms << 16) / 1000;
+	charge_ref_q16=((uint32_t)settings.charge_per_V << 16) / 1000;
+	if (!settings.charge_per_V) charge.gain_q12=CHARGE_GAIN_ONE;
+	return true;
+}
+
+//at power up: the saved settings, or the defaults (which are what was hard coded before) if there aren't any
+void settings_init()
+{
+	const _settings defaults={1, {10, 30, 50}, VPRIM_MIN_mV, VPRIM_MAX_mV, VPRIM_SLEW_mV_PER_MS, 0};
+	const uint8_t *saved;
+	uint16_t length;
+
+	saved=store_find(STORE_KEY_SETTINGS, &length);
+	if (!saved || length!=sizeof(_settings) || !settings_apply((const _settings *)saved)) settings_apply(&defaults);
+}
+
+
+
+// -------------------------
+// Record store in flash
+// -------------------------
+// Records (a key and some data) are only ever added to the end of the page in use. The newest good record of a key is the one
+// that counts, so changing a setting is one more record rather than an erase. When the page is full, the newest record of each
+// key is copied to the next page, and that page takes over. The pages take turns, so each gets erased half as often as one page
+// would.
+// Anything cut short by a power cut is passed over: a record header goes in before its data, so a record with its data missing
+// fails its CRC. A new page's header goes in last, after its records, so until then the old page is still the one in use.
+// Writing flash stalls the core (a page erase takes about 22ms), so it is only done from the main loop with the pulse engine
+// stopped, see store_flush(). The RX ring doesn't last that long, so the host is asked to hold its frames while it happens.
+
+// Where the firmware image ends in flash: the initial values of .data are the last thing in it. The symbols are the CubeMX
+// linker script's. The simulator, whose code isn't in its flash, has its own
+#ifndef IMAGE_END
+extern uint8_t _sidata[], _sdata[], _edata[];
+#define IMAGE_END	((uintptr_t)_sidata+(uintptr_t)(_edata-_sdata))
+#endif
+
+//page n of the store. The store is the last pages of flash, however big the part is. store_init() checks the image is clear of it
+static const uint8_t *store_page(uint8_t n)
+{
+	return (const uint8_t *)(FLASH_BASE + (FLASH_PAGE_NB - STORE_PAGES + n) * FLASH_PAGE_SIZE);
+}
+
+//bytes to flash that has been erased since it was last written. at is a multiple of 8, and the end is padded to 8 bytes
+static bool store_program(const uint8_t *at, const void *data, uint16_t bytes)
+{
+	const uint8_t *from=data;
+	uint64_t dword;
+	uint8_t n;
+
+	while (bytes)
+	{
+		n=(bytes<8) ? bytes : 8;
+		dword=0;
+		memcpy(&dword, from, n);
+		if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, (uint32_t)(uintptr_t)at, dword)!=HAL_OK) return false;
+		at+=8;
+		from+=n;
+		bytes-=n;
+	}
+	return true;
+}
+
+//find the records on the page in use, and where the next one goes
+static void store_scan()
+{
+	const _store_record *record;
+	uint32_t size;
+
+	memset(store.record, 0, sizeof(store.record));
+	store.used=sizeof(_store_page);
+	while (store.used+sizeof(_store_record) <= FLASH_PAGE_SIZE)
+	{
+		record=(const _store_record *)(store.page+store.used);
+		if (record->key==0xFF) return;		//erased, so that's the end
+		size=sizeof(_store_record)+((record->length+7u) & ~7u);
+		if (store.used+size > FLASH_PAGE_SIZE) break;		//a header that's gone wrong. Nothing more goes on this page
+		if (record->key && record->key<STORE_KEYS && frame_crc((const uint8_t *)(record+1), record->length)==record->crc)
+			store.record[record->key]=store.used;
+		store.used+=size;
+	}
+	store.used=FLASH_PAGE_SIZE;		//full, the next write moves to the next page
+}
+
+//copy the newest record of each key, except skip (which is about to be written anyway), to the next page and make that the page in use
+static bool store_compact(uint8_t skip)
+{
+	FLASH_EraseInitTypeDef erase={0};
+	uint32_t page_error;
+	uint8_t next=(store.index+1==STORE_PAGES) ? 0 : store.index+1;
+	const uint8_t *to=store_page(next);
+	_store_page header={STORE_MAGIC, store.sequence+1};
+	const _store_record *record;
+	uint16_t used=sizeof(_store_page);
+	uint8_t key;
+
+	erase.TypeErase=FLASH_TYPEERASE_PAGES;
+	erase.Banks=FLASH_BANK_1;
+	erase.Page=FLASH_PAGE_NB-STORE_PAGES+next;
+	erase.NbPages=1;
+	if (HAL_FLASHEx_Erase(&erase, &page_error)!=HAL_OK) return false;
+	for (key=1; key<STORE_KEYS; key++)
+	{
+		if (key==skip || !store.record[key]) continue;
+		record=(const _store_record *)(store.page+store.record[key]);
+		if (!store_program(to+used, record, sizeof(_store_record)+record->length)) return false;
+		used+=sizeof(_store_record)+((record->length+7u) & ~7u);
+	}
+	if (!store_program(to, &header, sizeof(header))) return false;
+	store.page=to;
+	store.index=next;
+	store.sequence=header.sequence;
+	store_scan();
+	return true;
+}
+
+//at power up: find the page in use, the one with the highest sequence number. A new board has none, and gets its first page
+//with its first write, so power up never waits on flash. A firmware that has grown into the store's pages leaves it alone:
+//its code would be read as records, and the first save would erase it
+void store_init()
+{
+	const _store_page *header;
+	uint8_t n;
+
+	store.page=NULL;
+	store.pending=0;
+	store.index=STORE_PAGES-1;		//so with no page yet, the first write starts on the first one
+	store.sequence=0;
+	store.used=FLASH_PAGE_SIZE;
+	memset(store.record, 0, sizeof(store.record));
+	store.in_image=IMAGE_END > (uintptr_t)store_page(0);
+	if (store.in_image) return;		//nothing saved is found, and saves fail with STATUS_SAVE_FAILED
+	for (n=0; n<STORE_PAGES; n++)
+	{
+		header=(const _store_page *)store_page(n);
+		if (header->magic==STORE_MAGIC && (!store.page || (int32_t)(header->sequence-store.sequence) > 0))
+		{
+			store.page=(const uint8_t *)header;
+			store.index=n;
+			store.sequence=header->sequence;
+		}
+	}
+	if (store.page) store_scan();
+}
+
+//the data of the newest record of key, or NULL if there isn't one
+const uint8_t *store_find(uint8_t key, uint16_t *length)
+{
+	const _store_record *record;
+
+	if (!store.page || !key || key>=STORE_KEYS || !store.record[key]) return NULL;
+	record=(const _store_record *)(store.page+store.record[key]);
+	*length=record->length;
+	return (const uint8_t *)(record+1);
+}
+
+//add a record. Only with the pulse engine stopped, see above
+bool store_write(uint8_t key, const void *data, uint16_t length)
+{
+	_store_record header={key, 0, length, frame_crc(data, length), 0};
+	uint32_t size=sizeof(_store_record)+((length+7u) & ~7u);
+	bool ok;
+
+	if (!key || key>=STORE_KEYS || store.in_image) return false;
+	HAL_FLASH_Unlock();
+	ok=(store.used+size <= FLASH_PAGE_SIZE || store_compact(key)) && store.used+size <= FLASH_PAGE_SIZE
+			&& store_program(store.page+store.used, &header, sizeof(header))
+			&& store_program(store.page+store.used+sizeof(header), data, length);
+	HAL_FLASH_Lock();
+	if (store.page) store_scan();		//picks the new record up, or steps over what a failed write left
+	return ok;
+}
+
+//main loop, once the pulse engine is stopped: write whatever the host has asked to be saved. STATUS_SAVING asks the host to
+//hold its frames, and the writing waits until the line has been quiet for STORE_QUIET_MS, taking the frames that were already
+//on their way meanwhile. Then nothing comes in while the core is stalled, and the RX ring can't be run over. STATUS_SAVED
+//or STATUS_SAVE_FAILED says the host can carry on
+void store_flush()
+{
+	uint32_t received, started, quiet_since;
+	bool ok=true;
+
+	if (!store.pending) return;
+	status_send(STATUS_SAVING);
+	received=usart_rx.received;
+	started=quiet_since=HAL_GetTick();
+	while (HAL_GetTick()-quiet_since < STORE_QUIET_MS && HAL_GetTick()-started < STORE_QUIET_MAX_MS)
+	{
+		event_pump();
+		if (usart_rx.received!=received)
+		{
+			received=usart_rx.received;
+			quiet_since=HAL_GetTick();
+		}
+		power_sleep();
+	}
+	if (store.pending & 1<<STORE_KEY_SETTINGS) ok=store_write(STORE_KEY_SETTINGS, &settings, sizeof(settings));
+	if (store.pending & 1<<STORE_KEY_PATTERN) ok=store_write(STORE_KEY_PATTERN, pattern.code, store.pattern_length) && ok;
+	store.pending=0;
+	status_send(ok ? STATUS_SAVED : STATUS_SAVE_FAILED);
+}
+
+
+
+// -----------------------------
+// modulator waveform functions
+// -----------------------------
+
+// wave_tables[waveform-1] for WAVE_SINE to WAVE_EXPONENTIAL. WAVE_TABLE_SIZE+1 points over a cycle, see NeoDK.h
+const uint16_t wave_tables[WAVE_TABLES][WAVE_TABLE_SIZE+1] = {
+		//sine
+		{ 0, 50, 101, 151, 201, 251, 301, 351, 401, 451, 501, 551, 601, 651, 700, 750, 799, 848, 897, 946, 995, 1044, 1092, 1141, 1189, 1237, 1285, 1332, 1380, 1427, 1474, 1521, 1567, 1614, 1660, 1706, 1751, 1797, 1842, 1886, 1931, 1975, 2019, 2062, 2106, 2149, 2191, 2234, 2276, 2317, 2359, 2399, 2440, 2480, 2520, 2559, 2598, 2637, 2675, 2713, 2751, 2788, 2824, 2861, 2896, 2932, 2967, 3001, 3035, 3068, 3102, 3134, 3166, 3198, 3229, 3260, 3290, 3320, 3349, 3378, 3406, 3433, 3461, 3487, 3513, 3539, 3564, 3588, 3612, 3636, 3659, 3681, 3703, 3724, 3745, 3765, 3784, 3803, 3822, 3839, 3857, 3873, 3889, 3905, 3920, 3934, 3948, 3961, 3973, 3985, 3996, 4007, 4017, 4027, 4036, 4044, 4052, 4059, 4065, 4071, 4076, 4081, 4085, 4088, 4091, 4093, 4095, 4096, 4096, 4096, 4095, 4093, 4091, 4088, 4085, 4081, 4076, 4071, 4065, 4059, 4052, 4044, 4036, 4027, 4017, 4007, 3996, 3985, 3973, 3961, 3948, 3934, 3920, 3905, 3889, 3873, 3857, 3839, 3822, 3803, 3784, 3765, 3745, 3724, 3703, 3681, 3659, 3636, 3612, 3588, 3564, 3539, 3513, 3487, 3461, 3433, 3406, 3378, 3349, 3320, 3290, 3260, 3229, 3198, 3166, 3134, 3102, 3068, 3035, 3001, 2967, 2932, 2896, 2861, 2824, 2788, 2751, 2713, 2675, 2637, 2598, 2559, 2520, 2480, 2440, 2399, 2359, 2317, 2276, 2234, 2191, 2149, 2106, 2062, 2019, 1975, 1931, 1886, 1842, 1797, 1751, 1706, 1660, 1614, 1567, 1521, 1474, 1427, 1380, 1332, 1285, 1237, 1189, 1141, 1092, 1044, 995, 946, 897, 848, 799, 750, 700, 651, 601, 551, 501, 451, 401, 351, 301, 251, 201, 151, 101, 50, 0 },
+		//sawtooth
+		{ 0, 16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256, 272, 288, 304, 320, 336, 352, 368, 384, 400, 416, 432, 448, 464, 480, 496, 512, 528, 544, 560, 576, 592, 608, 624, 640, 656, 672, 688, 704, 720, 736, 752, 768, 784, 800, 816, 832, 848, 864, 880, 896, 912, 928, 944, 960, 976, 992, 1008, 1024, 1040, 1056, 1072, 1088, 1104, 1120, 1136, 1152, 1168, 1184, 1200, 1216, 1232, 1248, 1264, 1280, 1296, 1312, 1328, 1344, 1360, 1376, 1392, 1408, 1424, 1440, 1456, 1472, 1488, 1504, 1520, 1536, 1552, 1568, 1584, 1600, 1616, 1632, 1648, 1664, 1680, 1696, 1712, 1728, 1744, 1760, 1776, 1792, 1808, 1824, 1840, 1856, 1872, 1888, 1904, 1920, 1936, 1952, 1968, 1984, 2000, 2016, 2032, 2048, 2064, 2080, 2096, 2112, 2128, 2144, 2160, 2176, 2192, 2208, 2224, 2240, 2256, 2272, 2288, 2304, 2320, 2336, 2352, 2368, 2384, 2400, 2416, 2432, 2448, 2464, 2480, 2496, 2512, 2528, 2544, 2560, 2576, 2592, 2608, 2624, 2640, 2656, 2672, 2688, 2704, 2720, 2736, 2752, 2768, 2784, 2800, 2816, 2832, 2848, 2864, 2880, 2896, 2912, 2928, 2944, 2960, 2976, 2992, 3008, 3024, 3040, 3056, 3072, 3088, 3104, 3120, 3136, 3152, 3168, 3184, 3200, 3216, 3232, 3248, 3264, 3280, 3296, 3312, 3328, 3344, 3360, 3376, 3392, 3408, 3424, 3440, 3456, 3472, 3488, 3504, 3520, 3536, 3552, 3568, 3584, 3600, 3616, 3632, 3648, 3664, 3680, 3696, 3712, 3728, 3744, 3760, 3776, 3792, 3808, 3824, 3840, 3856, 3872, 3888, 3904, 3920, 3936, 3952, 3968, 3984, 4000, 4016, 4032, 4048, 4064, 4080, 4096 },
+		//triangle
+		{ 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 480, 512, 544, 576, 608, 640, 672, 704, 736, 768, 800, 832, 864, 896, 928, 960, 992, 1024, 1056, 1088, 1120, 1152, 1184, 1216, 1248, 1280, 1312, 1344, 1376, 1408, 1440, 1472, 1504, 1536, 1568, 1600, 1632, 1664, 1696, 1728, 1760, 1792, 1824, 1856, 1888, 1920, 1952, 1984, 2016, 2048, 2080, 2112, 2144, 2176, 2208, 2240, 2272, 2304, 2336, 2368, 2400, 2432, 2464, 2496, 2528, 2560, 2592, 2624, 2656, 2688, 2720, 2752, 2784, 2816, 2848, 2880, 2912, 2944, 2976, 3008, 3040, 3072, 3104, 3136, 3168, 3200, 3232, 3264, 3296, 3328, 3360, 3392, 3424, 3456, 3488, 3520, 3552, 3584, 3616, 3648, 3680, 3712, 3744, 3776, 3808, 3840, 3872, 3904, 3936, 3968, 4000, 4032, 4064, 4096, 4064, 4032, 4000, 3968, 3936, 3904, 3872, 3840, 3808, 3776, 3744, 3712, 3680, 3648, 3616, 3584, 3552, 3520, 3488, 3456, 3424, 3392, 3360, 3328, 3296, 3264, 3232, 3200, 3168, 3136, 3104, 3072, 3040, 3008, 2976, 2944, 2912, 2880, 2848, 2816, 2784, 2752, 2720, 2688, 2656, 2624, 2592, 2560, 2528, 2496, 2464, 2432, 2400, 2368, 2336, 2304, 2272, 2240, 2208, 2176, 2144, 2112, 2080, 2048, 2016, 1984, 1952, 1920, 1888, 1856, 1824, 1792, 1760, 1728, 1696, 1664, 1632, 1600, 1568, 1536, 1504, 1472, 1440, 1408, 1376, 1344, 1312, 1280, 1248, 1216, 1184, 1152, 1120, 1088, 1056, 1024, 992, 960, 928, 896, 864, 832, 800, 768, 736, 704, 672, 640, 608, 576, 544, 512, 480, 448, 416, 384, 352, 320, 288, 256, 224, 192, 160, 128, 96, 64, 32, 0 },
+		//square
+		{ 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4096 },
+		//sawtooth down
+		{ 4096, 4080, 4064, 4048, 4032, 4016, 4000, 3984, 3968, 3952, 3936, 3920, 3904, 3888, 3872, 3856, 3840, 3824, 3808, 3792, 3776, 3760, 3744, 3728, 3712, 3696, 3680, 3664, 3648, 3632, 3616, 3600, 3584, 3568, 3552, 3536, 3520, 3504, 3488, 3472, 3456, 3440, 3424, 3408, 3392, 3376, 3360, 3344, 3328, 3312, 3296, 3280, 3264, 3248, 3232, 3216, 3200, 3184, 3168, 3152, 3136, 3120, 3104, 3088, 3072, 3056, 3040, 3024, 3008, 2992, 2976, 2960, 2944, 2928, 2912, 2896, 2880, 2864, 2848, 2832, 2816, 2800, 2784, 2768, 2752, 2736, 2720, 2704, 2688, 2672, 2656, 2640, 2624, 2608, 2592, 2576, 2560, 2544, 2528, 2512, 2496, 2480, 2464, 2448, 2432, 2416, 2400, 2384, 2368, 2352, 2336, 2320, 2304, 2288, 2272, 2256, 2240, 2224, 2208, 2192, 2176, 2160, 2144, 2128, 2112, 2096, 2080, 2064, 2048, 2032, 2016, 2000, 1984, 1968, 1952, 1936, 1920, 1904, 1888, 1872, 1856, 1840, 1824, 1808, 1792, 1776, 1760, 1744, 1728, 1712, 1696, 1680, 1664, 1648, 1632, 1616, 1600, 1584, 1568, 1552, 1536, 1520, 1504, 1488, 1472, 1456, 1440, 1424, 1408, 1392, 1376, 1360, 1344, 1328, 1312, 1296, 1280, 1264, 1248, 1232, 1216, 1200, 1184, 1168, 1152, 1136, 1120, 1104, 1088, 1072, 1056, 1040, 1024, 1008, 992, 976, 960, 944, 928, 912, 896, 880, 864, 848, 832, 816, 800, 784, 768, 752, 736, 720, 704, 688, 672, 656, 640, 624, 608, 592, 576, 560, 544, 528, 512, 496, 480, 464, 448, 432, 416, 400, 384, 368, 352, 336, 320, 304, 288, 272, 256, 240, 224, 208, 192, 176, 160, 144, 128, 112, 96, 80, 64, 48, 32, 16, 0 },
+		//exponential
+		{ 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 16, 17, 19, 20, 22, 23, 25, 26, 28, 30, 31, 33, 35, 37, 38, 40, 42, 44, 46, 48, 50, 52, 54, 56, 58, 60, 62, 64, 66, 69, 71, 73, 76, 78, 80, 83, 85, 88, 90, 93, 96, 99, 101, 104, 107, 110, 113, 116, 119, 122, 125, 128, 131, 135, 138, 141, 145, 148, 152, 155, 159, 163, 166, 170, 174, 178, 182, 186, 190, 195, 199, 203, 208, 212, 217, 221, 226, 231, 235, 240, 245, 250, 256, 261, 266, 271, 277, 283, 288, 294, 300, 306, 312, 318, 324, 330, 337, 343, 350, 357, 363, 370, 377, 384, 392, 399, 407, 414, 422, 430, 438, 446, 454, 462, 471, 480, 488, 497, 506, 515, 525, 534, 544, 554, 563, 574, 584, 594, 605, 615, 626, 637, 649, 660, 672, 683, 695, 708, 720, 732, 745, 758, 771, 785, 798, 812, 826, 840, 855, 869, 884, 899, 915, 930, 946, 962, 979, 995, 1012, 1029, 1047, 1064, 1082, 1100, 1119, 1138, 1157, 1176, 1196, 1216, 1236, 1257, 1278, 1299, 1321, 1343, 1366, 1388, 1411, 1435, 1459, 1483, 1507, 1532, 1558, 1583, 1609, 1636, 1663, 1690, 1718, 1746, 1775, 1804, 1834, 1864, 1894, 1926, 1957, 1989, 2022, 2055, 2088, 2122, 2157, 2192, 2228, 2264, 2301, 2338, 2376, 2415, 2454, 2494, 2535, 2576, 2617, 2660, 2703, 2747, 2791, 2836, 2882, 2929, 2976, 3024, 3073, 3123, 3173, 3224, 3276, 3329, 3383, 3437, 3492, 3549, 3606, 3664, 3723, 3782, 3843, 3905, 3968, 4031, 4096 }
+};
+
+// A modulator is set up once per burst by modulator_init(), which does the only divide. After that it is stepped along
+// by modulator_advance() one pulse at a time, and its value is a multiply to get the phase, a wavetable lookup, and a
+// multiply and shift to scale it. Every table waveform, built in or uploaded, costs the same.
+// The position is kept in microseconds and wrapped at the end of each cycle, so long bursts don't drift. The phase is an
+// unsigned 32 bit fraction of a cycle (so the top 16 bits are the Q16 position in the cycle).
+// The waveforms return 0 to 4096 (Q12) rather than 0 to 1000, so scaling is a shift instead of a /1000.
+
+void modulator_init(_modulator *mod, uint8_t waveform, uint16_t mod_period_ms, uint16_t unmodulated, uint16_t at_zero, uint16_t at_full)
+{
+	mod->phase_inc=0;
+	mod->period_us=0;
+	mod->position_us=0;
+	mod->table=NULL;
+	mod->random=0;
+	mod->base=unmodulated;
+	mod->span=0;
+	if (mod_period_ms==0) return;		//0 = not modulated
+
+	if (waveform>=WAVE_SINE && waveform<=WAVE_TABLES) mod->table=wave_tables[waveform-WAVE_SINE];
+	else if (waveform>=WAVE_CUSTOM && waveform<WAVE_CUSTOM+WAVE_SLOTS) mod->table=wave_slots[waveform-WAVE_CUSTOM];
+	else if (waveform==WAVE_RANDOM_HOLD || waveform==WAVE_NOISE)
+	{
+		mod->random=waveform;
+		mod->level=random16() >> 4;
+	}
+	else return;		//WAVE_NONE, or unknown
+	mod->period_us=(uint32_t)mod_period_ms*1000;
+	mod->phase_inc=0xFFFFFFFFu / mod->period_us;
+	mod->base=at_zero;
+	mod->span=(int32_t)at_full-(int32_t)at_zero;		//signed, so a minimum above the base value works too
+}
+
+//set the three modulators up for a new burst. Same scaling as before: period goes from period to period_mod_min, the others go from their min up to the burst value.
+void modulators_init(const _burst *burst)
+{
+	modulator_init(&period_modulator, burst->period_mod_waveform, burst->period_mod_freq, burst->period, burst->period, burst->period_mod_min);
+	modulator_init(&pw_modulator, burst->pw_mod_waveform, burst->pw_mod_freq, burst->pw, burst->pw_mod_min, burst->pw);
+	modulator_init(&v_modulator, burst->v_mod_waveform, burst->v_mod_freq, burst->volts, burst->v_mod_min, burst->volts);
+	route_modulator_init(&route_modulator, burst);
+}
+
+//change a modulator's settings part way through a burst. It carries on from the same point in its cycle, rather than
+//starting the cycle again like modulator_init() does, so a setting dragged on the host doesn't make the waveform jump
+void modulator_update(_modulator *mod, uint8_t waveform, uint16_t mod_period_ms, uint16_t unmodulated, uint16_t at_zero, uint16_t at_full)
+{
+	uint32_t phase=mod->period_us ? mod->position_us * mod->phase_inc : 0;
+	uint8_t random=mod->random;
+	uint16_t level=mod->level;
+
+	modulator_init(mod, waveform, mod_period_ms, unmodulated, at_zero, at_full);
+	if (!mod->period_us) return;
+	mod->position_us=((uint64_t)phase * mod->period_us) >> 32;
+	if (random && mod->random) mod->level=level;		//and a random waveform holds its level until it would have changed anyway
+}
+
+// FRAME_LIVE_DELTA. The values follow the bitmap in LIVE_ bit order, this many bytes each
+static const uint8_t live_field_size[LIVE_FIELDS]={
+		1, 2, 1,		//pw, period, volts
+		1, 2, 1,		//v_mod_waveform, v_mod_freq, v_mod_min
+		1, 2, 1,		//pw_mod_...
+		1, 2, 2,		//period_mod_...
+		1, 1, 2, 1		//pol_mod_freq, output_triacs, route_mod_routes, route_mod_pulses
+};
+
+//the bytes of values a FRAME_LIVE_DELTA with these fields carries
+uint8_t live_delta_length(uint16_t fields)
+{
+	uint8_t i, length=0;
+
+	for (i=0; i<LIVE_FIELDS; i++)
+		if (fields & 1u<<i) length+=live_field_size[i];
+	return length;
+}
+
+//main loop, from the frame handler: patch the running burst, and its repetitions, with the fields set. The modulators the
+//fields feed are set up again where they are in their cycles, and the pulse waiting in the spare slot is worked out again.
+//Pulses are only worked out in the main loop, so none has only some of the changes, and the interrupt picks the new values up
+//at the next pulse. The route rotation starts again from output_triacs if any of the route fields change.
+void live_apply(uint16_t fields, const uint8_t *values)
+{
+	_burst *b=&current_burst;
+	uint8_t i;
+	uint16_t v;
+
+	for (i=0; i<LIVE_FIELDS; i++)
+	{
+		if (!(fields & 1u<<i)) continue;
+		v=values[0];
+		if (live_field_size[i]==2) v|=(uint16_t)values[1] << 8;
+		values+=live_field_size[i];
+		switch (1u<<i)
+		{
+			case LIVE_PW:					b->pw=v; break;
+			case LIVE_PERIOD:				b->period=v; break;
+			case LIVE_VOLTS:				b->volts=v; break;
+			case LIVE_V_MOD_WAVEFORM:		b->v_mod_waveform=v; break;
+			case LIVE_V_MOD_FREQ:			b->v_mod_freq=v; break;
+			case LIVE_V_MOD_MIN:			b->v_mod_min=v; break;
+			case LIVE_PW_MOD_WAVEFORM:		b->pw_mod_waveform=v; break;
+			case LIVE_PW_MOD_FREQ:			b->pw_mod_freq=v; break;
+			case LIVE_PW_MOD_MIN:			b->pw_mod_min=v; break;
+			case LIVE_PERIOD_MOD_WAVEFORM:	b->period_mod_waveform=v; break;
+			case LIVE_PERIOD_MOD_FREQ:		b->period_mod_freq=v; break;
+			case LIVE_PERIOD_MOD_MIN:		b->period_mod_min=v; break;
+			case LIVE_POL_MOD_FREQ:			b->pol_mod_freq=v; break;
+			case LIVE_OUTPUT_TRIACS:		b->output_triacs=v; break;
+			case LIVE_ROUTE_MOD_ROUTES:		b->route_mod_routes=v; break;
+			case LIVE_ROUTE_MOD_PULSES:		b->route_mod_pulses=v; break;
+		}
+	}
+
+	//the same scaling as modulators_init()
+	if (fields & LIVE_PERIOD_MODULATOR) modulator_update(&period_modulator, b->period_mod_waveform, b->period_mod_freq, b->period, b->period, b->period_mod_min);
+	if (fields & LIVE_PW_MODULATOR) modulator_update(&pw_modulator, b->pw_mod_waveform, b->pw_mod_freq, b->pw, b->pw_mod_min, b->pw);
+	if (fields & LIVE_V_MODULATOR) modulator_update(&v_modulator, b->v_mod_waveform, b->v_mod_freq, b->volts, b->v_mod_min, b->volts);
+	if (fields & LIVE_ROUTE_MODULATOR) route_modulator_init(&route_modulator, b);
+	if (fields & (LIVE_PERIOD_MODULATOR | LIVE_PW_MODULATOR | LIVE_V_MODULATOR | LIVE_ROUTE_MODULATOR)) pulse_slot_redo(fields & LIVE_ROUTE_MODULATOR);
+}
+
+//move the modulator on by time_us. Steps are a pulse long, so the loop runs once at most for any sensible modulation period
+void modulator_advance(_modulator *mod, uint32_t time_us)
+{
+	if (!mod->period_us) return;
+	mod->position_us+=time_us;
+	while (mod->position_us >= mod->period_us)
+	{
+		mod->position_us-=mod->period_us;
+		if (mod->random==WAVE_RANDOM_HOLD) mod->level=random16() >> 4;
+	}
+	if (mod->random==WAVE_NOISE) mod->level=random16() >> 4;
+}
+
+uint32_t modulator_value(const _modulator *mod)
+{
+	int32_t wave;
+
+	if (!mod->period_us) return mod->base;
+	wave=mod->table ? wave_lookup(mod->table, mod->position_us * mod->phase_inc) : mod->level;
+	return mod->base + ((mod->span * wave) >> 12);
+}
+
+// The route modulator counts pulses rather than time: a burst starts on output_triacs, and if route_mod_routes is set it moves
+// on to the next route in there (in route number order, wrapping round) every route_mod_pulses pulses.
+void route_modulator_init(_route_modulator *mod, const _burst *burst)
+{
+	mod->route=(burst->output_triacs<OUTPUT_ROUTES) ? burst->output_triacs : 0;		//unknown route = all off
+	mod->routes=burst->route_mod_routes & ((1u<<OUTPUT_ROUTES)-1);
+	mod->pulses=burst->route_mod_pulses ? burst->route_mod_pulses : 1;
+	mod->count=mod->pulses;
+}
+
+//the route for the next pulse. The search looks at each route once at most
+uint8_t route_modulator_next(_route_modulator *mod)
+{
+	uint8_t route=mod->route;
+
+	if (mod->routes && !--mod->count)
+	{
+		mod->count=mod->pulses;
+		do {
+			if (++mod->route>=OUTPUT_ROUTES) mod->route=0;
+		} while (!(mod->routes & (1u<<mod->route)));
+	}
+	return route;
+}
+
+//the modulated times and volts for the pulse the modulators are at, into the spare slot. Returns its period
+static uint32_t pulse_slot_work_out(volatile _pulse_slot *slot)
+{
+	uint32_t period=modulator_value(&period_modulator);
+	uint32_t pw=charge_on_time(modulator_value(&pw_modulator), period);
+
+	slot->on_time=pw;
+	slot->off_time=period-pw;
+	slot->volts=modulator_value(&v_modulator);
+	return period;
+}
+
+//work out the next pulse into the spare slot and hand it over. Main loop only, and only while pulse_slots.ready is 0:
+//the interrupt never touches the spare slot then, and doesn't swap until ready is set.
+void pulse_slot_fill()
+{
+	volatile _pulse_slot *slot=&pulse_slots.slot[pulse_slots.active^1];
+	uint32_t period=pulse_slot_work_out(slot);
+
+	slot->route=route_modulator_next(&route_modulator);
+
+	//the pulse after this one starts a period later
+	modulator_advance(&period_modulator, period);
+	modulator_advance(&pw_modulator, period);
+	modulator_advance(&v_modulator, period);
+
+	pulse_slots.ready=1;
+}
+
+//main loop, after live_apply() has changed the modulators: work the pulse in the spare slot out again, if the interrupt hasn't
+//taken it yet. The modulators have already been moved on past it, so it gets the values of the pulse after, and they aren't
+//moved on again: that pulse's values are used twice, and the modulation stays where it was in its cycle. The route stays, unless
+//the rotation has been set up again.
+void pulse_slot_redo(bool new_route)
+{
+	volatile _pulse_slot *slot=&pulse_slots.slot[pulse_slots.active^1];
+	uint8_t waiting;
+
+	__disable_irq();		//take it back, or find the interrupt already has it
+	waiting=pulse_slots.ready;
+	pulse_slots.ready=0;
+	__enable_irq();
+	if (!waiting) return;
+	pulse_slot_work_out(slot);
+	if (new_route) slot->route=route_modulator_next(&route_modulator);
+	pulse_slots.ready=1;
+}
+
+//throw away a pulse that hasn't been taken yet and queue up the first pulse of the modulation, for a new burst or a repetition.
+//pulse_running.stopped must be set while this runs, so the interrupt doesn't swap slots halfway through.
+void pulse_slots_restart()
+{
+	pulse_slots.ready=0;
+	pulse_slot_fill();
+}
+
+//sleep until an interrupt, unless the flag it clears is clear already or an event is waiting. The check and the WFI are done
+//with interrupts masked, so an interrupt clearing the flag just before the WFI still wakes it, rather than leaving it asleep
+//until the next tick. See power_sleep()
+void power_sleep_while(volatile const uint8_t *busy)
+{
+	__disable_irq();
+	if (*busy && !pending_events)
+	{
+		profile_pass_end();
+		__WFI();
+	}
+	__enable_irq();
+}
+
+//the top 8 bits of the phase pick the step and the next 16 say how far along it we are
+uint16_t wave_lookup(const uint16_t *table, uint32_t phase)
+{
+	int32_t from=table[phase >> 24];
+	int32_t to=table[(phase >> 24)+1];
+
+	return from + (((to-from) * (int32_t)((phase >> 8) & 0xFFFF)) >> 16);
+}
+
+
+
+
+
+
+
+// ----------------
+//  USART TX Stuff
+// ----------------
+
+// Anything can write: the main loop, and interrupts that cut in on it part way through a write of its own. Each writer takes its
+// room with interrupts masked, copies in with them on, and commits with them masked again. The bytes only become committed (free
+// for the DMA to send) when the last writer in has finished, so an interrupt's message waits behind the one it cut into rather
+// than going out ahead of bytes that aren't there yet. The DMA sends what is committed up to the end of the ring, and the
+// transfer complete interrupt chains on from the start of it.
+
+//any context. A message that doesn't fit is dropped whole and counted, so the host never gets part of a frame
+void uart_buffer_write(const uint8_t* data, uint16_t size)
+{
+	uint32_t at, waiting;
+
+	__disable_irq();
+	waiting=usart_tx.reserved-usart_tx.sent;
+	if (waiting+size > TX_BUFFER_SIZE)
+	{
+		usart_tx.dropped++;
+		usart_tx.dropped_bytes+=size;
+		__enable_irq();
+		return;
+	}
+	at=usart_tx.reserved;
+	usart_tx.reserved+=size;
+	usart_tx.writers++;
+	if (waiting+size > usart_tx.most_waiting) usart_tx.most_waiting=waiting+size;
+	__enable_irq();
+
+	while (size--) usart_tx_buffer[at++ % TX_BUFFER_SIZE]=*data++;
+
+	__disable_irq();
+	if (--usart_tx.writers==0) usart_tx.committed=usart_tx.reserved;
+	if (!usart_tx.sending) start_uart_dma();
+	__enable_irq();
+}
+
+void status_send(uint8_t code)
+{
+	uart_buffer_write(&code, 1);
+}
+
+//with interrupts masked, or from the transfer complete interrupt. Sends what is committed, as far as the end of the ring
+void start_uart_dma()
+{
+	uint32_t start=usart_tx.sent % TX_BUFFER_SIZE;
+	uint32_t count=usart_tx.committed-usart_tx.sent;
+
+	if (count > TX_BUFFER_SIZE-start) count=TX_BUFFER_SIZE-start;
+	usart_tx.sending=(uint16_t)count;
+	if (count && HAL_UART_Transmit_DMA(&hlpuart1, &usart_tx_buffer[start], (uint16_t)count)!=HAL_OK) usart_tx.sending=0;		//the next write tries again
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+	uint32_t started=htim2.Instance->CNT;
+
+	usart_tx.sent+=usart_tx.sending;
+	start_uart_dma();		//the rest, from the start of the ring, or whatever was written while that went out. Here, so the line doesn't go quiet until the main loop comes round
+	isr_time(PROFILE_USART_TX, started);
 }
 
 
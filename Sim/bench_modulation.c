@@ -0,0 +1,202 @@
+// -----------------------------------------------------------------------
+// Benchmark: modulator engine vs the old angle/switch/divide main loop code
+// -----------------------------------------------------------------------
+// Runs the old per-loop modulation code (copied here as it was) and the modulators from NeoDK.c over
+// the same bursts and times, checks they give the same answers, and reports the time per main loop
+// pass and how many divides each pass needs.
+//
+// The divide count is the number that matters on the board: the M0+ has no divide instruction, so
+// every / and % is a call into the runtime (__aeabi_uidiv / __aeabi_uidivmod), tens of cycles each.
+// A PC divides in hardware, so the host timings understate the gain on the real thing.
+// On the board, ask for the main loop's profile (FRAME_PROFILE) to see the actual time per pass.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "NeoDK.h"
+
+//nothing is sent over the UART here
+void sim_host_receive(const uint8_t *data, uint16_t len)
+{
+	(void)data;
+	(void)len;
+}
+
+void sim_host_line_error(uint16_t len)
+{
+	(void)len;
+}
+
+static unsigned long divides;
+#define DIV(a, b) (divides++, (a) / (b))
+#define MOD(a, b) (divides++, (a) % (b))
+
+
+// ---------------------------------------------
+// The old code path, from Do_User_Code_While_1
+// ---------------------------------------------
+
+static const uint16_t sine_table[361] = {
+		0, 9, 17, 26, 35, 44, 52, 61, 70, 78, 87, 96, 105, 113, 122, 131, 139, 148, 156, 165, 174, 182, 191, 199, 208, 216, 225, 233, 242, 250, 259, 267, 276, 284, 292, 301, 309, 317, 326, 334, 342, 350, 358, 367, 375, 383, 391, 399, 407, 415, 423, 431, 438, 446, 454, 462, 469, 477, 485, 492, 500, 508, 515, 522, 530, 537, 545, 552, 559, 566, 574, 581, 588, 595, 602, 609, 616, 623, 629, 636, 643, 649, 656, 663, 669, 676, 682, 688, 695, 701, 707, 713, 719, 725, 731, 737, 743, 749, 755, 760, 766, 772, 777, 783, 788, 793, 799, 804, 809, 814, 819, 824, 829, 834, 839, 843, 848, 853, 857, 862, 866, 870, 875, 879, 883, 887, 891, 895, 899, 903, 906, 910, 914, 917, 921, 924, 927, 930, 934, 937, 940, 943, 946, 948, 951, 954, 956, 959, 961, 964, 966, 968, 970, 972, 974, 976, 978, 980, 982, 983, 985, 986, 988, 989, 990, 991, 993, 994, 995, 995, 996, 997, 998, 998, 999, 999, 999, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 999, 999, 999, 998, 998, 997, 996, 995, 995, 994, 993, 991, 990, 989, 988, 986, 985, 983, 982, 980, 978, 976, 974, 972, 970, 968, 966, 964, 961, 959, 956, 954, 951, 948, 946, 943, 940, 937, 934, 930, 927, 924, 921, 917, 914, 910, 906, 903, 899, 895, 891, 887, 883, 879, 875, 870, 866, 862, 857, 853, 848, 843, 839, 834, 829, 824, 819, 814, 809, 804, 799, 793, 788, 783, 777, 772, 766, 760, 755, 749, 743, 737, 731, 725, 719, 713, 707, 701, 695, 688, 682, 676, 669, 663, 656, 649, 643, 636, 629, 623, 616, 609, 602, 595, 588, 581, 574, 566, 559, 552, 545, 537, 530, 522, 515, 508, 500, 492, 485, 477, 469, 462, 454, 446, 438, 431, 423, 415, 407, 399, 391, 383, 375, 367, 358, 350, 342, 334, 326, 317, 309, 301, 292, 284, 276, 267, 259, 250, 242, 233, 225, 216, 208, 199, 191, 182, 174, 165, 156, 148, 139, 131, 122, 113, 105, 96, 87, 78, 70, 61, 52, 44, 35, 26, 17, 9, 0
+};
+
+static uint16_t old_fast_sine(uint16_t angle) {
+	return sine_table[angle];
+}
+
+static uint16_t old_triangle_wave(uint16_t angle) {
+	if (angle <= 180) {
+		return DIV((angle*100), 18);
+	} else {
+		return DIV((36000-(angle*100)), 18);
+	}
+}
+
+static uint16_t old_sawtooth_wave(uint16_t angle) {
+	return DIV((angle*100), 36);
+}
+
+static uint16_t old_square_wave(uint16_t angle) {
+	if (angle <= 180) {
+		return (1000);
+	} else {
+		return (0) ;
+	}
+}
+
+static uint32_t old_angle(uint32_t time_in_burst, uint16_t mod_freq)
+{
+	uint32_t angle=0;
+	if (mod_freq) {
+		angle=MOD(time_in_burst, mod_freq);
+		angle=angle*360;
+		angle=DIV(angle, mod_freq);
+	}
+	return angle;
+}
+
+static uint16_t old_wave(uint8_t waveform, uint32_t angle)
+{
+	switch (waveform) {
+		case 1: return old_fast_sine(angle);
+		case 2: return old_sawtooth_wave(angle);
+		case 3: return old_triangle_wave(angle);
+		case 4: return old_square_wave(angle);
+	}
+	return 0;
+}
+
+static void old_modulations(const _burst *b, uint32_t time_in_burst, uint32_t *period, uint32_t *pw, uint32_t *volts)
+{
+	uint32_t angle;
+
+	angle=old_angle(time_in_burst, b->period_mod_freq);
+	if (b->period_mod_waveform>=1 && b->period_mod_waveform<=4)
+		*period=b->period+DIV((b->period_mod_min-b->period)*old_wave(b->period_mod_waveform, angle), 1000);
+	else
+		*period=b->period;
+
+	angle=old_angle(time_in_burst, b->pw_mod_freq);
+	if (b->pw_mod_waveform>=1 && b->pw_mod_waveform<=4)
+		*pw=b->pw_mod_min+DIV((b->pw-b->pw_mod_min)*old_wave(b->pw_mod_waveform, angle), 1000);
+	else
+		*pw=b->pw;
+
+	angle=old_angle(time_in_burst, b->v_mod_freq);
+	if (b->v_mod_waveform>=1 && b->v_mod_waveform<=4)
+		*volts=b->v_mod_min+DIV((b->volts-b->v_mod_min)*old_wave(b->v_mod_waveform, angle), 1000);
+	else
+		*volts=b->volts;
+}
+
+
+// ---------
+// The runs
+// ---------
+
+//the modulators are stepped along rather than evaluated at a time, so step them a millisecond at a time like the old loop saw it
+static void advance_ms(void)
+{
+	modulator_advance(&period_modulator, 1000);
+	modulator_advance(&pw_modulator, 1000);
+	modulator_advance(&v_modulator, 1000);
+}
+
+static const struct {
+	const char	*name;
+	_burst		burst;
+} cases[] = {
+	{ "all sine", { .duration = 60000, .pw = 200, .period = 4000, .volts = 100,
+			.v_mod_waveform = 1, .v_mod_freq = 500, .v_mod_min = 50,
+			.pw_mod_waveform = 1, .pw_mod_freq = 250, .pw_mod_min = 80,
+			.period_mod_waveform = 1, .period_mod_freq = 1000, .period_mod_min = 8000 } },
+	{ "saw/tri/square", { .duration = 60000, .pw = 150, .period = 2500, .volts = 80,
+			.v_mod_waveform = 4, .v_mod_freq = 700, .v_mod_min = 30,
+			.pw_mod_waveform = 3, .pw_mod_freq = 333, .pw_mod_min = 60,
+			.period_mod_waveform = 2, .period_mod_freq = 1234, .period_mod_min = 5000 } },
+	{ "unmodulated", { .duration = 60000, .pw = 100, .period = 5000, .volts = 60 } },
+};
+
+#define PASSES			20000000u
+#define PASSES_PER_MS	16u		//roughly how often the old loop went round per millisecond of burst
+
+static double seconds(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	volatile uint32_t sink = 0;
+
+	printf("%-16s %12s %12s %8s %14s %14s %10s\n", "burst", "old ns/pass", "new ns/pass", "speedup",
+			"old div/pass", "new div/pass", "max diff");
+	for (unsigned c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		const _burst *b = &cases[c].burst;
+		uint32_t period, pw, volts, max_diff = 0;
+		double t0, t_old, t_new;
+		unsigned long old_divides;
+
+		//same answers? (within rounding: the new waveforms are Q12 rather than 0-1000)
+		modulators_init(b);
+		for (uint32_t ms = 0; ms < 10000; ms++) {
+			old_modulations(b, ms, &period, &pw, &volts);
+			uint32_t d[3] = {
+				(uint32_t)labs((long)modulator_value(&period_modulator) - (long)period),
+				(uint32_t)labs((long)modulator_value(&pw_modulator) - (long)pw),
+				(uint32_t)labs((long)modulator_value(&v_modulator) - (long)volts) };
+			for (int i = 0; i < 3; i++) if (d[i] > max_diff) max_diff = d[i];
+			advance_ms();
+		}
+
+		divides = 0;
+		t0 = seconds();
+		for (uint32_t i = 0; i < PASSES; i++) {
+			old_modulations(b, i / PASSES_PER_MS, &period, &pw, &volts);
+			sink += period + pw + volts;
+		}
+		t_old = seconds() - t0;
+		old_divides = divides;
+
+		modulators_init(b);
+		t0 = seconds();
+		for (uint32_t i = 0, pass_in_ms = 0; i < PASSES; i++) {
+			if (++pass_in_ms == PASSES_PER_MS) {
+				pass_in_ms = 0;
+				advance_ms();
+			}
+			sink += modulator_value(&period_modulator) + modulator_value(&pw_modulator) + modulator_value(&v_modulator);
+		}
+		t_new = seconds() - t0;
+
+		printf("%-16s %12.2f %12.2f %7.1fx %14.1f %14.1f %10u\n", cases[c].name,
+				t_old * 1e9 / PASSES, t_new * 1e9 / PASSES, t_old / t_new,
+				(double)old_divides / PASSES, 0.0, max_diff);
+	}
+	printf("\nmax diff is the largest difference between old and new values over 10s of burst. Sine differs by up to one\n"
+			"table step, and square/step edges can land a millisecond apart, so a whole span shows up there.\n");
+	return sink == 42;
+}
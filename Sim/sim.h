@@ -0,0 +1,58 @@
+// ------------------------------------------------
+// Host simulator: virtual hardware behind the HAL
+// ------------------------------------------------
+
+#ifndef __SIM_H
+#define __SIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <setjmp.h>
+
+#include "stm32g0xx_hal.h"
+
+#define SIM_CORE_HZ			32000000u		// SYSCLK from SystemClock_Config(): HSI16 * 8 / 4
+#define SIM_CYCLES_PER_MS	(SIM_CORE_HZ / 1000u)
+#define SIM_CYCLES_PER_US	(SIM_CORE_HZ / 1000000u)
+
+typedef struct {
+	uint16_t	batt_mV;			//battery voltage seen on BAT_VOLT_SENSE (before the 4:1 divider)
+	uint8_t		pot_percent;		//level pot position, 0 to 100
+	uint8_t		pushbutton;			//0 = released, 1 = pressed
+	uint8_t		load_percent;		//how well the load conducts: scales the current sense reading, 100 = as modelled
+} _sim_inputs;
+
+extern uint64_t sim_cycles;			//the virtual clock, in core clock cycles
+extern jmp_buf sim_exit;			//longjmp'd to when the run is over
+extern _sim_inputs sim_inputs;
+
+void sim_mx_init(void);
+void sim_init(uint64_t end_cycles);
+void sim_advance(uint32_t cycles);
+void sim_set_trace(FILE *trace);
+
+// queue bytes on the host->NeoDK line. They go out back to back at the current baud rate, starting no
+// earlier than at_cycles and no earlier than the end of anything already queued.
+void sim_uart_inject(uint64_t at_cycles, const uint8_t *data, uint16_t len);
+// the host stops sending from at_cycles (finishing the write it is in) until it is released, and starts again at at_cycles
+void sim_uart_hold(uint64_t at_cycles);
+void sim_uart_release(uint64_t at_cycles);
+
+// change one of sim_inputs (&sim_inputs.pushbutton, say) to value at at_cycles
+void sim_input_at(uint64_t at_cycles, uint8_t *input, uint8_t value);
+
+// the host end of the NeoDK->host line (sim_main.c). Gets whatever the firmware transmits, as it starts going out.
+void sim_host_receive(const uint8_t *data, uint16_t len);
+// or, when the firmware's LPUART1 isn't at sim_host_baud, len bytes the host can't make sense of
+void sim_host_line_error(uint16_t len);
+
+// the rate the host sends and listens at. The bytes on the line are garbage to whichever end isn't at the other's rate
+extern uint32_t sim_host_baud;
+
+// flash contents from a file (or erased, if path is NULL or there's no such file), and back to it at the end
+void sim_flash_load(const char *path);
+int sim_flash_save(const char *path);
+
+void sim_report(FILE *out, double wall_seconds);
+
+#endif /* __SIM_H */
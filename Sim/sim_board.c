@@ -0,0 +1,63 @@
+// --------------------------------------------------------------------
+// Peripheral handles, set up the way main.c's MX_*_Init() leaves them
+// --------------------------------------------------------------------
+
+#include "sim.h"
+#include "main.h"
+
+//the handles main.c owns on the target
+ADC_HandleTypeDef hadc1;
+DMA_HandleTypeDef hdma_adc1;
+DAC_HandleTypeDef hdac1;
+UART_HandleTypeDef hlpuart1;
+DMA_HandleTypeDef hdma_lpuart1_rx;
+DMA_HandleTypeDef hdma_lpuart1_tx;
+TIM_HandleTypeDef htim2;
+TIM_HandleTypeDef htim14;
+
+
+void Error_Handler(void)
+{
+	fprintf(stderr, "firmware called Error_Handler()\n");
+	longjmp(sim_exit, 2);
+}
+
+void sim_mx_init(void)
+{
+	hadc1.Instance = ADC1;
+	hadc1.DMA_Handle = &hdma_adc1;
+	hadc1.Init.ContinuousConvMode = ENABLE;
+	hadc1.Init.NbrOfConversion = 4;
+	hadc1.Init.ExternalTrigConv = ADC_SOFTWARE_START;
+	hadc1.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_NONE;
+	hadc1.Init.SamplingTimeCommon1 = ADC_SAMPLETIME_160CYCLES_5;
+	hadc1.Init.SamplingTimeCommon2 = ADC_SAMPLETIME_160CYCLES_5;
+	hadc1.Init.OversamplingMode = DISABLE;
+	hdma_adc1.Instance = DMA1_Channel1;
+	hdma_adc1.Init.Mode = DMA_CIRCULAR;
+
+	hdac1.Instance = DAC1;
+
+	hlpuart1.Instance = LPUART1;
+	hlpuart1.Init.BaudRate = 115200;
+	hlpuart1.FifoMode = UART_FIFOMODE_DISABLE;
+	hlpuart1.hdmarx = &hdma_lpuart1_rx;
+	hlpuart1.hdmatx = &hdma_lpuart1_tx;
+	hdma_lpuart1_rx.Instance = DMA1_Channel2;
+	hdma_lpuart1_rx.Init.Mode = DMA_NORMAL;
+	hdma_lpuart1_tx.Instance = DMA1_Channel3;
+	hdma_lpuart1_tx.Init.Mode = DMA_NORMAL;
+
+	htim2.Instance = TIM2;
+	htim2.Init.Prescaler = 0;
+	htim2.Init.Period = 4294967295;
+	TIM2->PSC = 0;
+	TIM2->ARR = 4294967295;
+	htim2.State = HAL_TIM_STATE_READY;
+
+	htim14.Instance = TIM14;
+	htim14.Init.Prescaler = 32 - 1;
+	htim14.Init.Period = 65500;
+	TIM14->PSC = 32 - 1;
+	TIM14->ARR = 65500;
+}
@@ -0,0 +1,1562 @@
+// ------------------------------------------------------------------
+// Virtual HAL for the host simulator
+// ------------------------------------------------------------------
+// Time only moves when the firmware calls into the HAL: every call costs a rough number of
+// core cycles (see the COST_ table), and while that time passes the virtual peripherals run
+// and any interrupts that fall due are delivered, the same way a Cortex-M0+ takes interrupts
+// between instructions. Code that doesn't touch the HAL is treated as free, so the run is
+// fully deterministic and a second of firmware time takes a few milliseconds of wall time.
+//
+// All interrupts are modelled at the same NVIC priority (as set up by CubeMX), so an ISR is
+// never pre-empted and anything that falls due while it runs is taken when it returns.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sim.h"
+#include "main.h"
+
+
+//rough costs in core cycles. HAL at -Os on an M0+, including call overhead.
+#define COST_GETTICK		10
+#define COST_GPIO_READ		12
+#define COST_GPIO_WRITE		12
+#define COST_GPIO_TOGGLE	16
+#define COST_GPIO_INIT		120
+#define COST_DAC_SET		30
+#define COST_TIM_START		24
+#define COST_TIM_STOP		20
+#define COST_TIM_IT			30
+#define COST_TIM_INIT		200
+#define COST_UART_TX_DMA	120
+#define COST_UART_RX_DMA	160
+#define COST_DMA_INIT		150
+#define COST_UART_INIT		300		//HAL_UART_Init: baud rate, frame format, enable
+#define COST_UART_ABORT		150
+#define COST_UART_FIFO		40		//each of the FIFO mode and threshold calls
+#define COST_ADC_START		400
+#define COST_NOP			1
+#define COST_WFI			4		//sleep entry; wake up is covered by COST_IRQ_ENTRY
+#define COST_IRQ_ENTRY		48		//exception entry plus the HAL IRQ handler working out which callback to call
+#define COST_IRQ_EXIT		16
+#define COST_FLASH_ERASE	(SIM_CYCLES_PER_MS * 22)	//page erase, typical from the datasheet. The core stalls for all of it
+#define COST_FLASH_PROGRAM	(SIM_CYCLES_PER_US * 85)	//one double word
+
+#define UART_BITS_PER_CHAR	10		//8N1
+#define CAP_TAU_MS			20.0	//buck output settling time constant
+#define ANALOG_UPDATE_CYCLES	(SIM_CYCLES_PER_US * 50)	//how often the buck model is brought up to date, so BUCK_EN changes are seen
+#define ADC_CYCLES_PER_CLOCK	4		//core cycles per ADC clock: PCLK/4, from MX_ADC1_Init
+#define ADC_CURRENT_PER_mV		(4096.0 / 3300.0 / 8.0)		//current sense reading per mV on the capacitors while the bridge is on, see adc_scan_start()
+
+//handles owned by the firmware build (main.c on the target, sim_main.c here)
+extern TIM_HandleTypeDef htim14;
+extern UART_HandleTypeDef hlpuart1;
+extern ADC_HandleTypeDef hadc1;
+
+
+GPIO_TypeDef sim_gpioa, sim_gpiob, sim_gpioc;
+TIM_TypeDef sim_tim1, sim_tim2, sim_tim14;
+USART_TypeDef sim_lpuart1;
+DMA_Channel_TypeDef sim_dma1_channel[7];
+ADC_TypeDef sim_adc1;
+DAC_TypeDef sim_dac1;
+
+uint64_t sim_cycles;
+jmp_buf sim_exit;
+_sim_inputs sim_inputs = { .batt_mV = 12000, .pot_percent = 30, .pushbutton = 0, .load_percent = 100 };
+
+static uint64_t end_cycles;
+static int in_isr;
+static int irq_masked;				//PRIMASK
+static FILE *trace_file;
+
+static void power_progress(void);
+static void power_adc_scan(uint64_t cycles);
+static void power_pulse(uint64_t on_cycles);
+
+
+// ---------------------
+//  Statistics / trace
+// ---------------------
+
+typedef struct {
+	uint64_t	count;
+	double		min;
+	double		max;
+	double		sum;
+	double		sum_sq;
+} _sim_stat;
+
+static void stat_add(_sim_stat *s, double v)
+{
+	if (!s->count || v < s->min) s->min = v;
+	if (!s->count || v > s->max) s->max = v;
+	s->sum += v;
+	s->sum_sq += v * v;
+	s->count++;
+}
+
+static void stat_print(FILE *out, const char *name, const _sim_stat *s)
+{
+	if (s->count) {
+		double mean = s->sum / s->count;
+		double var = s->sum_sq / s->count - mean * mean;
+		fprintf(out, "%-16s: n %llu  min %.2f  mean %.2f  max %.2f  sd %.3f\n", name,
+				(unsigned long long)s->count, s->min, mean, s->max, var > 0 ? sqrt(var) : 0.0);
+	}
+	else
+		fprintf(out, "%-16s: n 0\n", name);
+}
+
+static double now_us(void)
+{
+	return (double)sim_cycles / SIM_CYCLES_PER_US;
+}
+
+static void trace(const char *signal, uint32_t value)
+{
+	if (trace_file)
+		fprintf(trace_file, "%.3f,%s,%u\n", now_us(), signal, value);
+}
+
+
+// ------
+// GPIO
+// ------
+
+typedef struct {
+	GPIO_TypeDef	*port;
+	uint16_t		pin;
+	const char		*name;
+} _sim_pin;
+
+static const _sim_pin traced_pins[] = {
+	{ Q1_GPIO_Port, Q1_Pin, "Q1" },
+	{ Q2_GPIO_Port, Q2_Pin, "Q2" },
+	{ TRIAC_1_GPIO_Port, TRIAC_1_Pin, "TRIAC1" },
+	{ TRIAC_2_GPIO_Port, TRIAC_2_Pin, "TRIAC2" },
+	{ TRIAC_3_GPIO_Port, TRIAC_3_Pin, "TRIAC3" },
+	{ TRIAC_4_GPIO_Port, TRIAC_4_Pin, "TRIAC4" },
+	{ BUCK_EN_GPIO_Port, BUCK_EN_Pin, "BUCK_EN" },
+	{ LED_1_GPIO_Port, LED_1_Pin, "LED" },
+};
+
+//pins a timer channel can drive, when they are set to that alternate function
+typedef struct {
+	GPIO_TypeDef	*port;
+	uint8_t			pin;			//pin number, not mask
+	uint8_t			af;
+	TIM_TypeDef		*tim;
+	uint8_t			channel;		//0 = CH1
+} _sim_af_pin;
+
+static const _sim_af_pin timer_pins[] = {
+	{ GPIOA, 8, 2, TIM1, 0 },
+	{ GPIOA, 9, 2, TIM1, 1 },
+};
+#define NUM_TIMER_PINS (sizeof(timer_pins) / sizeof(timer_pins[0]))
+
+static uint32_t port_levels[3];		//what each port was last seen driving
+
+static uint64_t q_on_at;			//when the current Q1/Q2 pulse started
+static uint64_t q_last_on_at;		//when the previous one started
+static uint64_t q_pulses[2];
+static _sim_stat stat_on_us, stat_period_us;
+
+static uint64_t q_off_at;			//when the last Q1/Q2 pulse ended
+static unsigned q_triacs;			//triacs that were triggered during it, bit 0 = A (TRIAC_1) ... bit 3 = D
+static uint64_t route_pulses[16];	//pulses by the triacs that were triggered, same bits
+static uint64_t triacs_under_load;	//times the triacs changed while Q1 or Q2 was on
+static _sim_stat stat_route_dead_us;
+
+//triacs being triggered (they are active low), as bits A..D
+static unsigned triacs_gated(uint32_t gpiob_levels)
+{
+	const uint16_t pins[4] = { TRIAC_1_Pin, TRIAC_2_Pin, TRIAC_3_Pin, TRIAC_4_Pin };
+	unsigned gated = 0;
+
+	for (unsigned i = 0; i < 4; i++)
+		if (!(gpiob_levels & pins[i])) gated |= 1u << i;
+	return gated;
+}
+
+static uint8_t timer_outputs(TIM_TypeDef *tim);
+
+//what the port is driving: ODR, except for pins handed over to a timer channel
+static uint32_t pin_levels(GPIO_TypeDef *port)
+{
+	uint32_t levels = port->ODR;
+
+	for (unsigned i = 0; i < NUM_TIMER_PINS; i++) {
+		const _sim_af_pin *p = &timer_pins[i];
+		if (p->port != port || ((port->MODER >> (p->pin * 2)) & 3u) != GPIO_MODE_AF_PP
+				|| ((port->AFR[p->pin >> 3] >> ((p->pin & 7) * 4)) & 0xFu) != p->af)
+			continue;
+		levels &= ~(1u << p->pin);
+		if (timer_outputs(p->tim) & (1u << p->channel)) levels |= 1u << p->pin;
+	}
+	return levels;
+}
+
+//called whenever something might have changed what a port drives, to log edges and measure pulses on the H-bridge
+static void pins_changed(GPIO_TypeDef *port)
+{
+	unsigned n = (unsigned)(port == GPIOA ? 0 : port == GPIOB ? 1 : 2);
+	uint32_t old = port_levels[n];
+	uint32_t now = pin_levels(port);
+	uint32_t diff = now ^ old;
+
+	if (!diff) return;
+	port_levels[n] = now;
+	for (unsigned i = 0; i < sizeof(traced_pins) / sizeof(traced_pins[0]); i++)
+		if (traced_pins[i].port == port && (diff & traced_pins[i].pin))
+			trace(traced_pins[i].name, (now & traced_pins[i].pin) != 0);
+
+	if (port == Q1_GPIO_Port && (diff & (Q1_Pin | Q2_Pin))) {
+		uint32_t was_on = old & (Q1_Pin | Q2_Pin);
+		uint32_t is_on = now & (Q1_Pin | Q2_Pin);
+		if (!was_on && is_on) {
+			if (q_last_on_at)
+				stat_add(&stat_period_us, (double)(sim_cycles - q_last_on_at) / SIM_CYCLES_PER_US);
+			q_on_at = q_last_on_at = sim_cycles;
+			q_pulses[(is_on & Q1_Pin) ? 0 : 1]++;
+			q_triacs = triacs_gated(port_levels[1]);
+			route_pulses[q_triacs]++;
+		} else if (was_on && !is_on) {
+			stat_add(&stat_on_us, (double)(sim_cycles - q_on_at) / SIM_CYCLES_PER_US);
+			power_pulse(sim_cycles - q_on_at);
+			q_off_at = sim_cycles;
+		}
+	}
+	if (port == BUCK_EN_GPIO_Port && (diff & BUCK_EN_Pin)) power_progress();
+
+	//triac changes: never with the bridge on, and triggering a different set has to wait for the old one to drop out
+	if (port == TRIAC_1_GPIO_Port && (diff & (TRIAC_1_Pin | TRIAC_2_Pin | TRIAC_3_Pin | TRIAC_4_Pin))) {
+		unsigned gated = triacs_gated(now), was_gated = triacs_gated(old);
+		if (port_levels[0] & pin_levels(Q1_GPIO_Port) & (Q1_Pin | Q2_Pin)) triacs_under_load++;		//on before and after, see gpio_sync()
+		if ((gated & ~was_gated) && q_triacs && gated != q_triacs)
+			stat_add(&stat_route_dead_us, (double)(sim_cycles - q_off_at) / SIM_CYCLES_PER_US);
+	}
+}
+
+//apply BSRR/BRR stores the firmware has done directly since we last looked. Set wins over reset, like the real thing.
+//Stores to different ports that land in the same sync can't be put in order, so they are taken as happening together: all the
+//ports change first, then they are looked at. GPIOB goes before GPIOA so a pulse starting sees its triacs, and the triac check
+//sees the bridge from before and after.
+static void gpio_sync(void)
+{
+	GPIO_TypeDef *const ports[] = { GPIOB, GPIOA, GPIOC };
+	unsigned stored = 0;
+
+	for (unsigned i = 0; i < sizeof(ports) / sizeof(ports[0]); i++) {
+		GPIO_TypeDef *p = ports[i];
+		if (p->BSRR | p->BRR) {
+			p->ODR = (p->ODR & ~((p->BSRR >> 16) | p->BRR)) | (p->BSRR & 0xFFFFu);
+			p->BSRR = 0;
+			p->BRR = 0;
+			stored |= 1u << i;
+		}
+	}
+	for (unsigned i = 0; i < sizeof(ports) / sizeof(ports[0]); i++)
+		if (stored & (1u << i)) pins_changed(ports[i]);
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init)
+{
+	for (unsigned pin = 0; pin < 16; pin++) {
+		if (GPIO_Init->Pin & (1u << pin)) {
+			GPIOx->MODER = (GPIOx->MODER & ~(3u << (pin * 2))) | ((GPIO_Init->Mode & 3u) << (pin * 2));
+			GPIOx->AFR[pin >> 3] = (GPIOx->AFR[pin >> 3] & ~(0xFu << ((pin & 7) * 4))) | ((GPIO_Init->Alternate & 0xFu) << ((pin & 7) * 4));
+		}
+	}
+	pins_changed(GPIOx);
+	sim_advance(COST_GPIO_INIT);
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+	sim_advance(COST_GPIO_READ);
+	if (GPIOx == PUSHBUTTON_PIN_GPIO_Port && GPIO_Pin == PUSHBUTTON_PIN_Pin)
+		return sim_inputs.pushbutton ? GPIO_PIN_SET : GPIO_PIN_RESET;
+	return (GPIOx->IDR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+	if (PinState != GPIO_PIN_RESET) GPIOx->ODR |= GPIO_Pin;
+	else GPIOx->ODR &= ~(uint32_t)GPIO_Pin;
+	pins_changed(GPIOx);
+	sim_advance(COST_GPIO_WRITE);
+}
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+	GPIOx->ODR ^= GPIO_Pin;
+	pins_changed(GPIOx);
+	sim_advance(COST_GPIO_TOGGLE);
+}
+
+
+// -------------------
+// Analog: DAC, buck
+// -------------------
+
+static uint32_t dac_code;
+static uint64_t dac_writes, dac_changes;
+static double cap_mV;
+static uint64_t analog_updated_at;
+
+//inverse of Vcap_mV_ToDacVal() in NeoDK.c: the buck's feedback node is pulled by the DAC, so a higher code is a lower voltage
+static double dac_code_to_cap_mV(uint32_t code)
+{
+	return 10195.0 - (double)code * 4096.0 / 1865.0;
+}
+
+static void analog_progress(void)
+{
+	double dt_ms = (double)(sim_cycles - analog_updated_at) / SIM_CYCLES_PER_MS;
+	double target = (BUCK_EN_GPIO_Port->ODR & BUCK_EN_Pin) ? dac_code_to_cap_mV(dac_code) : 0.0;
+
+	analog_updated_at = sim_cycles;
+	cap_mV += (target - cap_mV) * (1.0 - exp(-dt_ms / CAP_TAU_MS));
+}
+
+HAL_StatusTypeDef HAL_DAC_Start(DAC_HandleTypeDef *hdac, uint32_t Channel)
+{
+	(void)Channel;
+	hdac->Instance->CR |= 1u << 16;
+	sim_advance(COST_DAC_SET);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DAC_SetValue(DAC_HandleTypeDef *hdac, uint32_t Channel, uint32_t Alignment, uint32_t Data)
+{
+	(void)Channel; (void)Alignment;
+	dac_writes++;
+	if (Data != dac_code) {
+		analog_progress();		//settle the buck up to now on the old setpoint
+		dac_changes++;
+		dac_code = Data;
+		trace("DAC", Data);
+	}
+	hdac->Instance->DHR12R2 = Data;
+	sim_advance(COST_DAC_SET);
+	return HAL_OK;
+}
+
+
+
+// ---------------
+//  Board inputs
+// ---------------
+
+typedef struct {
+	uint64_t	at;
+	uint8_t		*input;			//a field of sim_inputs
+	uint8_t		value;
+} _sim_input_change;
+
+static _sim_input_change *input_changes;	//scheduled by the scenario, in time order
+static size_t input_changes_len, input_changes_cap, input_next;
+
+void sim_input_at(uint64_t at_cycles, uint8_t *input, uint8_t value)
+{
+	size_t i;
+
+	if (input_changes_len == input_changes_cap) {
+		input_changes_cap = input_changes_cap ? input_changes_cap * 2 : 16;
+		input_changes = realloc(input_changes, input_changes_cap * sizeof(*input_changes));
+	}
+	for (i = input_changes_len; i > input_next && input_changes[i - 1].at > at_cycles; i--)
+		input_changes[i] = input_changes[i - 1];
+	input_changes[i].at = at_cycles;
+	input_changes[i].input = input;
+	input_changes[i].value = value;
+	input_changes_len++;
+}
+
+static void inputs_progress(void)
+{
+	while (input_next < input_changes_len && input_changes[input_next].at <= sim_cycles) {
+		*input_changes[input_next].input = input_changes[input_next].value;
+		input_next++;
+	}
+}
+
+
+// --------
+// Timers
+// --------
+
+// Up counting only. Channels 1 and 2 can be outputs in PWM mode 1/2 or forced, which is all the
+// pulse engines use. ARR and CCRx preload (ARPE, OCxPE) take effect at the update event like the real thing.
+// Channel 4 has no pin, but its compare events are there for the ADC to be triggered from.
+typedef struct {
+	TIM_TypeDef			*regs;
+	TIM_HandleTypeDef	*handle;		//picked up from the first HAL call on the timer, for the update callback
+	uint32_t			max;			//counter width
+	int					advanced;		//has BDTR, so the outputs need MOE
+	int					running;
+	uint64_t			base_cycle;		//cycle at which the counter held base_cnt
+	uint32_t			base_cnt;
+	uint32_t			last_cnt;		//what we last put in CNT, to spot the firmware writing it
+	uint32_t			last_arr;		//ARR when we last looked, to spot it being changed on the fly
+	uint32_t			arr;			//the ARR the counter is using (the shadow register, if ARPE is set)
+	uint32_t			ccr[4];			//same for CCR1 to CCR4
+	uint8_t				out;			//channel output levels, bit 0 = CH1
+	int					pending;		//update interrupt waiting to be taken
+	uint64_t			cc4_at;			//when the last channel 4 compare was taken
+	int					cc4_event;		//channel 4 compare (or CC4G) for the ADC to pick up
+} _sim_timer;
+
+static _sim_timer timers[] = {
+	{ .regs = &sim_tim14, .handle = &htim14, .max = 0xFFFFu },
+	{ .regs = &sim_tim2, .handle = NULL, .max = 0xFFFFFFFFu },
+	{ .regs = &sim_tim1, .handle = NULL, .max = 0xFFFFu, .advanced = 1 },
+};
+#define NUM_TIMERS (sizeof(timers) / sizeof(timers[0]))
+
+static _sim_timer *timer_of(TIM_HandleTypeDef *htim)
+{
+	for (unsigned i = 0; i < NUM_TIMERS; i++)
+		if (timers[i].regs == htim->Instance) {
+			timers[i].handle = htim;
+			return &timers[i];
+		}
+	return NULL;
+}
+
+static _sim_timer *timer_find(TIM_TypeDef *tim)
+{
+	for (unsigned i = 0; i < NUM_TIMERS; i++)
+		if (timers[i].regs == tim) return &timers[i];
+	return NULL;
+}
+
+static uint8_t timer_outputs(TIM_TypeDef *tim)
+{
+	_sim_timer *t = timer_find(tim);
+	return t ? t->out : 0;
+}
+
+//update event: the preload registers go live
+static void timer_load(_sim_timer *t)
+{
+	t->arr = t->regs->ARR & t->max;
+	t->ccr[0] = t->regs->CCR1;
+	t->ccr[1] = t->regs->CCR2;
+	t->ccr[2] = t->regs->CCR3;
+	t->ccr[3] = t->regs->CCR4;
+}
+
+//registers without preload are live all the time
+static void timer_load_unbuffered(_sim_timer *t)
+{
+	if (!(t->regs->CR1 & TIM_CR1_ARPE)) t->arr = t->regs->ARR & t->max;
+	if (!(t->regs->CCMR1 & TIM_CCMR1_OC1PE)) t->ccr[0] = t->regs->CCR1;
+	if (!(t->regs->CCMR1 & TIM_CCMR1_OC2PE)) t->ccr[1] = t->regs->CCR2;
+	if (!(t->regs->CCMR2 & TIM_CCMR2_OC3PE)) t->ccr[2] = t->regs->CCR3;
+	if (!(t->regs->CCMR2 & TIM_CCMR2_OC4PE)) t->ccr[3] = t->regs->CCR4;
+}
+
+static int timer_channel_level(_sim_timer *t, unsigned ch, uint32_t cnt)
+{
+	uint32_t mode = (t->regs->CCMR1 >> (8 * ch + 4)) & 7u;
+	int ref;
+
+	if (!(t->regs->CCER & (TIM_CCER_CC1E << (4 * ch)))) return 0;
+	if (t->advanced && !(t->regs->BDTR & TIM_BDTR_MOE)) return 0;
+	switch (mode) {
+	case 4: ref = 0; break;						//force inactive
+	case 5: ref = 1; break;						//force active
+	case 6: ref = cnt < t->ccr[ch]; break;		//PWM mode 1
+	case 7: ref = cnt >= t->ccr[ch]; break;		//PWM mode 2
+	default: ref = (t->out >> ch) & 1; break;	//frozen (output compare modes that toggle aren't modelled)
+	}
+	if (t->regs->CCER & (TIM_CCER_CC1P << (4 * ch))) ref = !ref;
+	return ref;
+}
+
+static void timer_outputs_update(_sim_timer *t)
+{
+	uint8_t out = 0;
+
+	for (unsigned ch = 0; ch < 2; ch++)
+		if (timer_channel_level(t, ch, t->regs->CNT)) out |= (uint8_t)(1u << ch);
+	if (out == t->out) return;
+	t->out = out;
+	for (unsigned i = 0; i < NUM_TIMER_PINS; i++)
+		if (timer_pins[i].tim == t->regs) pins_changed(timer_pins[i].port);
+}
+
+static uint32_t timer_cnt_now(_sim_timer *t)
+{
+	uint64_t ticks = (sim_cycles - t->base_cycle) / (t->regs->PSC + 1u);
+	return (uint32_t)((t->base_cnt + ticks) & t->max);
+}
+
+//pick up CEN, CNT, ARR and EGR writes done by the firmware since we last looked
+static void timer_sync(_sim_timer *t)
+{
+	int cen = (t->regs->CR1 & TIM_CR1_CEN) != 0;
+
+	if (t->regs->EGR & TIM_EGR_UG) {
+		//software update event: counter back to 0, preloads go live, and UIF unless URS says only overflows count
+		t->regs->EGR = 0;
+		t->regs->CNT = t->last_cnt = 0;
+		t->base_cycle = sim_cycles;
+		t->base_cnt = 0;
+		timer_load(t);
+		if (!(t->regs->CR1 & TIM_CR1_URS)) {
+			t->regs->SR |= TIM_SR_UIF;
+			if (t->regs->DIER & TIM_DIER_UIE) t->pending = 1;
+		}
+	}
+	if (t->regs->EGR & TIM_EGR_CC4G) {
+		t->regs->EGR &= ~TIM_EGR_CC4G;
+		t->regs->SR |= TIM_SR_CC4IF;
+		t->cc4_event = 1;
+	}
+	timer_load_unbuffered(t);
+	if (t->running && t->regs->CNT != t->last_cnt) {
+		t->base_cycle = sim_cycles;
+		t->base_cnt = t->regs->CNT;
+	}
+	if (t->running && !(t->regs->CR1 & TIM_CR1_ARPE) && t->regs->ARR != t->last_arr) {
+		//no preload, so a new ARR takes effect against wherever the counter has got to
+		uint64_t div = t->regs->PSC + 1u;
+		t->base_cnt = timer_cnt_now(t);
+		t->base_cycle = sim_cycles - (sim_cycles - t->base_cycle) % div;
+	}
+	t->last_arr = t->regs->ARR;
+	if (cen && !t->running) {
+		t->running = 1;
+		t->base_cycle = sim_cycles;
+		t->base_cnt = t->regs->CNT;
+		power_progress();
+	} else if (!cen && t->running) {
+		t->regs->CNT = timer_cnt_now(t);
+		t->running = 0;
+		power_progress();
+	}
+	if (t->running) t->regs->CNT = timer_cnt_now(t);
+	t->last_cnt = t->regs->CNT;
+	timer_outputs_update(t);
+}
+
+//cycle at which the counter next overflows past ARR. If it is already beyond ARR it has to wrap round first.
+static uint64_t timer_due(_sim_timer *t)
+{
+	uint64_t div = t->regs->PSC + 1u;
+	uint64_t cnt = t->base_cnt;
+	uint64_t arr = t->arr;
+	uint64_t ticks = (cnt <= arr) ? (arr - cnt + 1) : ((uint64_t)t->max - cnt + 1 + arr + 1);
+
+	return t->base_cycle + ticks * div;
+}
+
+//cycle at which the counter next reaches an enabled channel's CCR, ie an output edge in the middle of the period
+static uint64_t timer_compare_due(_sim_timer *t)
+{
+	uint64_t next = UINT64_MAX;
+	uint32_t cnt;
+
+	if (!t->running || !(t->regs->CCER & (TIM_CCER_CC1E | TIM_CCER_CC2E))) return next;
+	cnt = timer_cnt_now(t);
+	for (unsigned ch = 0; ch < 2; ch++) {
+		if ((t->regs->CCER & (TIM_CCER_CC1E << (4 * ch))) && t->ccr[ch] > cnt && t->ccr[ch] <= t->arr) {
+			uint64_t due = t->base_cycle + (uint64_t)(t->ccr[ch] - t->base_cnt) * (t->regs->PSC + 1u);
+			if (due < next) next = due;
+		}
+	}
+	return next;
+}
+
+//cycle at which the counter reaches CCR4 in this period, if channel 4 is set up and that compare hasn't been taken yet. Channel 4
+//drives no pin, it is only there as the ADC trigger
+static uint64_t timer_cc4_due(_sim_timer *t)
+{
+	uint64_t due;
+
+	if (!t->running || !t->regs->CCMR2 || t->ccr[3] < t->base_cnt || t->ccr[3] > t->arr) return UINT64_MAX;
+	due = t->base_cycle + (uint64_t)(t->ccr[3] - t->base_cnt) * (t->regs->PSC + 1u);
+	return due > t->cc4_at ? due : UINT64_MAX;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Start(TIM_HandleTypeDef *htim)
+{
+	if (htim->State != HAL_TIM_STATE_READY) return HAL_ERROR;
+	htim->State = HAL_TIM_STATE_BUSY;
+	htim->Instance->CR1 |= TIM_CR1_CEN;
+	sim_advance(COST_TIM_START);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Stop(TIM_HandleTypeDef *htim)
+{
+	htim->Instance->CR1 &= ~TIM_CR1_CEN;
+	htim->State = HAL_TIM_STATE_READY;
+	sim_advance(COST_TIM_STOP);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef *htim)
+{
+	if (htim->State != HAL_TIM_STATE_READY) return HAL_ERROR;
+	htim->State = HAL_TIM_STATE_BUSY;
+	htim->Instance->DIER |= TIM_DIER_UIE;
+	htim->Instance->CR1 |= TIM_CR1_CEN;
+	sim_advance(COST_TIM_IT);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Stop_IT(TIM_HandleTypeDef *htim)
+{
+	htim->Instance->DIER &= ~TIM_DIER_UIE;
+	htim->Instance->CR1 &= ~TIM_CR1_CEN;
+	htim->State = HAL_TIM_STATE_READY;
+	sim_advance(COST_TIM_IT);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Init(TIM_HandleTypeDef *htim)
+{
+	TIM_TypeDef *r = htim->Instance;
+
+	if (!timer_of(htim)) return HAL_ERROR;
+	r->PSC = htim->Init.Prescaler;
+	r->ARR = htim->Init.Period;
+	r->RCR = htim->Init.RepetitionCounter;
+	r->CR1 = (r->CR1 & ~TIM_CR1_ARPE) | htim->Init.AutoReloadPreload;
+	r->EGR = TIM_EGR_UG;		//the HAL loads PSC and ARR straight away like this
+	sim_advance(COST_TIM_INIT);
+	r->SR &= ~TIM_SR_UIF;		//and clears the UIF that leaves behind
+	htim->State = HAL_TIM_STATE_READY;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_ConfigChannel(TIM_HandleTypeDef *htim, const TIM_OC_InitTypeDef *sConfig, uint32_t Channel)
+{
+	TIM_TypeDef *r = htim->Instance;
+	unsigned ch = Channel / 4u;
+	__IO uint32_t *ccmr = ch < 2 ? &r->CCMR1 : &r->CCMR2;
+	__IO uint32_t *ccr[4] = { &r->CCR1, &r->CCR2, &r->CCR3, &r->CCR4 };
+
+	if (ch > 3) return HAL_ERROR;
+	r->CCER &= ~((TIM_CCER_CC1E | TIM_CCER_CC1P) << (4 * ch));
+	r->CCER |= (sConfig->OCPolarity & TIM_CCER_CC1P) << (4 * ch);
+	*ccmr = (*ccmr & ~(0xFFu << (8 * (ch & 1)))) | ((sConfig->OCMode | TIM_CCMR1_OC1PE) << (8 * (ch & 1)));
+	*ccr[ch] = sConfig->Pulse;
+	sim_advance(COST_TIM_INIT);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Start(TIM_HandleTypeDef *htim, uint32_t Channel)
+{
+	_sim_timer *t = timer_of(htim);
+
+	if (!t || (Channel != TIM_CHANNEL_1 && Channel != TIM_CHANNEL_2)) return HAL_ERROR;
+	htim->Instance->CCER |= TIM_CCER_CC1E << Channel;
+	if (t->advanced) htim->Instance->BDTR |= TIM_BDTR_MOE;
+	htim->Instance->CR1 |= TIM_CR1_CEN;
+	sim_advance(COST_TIM_START);
+	return HAL_OK;
+}
+
+//the sim delivers timer interrupts straight to HAL_TIM_PeriodElapsedCallback(), but firmware IRQ handlers may call this
+void HAL_TIM_IRQHandler(TIM_HandleTypeDef *htim)
+{
+	if ((htim->Instance->SR & TIM_SR_UIF) && (htim->Instance->DIER & TIM_DIER_UIE)) {
+		htim->Instance->SR &= ~TIM_SR_UIF;
+		HAL_TIM_PeriodElapsedCallback(htim);
+	}
+}
+
+
+// -----
+//  ADC
+// -----
+// One scan of the four ranks per trigger, or back to back in continuous mode. With software triggering, setting ADSTART is the
+// trigger. With TIM1 CC4 as the trigger, ADSTART arms the ADC and each channel 4 compare starts a scan. A trigger while a scan
+// is going is lost, like the real thing. A scan takes as long as the sampling times and oversampling say, and at its end the
+// readings go into the DMA buffer, with the half and full transfer callbacks of a circular buffer.
+// The readings are all taken as the scan starts. Current sense, which is first and short, is the one where that matters.
+
+static const double adc_sampling_clocks[8] = { 1.5, 3.5, 7.5, 12.5, 19.5, 39.5, 79.5, 160.5 };		//by ADC_SAMPLETIME_ code
+static uint32_t adc_rank_sampling[4] = { ADC_SAMPLINGTIME_COMMON_1, ADC_SAMPLINGTIME_COMMON_2,		//as MX_ADC1_Init sets them
+		ADC_SAMPLINGTIME_COMMON_2, ADC_SAMPLINGTIME_COMMON_1 };
+static volatile uint16_t *adc_dma_buffer;
+static uint32_t adc_dma_length, adc_dma_pos;
+static uint64_t adc_done_at;			//when the scan going ends, 0 = none going
+static uint16_t adc_readings[4];
+static int adc_half_pending, adc_cplt_pending;
+static uint64_t adc_scans, adc_scans_bridge_on, adc_triggers_lost;
+
+static int adc_external_trigger(void)
+{
+	return hadc1.Init.ExternalTrigConv != ADC_SOFTWARE_START;
+}
+
+static uint64_t adc_scan_cycles(void)
+{
+	double clocks = 0;
+
+	for (unsigned rank = 0; rank < 4; rank++) {
+		uint32_t smp = adc_rank_sampling[rank] ? hadc1.Init.SamplingTimeCommon2 : hadc1.Init.SamplingTimeCommon1;
+		clocks += adc_sampling_clocks[smp & 7u] + 12.5;		//plus 12.5 clocks of conversion
+	}
+	if (hadc1.Init.OversamplingMode) clocks *= 2u << (hadc1.Init.Oversampling.Ratio >> 2);
+	return (uint64_t)(clocks * ADC_CYCLES_PER_CLOCK);
+}
+
+//Ranks as configured in MX_ADC1_Init: current sense, capacitor voltage, battery voltage, level pot. 4096 = 3.3V.
+//There is no model of the transformer and load, so the current sense reads in proportion to the capacitor voltage while the bridge is on,
+//scaled by sim_inputs.load_percent
+static void adc_scan_start(void)
+{
+	int bridge_on = (pin_levels(Q1_GPIO_Port) & (Q1_Pin | Q2_Pin)) != 0;
+
+	analog_progress();
+	adc_readings[0] = bridge_on ? (uint16_t)(cap_mV * ADC_CURRENT_PER_mV * sim_inputs.load_percent / 100.0) : 0;
+	adc_readings[1] = (uint16_t)(cap_mV * 4096.0 / 3300.0 / 4.0);
+	adc_readings[2] = (uint16_t)(sim_inputs.batt_mV * 4096.0 / 3300.0 / 4.0);
+	adc_readings[3] = (uint16_t)(sim_inputs.pot_percent * 4095u / 100u);
+	adc_done_at = sim_cycles + adc_scan_cycles();
+	power_adc_scan(adc_scan_cycles());
+	adc_scans++;
+	if (bridge_on) adc_scans_bridge_on++;
+}
+
+static void adc_scan_end(void)
+{
+	adc_done_at = 0;
+	if (!adc_dma_buffer) return;
+	for (unsigned rank = 0; rank < 4 && adc_dma_pos < adc_dma_length; rank++)
+		adc_dma_buffer[adc_dma_pos++] = adc_readings[rank];
+	if (adc_dma_pos == adc_dma_length / 2) adc_half_pending = 1;
+	if (adc_dma_pos >= adc_dma_length) {
+		adc_dma_pos = 0;
+		adc_cplt_pending = 1;
+	}
+	if (!adc_external_trigger() && !hadc1.Init.ContinuousConvMode) ADC1->CR &= ~ADC_CR_ADSTART;
+}
+
+//returns 1 if anything happened
+static int adc_progress(void)
+{
+	_sim_timer *tim1 = timer_find(TIM1);
+	int trigger = tim1->cc4_event, did = trigger;
+
+	tim1->cc4_event = 0;
+	if (adc_done_at && adc_done_at <= sim_cycles) {
+		adc_scan_end();
+		did = 1;
+	}
+	if (!(ADC1->CR & ADC_CR_ADSTART)) return did;
+	if (adc_external_trigger()) {
+		if (!trigger) return did;
+		if (adc_done_at) adc_triggers_lost++;
+		else adc_scan_start();
+	} else if (!adc_done_at) {
+		adc_scan_start();
+		did = 1;
+	}
+	return did;
+}
+
+HAL_StatusTypeDef HAL_ADC_Init(ADC_HandleTypeDef *hadc)
+{
+	(void)hadc;		//the model reads hadc1.Init as it goes
+	sim_advance(COST_ADC_START);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_ConfigChannel(ADC_HandleTypeDef *hadc, const ADC_ChannelConfTypeDef *sConfig)
+{
+	(void)hadc;
+	if (sConfig->Rank < 1 || sConfig->Rank > 4) return HAL_ERROR;
+	adc_rank_sampling[sConfig->Rank - 1] = sConfig->SamplingTime;
+	sim_advance(COST_ADC_START);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADCEx_Calibration_Start(ADC_HandleTypeDef *hadc)
+{
+	(void)hadc;
+	sim_advance(COST_ADC_START);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_Start_DMA(ADC_HandleTypeDef *hadc, uint32_t *pData, uint32_t Length)
+{
+	adc_dma_buffer = (volatile uint16_t *)pData;
+	adc_dma_length = Length;
+	adc_dma_pos = 0;
+	hadc->Instance->CR |= ADC_CR_ADSTART;
+	sim_advance(COST_ADC_START);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_Stop_DMA(ADC_HandleTypeDef *hadc)
+{
+	hadc->Instance->CR &= ~ADC_CR_ADSTART;
+	adc_dma_buffer = NULL;
+	adc_done_at = 0;
+	sim_advance(COST_ADC_START);
+	return HAL_OK;
+}
+
+
+// --------
+//  Energy
+// --------
+// Battery current, from what the sim knows about: the core awake or asleep, ADC scans, the buck's own draw while BUCK_EN is on,
+// and the energy the pulses take from the capacitors, into a resistive load and through the buck. The core figures are typical
+// ones from the STM32G071 datasheet, the buck and load ones are guesses until someone measures a board. The time is split by
+// what the board was doing: pulsing (a pulse timer running), idle with the buck on, and idle with it off.
+
+#define CORE_RUN_mA			3.6		//Run at 32MHz from flash, with the peripherals in use clocked
+#define CORE_SLEEP_mA		1.3		//Sleep, the same
+#define ADC_mA				0.5		//while a scan is going
+#define BUCK_QUIESCENT_mA	2.0		//the buck and its feedback divider, enabled with nothing drawn
+#define BUCK_EFFICIENCY		0.85
+#define LOAD_OHMS			50.0	//the load as the primary sees it, at sim_inputs.load_percent 100
+
+enum { POWER_PULSING, POWER_BUCK_ON, POWER_BUCK_OFF, POWER_MODES };
+static const char *const power_mode_names[POWER_MODES] = { "pulsing", "idle, buck on", "idle, buck off" };
+
+static struct {
+	uint64_t	cycles, asleep_cycles, adc_cycles, buck_cycles;
+	double		output_uJ;
+} power_modes[POWER_MODES];
+static int power_mode = POWER_BUCK_OFF;
+static uint64_t power_counted_at;
+
+static int power_mode_now(void)
+{
+	if ((TIM14->DIER | TIM1->DIER) & TIM_DIER_UIE) return POWER_PULSING;		//not CEN: the TIM14 interrupt stops and restarts its timer
+	return (BUCK_EN_GPIO_Port->ODR & BUCK_EN_Pin) ? POWER_BUCK_ON : POWER_BUCK_OFF;
+}
+
+//put the time since the last call down to the mode the board was in, and see which one it is in now
+static void power_progress(void)
+{
+	static int buck_on;
+	uint64_t dt = sim_cycles - power_counted_at;
+
+	power_modes[power_mode].cycles += dt;
+	if (buck_on) power_modes[power_mode].buck_cycles += dt;
+	power_counted_at = sim_cycles;
+	power_mode = power_mode_now();
+	buck_on = (BUCK_EN_GPIO_Port->ODR & BUCK_EN_Pin) != 0;
+}
+
+static void power_adc_scan(uint64_t cycles)
+{
+	power_modes[power_mode].adc_cycles += cycles;
+}
+
+//the capacitor voltage is taken as steady through a pulse, which it is near enough with the buck behind it
+static void power_pulse(uint64_t on_cycles)
+{
+	double volts;
+
+	analog_progress();
+	volts = cap_mV / 1000.0;
+	power_modes[power_mode].output_uJ += volts * volts / LOAD_OHMS * sim_inputs.load_percent / 100.0
+			* (double)on_cycles / SIM_CYCLES_PER_US;
+}
+
+static void power_report(FILE *out)
+{
+	double total_mAs = 0;
+
+	power_progress();
+	for (int m = 0; m < POWER_MODES; m++) {
+		double seconds = (double)power_modes[m].cycles / SIM_CORE_HZ, core, adc, buck, output;
+		if (!power_modes[m].cycles) continue;
+		core = (CORE_RUN_mA * (double)(power_modes[m].cycles - power_modes[m].asleep_cycles)
+				+ CORE_SLEEP_mA * (double)power_modes[m].asleep_cycles) / (double)power_modes[m].cycles;
+		adc = ADC_mA * (double)power_modes[m].adc_cycles / (double)power_modes[m].cycles;
+		buck = BUCK_QUIESCENT_mA * (double)power_modes[m].buck_cycles / (double)power_modes[m].cycles;
+		output = power_modes[m].output_uJ / 1000.0 / seconds / BUCK_EFFICIENCY / (sim_inputs.batt_mV / 1000.0);
+		fprintf(out, "%-16s: %s %.3f s, %.2f mA (core %.2f, ADC %.2f, buck %.2f, output %.2f)\n", "battery",
+				power_mode_names[m], seconds, core + adc + buck + output, core, adc, buck, output);
+		total_mAs += (core + adc + buck + output) * seconds;
+	}
+	fprintf(out, "%-16s: %.2f mA on average\n", "battery", sim_cycles ? total_mAs * SIM_CORE_HZ / (double)sim_cycles : 0.0);
+}
+
+
+// ---------
+// LPUART1
+// ---------
+
+typedef struct {
+	uint64_t	at;						//the earliest it can start
+	uint8_t		data;
+} _sim_rx_byte;
+
+static _sim_rx_byte *rx_line;			//everything the host will send, in the order it goes out
+static size_t rx_line_len, rx_line_cap, rx_next;
+static uint64_t rx_line_free_at;		//when the host finished sending the byte before rx_next
+static uint64_t rx_held_from = UINT64_MAX;		//the host holds back what it would start sending from then, see sim_uart_hold()
+static uint64_t quiet_until;			//the fast path's (below). Cleared when the host's bytes move
+static uint64_t rx_last_byte_at;
+static uint64_t rx_errors;				//bytes that came in at a rate the UART isn't at
+static uint32_t rx_error_pending;		//HAL_UART_ERROR_ for HAL_UART_ErrorCallback
+uint32_t sim_host_baud = 115200;
+static int rx_idle_pending;				//line went quiet after a byte; idle flag fires one char time later
+
+static uint8_t *rx_dma_buf;				//reception armed by HAL_UARTEx_ReceiveToIdle_DMA
+static uint16_t rx_dma_size, rx_dma_pos;
+static uint64_t rx_bytes, rx_lost;
+
+#define RX_EVENT_QUEUE 8
+static struct { uint16_t size; uint32_t type; } rx_events[RX_EVENT_QUEUE];
+static int rx_events_count;
+
+static int tx_busy;
+static uint64_t tx_done_at;
+static int tx_cplt_pending;
+static uint64_t tx_bytes;
+
+static uint64_t char_cycles(uint32_t baud)
+{
+	return ((uint64_t)SIM_CORE_HZ * UART_BITS_PER_CHAR + baud - 1) / baud;
+}
+
+static uint64_t uart_char_cycles(void)
+{
+	return char_cycles(hlpuart1.Init.BaudRate ? hlpuart1.Init.BaudRate : 115200u);
+}
+
+//the bytes are timed as they go out rather than when they are queued, so they go at whatever rate the host is at by then
+void sim_uart_inject(uint64_t at_cycles, const uint8_t *data, uint16_t len)
+{
+	if (rx_line_len + len > rx_line_cap) {
+		rx_line_cap = (rx_line_len + len) * 2;
+		rx_line = realloc(rx_line, rx_line_cap * sizeof(*rx_line));
+	}
+	for (uint16_t i = 0; i < len; i++) {
+		rx_line[rx_line_len].at = at_cycles;
+		rx_line[rx_line_len].data = data[i];
+		rx_line_len++;
+	}
+}
+
+//the host finishes the write it is in, and sends nothing new from at_cycles until it is released. Bytes injected at the same
+//time are one write
+void sim_uart_hold(uint64_t at_cycles)
+{
+	rx_held_from = at_cycles;
+	quiet_until = 0;
+}
+
+void sim_uart_release(uint64_t at_cycles)
+{
+	rx_held_from = UINT64_MAX;
+	if (rx_line_free_at < at_cycles) rx_line_free_at = at_cycles;
+	quiet_until = 0;
+}
+
+//when the next byte from the host has finished arriving, or UINT64_MAX while it is held back
+static uint64_t rx_due(void)
+{
+	uint64_t start = rx_line[rx_next].at > rx_line_free_at ? rx_line[rx_next].at : rx_line_free_at;
+	if (start >= rx_held_from && (!rx_next || rx_line[rx_next].at != rx_line[rx_next - 1].at)) return UINT64_MAX;
+	return start + char_cycles(sim_host_baud);
+}
+
+static void rx_event(uint16_t size, uint32_t type)
+{
+	if (rx_events_count < RX_EVENT_QUEUE) {
+		rx_events[rx_events_count].size = size;
+		rx_events[rx_events_count].type = type;
+		rx_events_count++;
+	}
+}
+
+static int rx_circular(void)
+{
+	return hlpuart1.hdmarx && (hlpuart1.hdmarx->Init.Mode & DMA_CIRCULAR);
+}
+
+static void rx_disarm(void)
+{
+	rx_dma_buf = NULL;
+	hlpuart1.RxState = HAL_UART_STATE_READY;
+}
+
+//a byte finished arriving on the RX pin. If the host is at another rate it's a framing error, and what lands is garbage
+//(the bits inverted, so a sync byte doesn't get through). The reception carries on, as the HAL's does for a framing error
+static void rx_byte(uint8_t b)
+{
+	rx_bytes++;
+	rx_last_byte_at = sim_cycles;
+	rx_idle_pending = 1;
+	if (sim_host_baud != hlpuart1.Init.BaudRate) {
+		b = (uint8_t)~b;
+		rx_errors++;
+		if (rx_dma_buf) rx_error_pending |= HAL_UART_ERROR_FE;
+	}
+	if (!rx_dma_buf) {
+		rx_lost++;
+		return;
+	}
+	rx_dma_buf[rx_dma_pos++] = b;
+	if (hlpuart1.hdmarx) hlpuart1.hdmarx->Instance->CNDTR = rx_dma_size - rx_dma_pos;
+
+	if (rx_dma_pos == rx_dma_size) {
+		rx_event(rx_dma_size, HAL_UART_RXEVENT_TC);
+		if (rx_circular()) {
+			rx_dma_pos = 0;
+			if (hlpuart1.hdmarx) hlpuart1.hdmarx->Instance->CNDTR = rx_dma_size;
+		} else
+			rx_disarm();
+	} else if (rx_dma_pos == rx_dma_size / 2 && hlpuart1.hdmarx && (hlpuart1.hdmarx->Instance->CCR & DMA_IT_HT)) {
+		rx_event(rx_dma_pos, HAL_UART_RXEVENT_HT);
+	}
+}
+
+static void rx_idle(void)
+{
+	rx_idle_pending = 0;
+	if (!rx_dma_buf) return;
+	rx_event(rx_dma_pos, HAL_UART_RXEVENT_IDLE);
+	if (!rx_circular()) rx_disarm();
+}
+
+//only the mode matters here: rx_circular() looks at Init.Mode
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma)
+{
+	if (hdma->Instance->CCR & DMA_CCR_EN) return HAL_ERROR;
+	hdma->Instance->CCR = (hdma->Instance->CCR & ~DMA_CCR_CIRC) | (hdma->Init.Mode & DMA_CCR_CIRC);
+	hdma->State = HAL_DMA_STATE_READY;
+	sim_advance(COST_DMA_INIT);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+	if (huart->RxState != HAL_UART_STATE_READY) return HAL_BUSY;
+	huart->RxState = HAL_UART_STATE_BUSY_RX;
+	huart->pRxBuffPtr = pData;
+	huart->RxXferSize = Size;
+	rx_dma_buf = pData;
+	rx_dma_size = Size;
+	rx_dma_pos = 0;
+	rx_idle_pending = 0;	//idle detection restarts with the new reception
+	if (huart->hdmarx) {
+		huart->hdmarx->Instance->CNDTR = Size;
+		huart->hdmarx->Instance->CCR |= DMA_CCR_EN | DMA_IT_TC | DMA_IT_HT;
+	}
+	sim_advance(COST_UART_RX_DMA);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size)
+{
+	if (huart->gState != HAL_UART_STATE_READY) return HAL_BUSY;
+	if (!Size) return HAL_ERROR;
+	huart->gState = HAL_UART_STATE_BUSY_TX;
+	tx_busy = 1;
+	tx_done_at = sim_cycles + Size * uart_char_cycles();
+	tx_bytes += Size;
+	if (hlpuart1.Init.BaudRate == sim_host_baud) sim_host_receive(pData, Size);
+	else sim_host_line_error(Size);
+	sim_advance(COST_UART_TX_DMA);
+	return HAL_OK;
+}
+
+//only the baud rate is modelled. Like the real one, this doesn't touch the DMA channels linked to the handle
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+	if (huart->gState != HAL_UART_STATE_READY || huart->RxState != HAL_UART_STATE_READY) return HAL_ERROR;
+	huart->FifoMode = UART_FIFOMODE_DISABLE;
+	sim_advance(COST_UART_INIT);
+	return HAL_OK;
+}
+
+//stops both directions. A transmission part way through is cut short: the host sees it all, as it was handed over when it started
+HAL_StatusTypeDef HAL_UART_Abort(UART_HandleTypeDef *huart)
+{
+	tx_busy = 0;
+	tx_cplt_pending = 0;
+	huart->gState = HAL_UART_STATE_READY;
+	rx_disarm();
+	rx_events_count = 0;
+	rx_error_pending = 0;
+	if (huart->hdmarx) huart->hdmarx->Instance->CCR &= ~DMA_CCR_EN;
+	huart->ErrorCode = HAL_UART_ERROR_NONE;
+	sim_advance(COST_UART_ABORT);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_EnableFifoMode(UART_HandleTypeDef *huart)
+{
+	huart->FifoMode = UART_FIFOMODE_ENABLE;
+	sim_advance(COST_UART_FIFO);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_SetTxFifoThreshold(UART_HandleTypeDef *huart, uint32_t Threshold)
+{
+	(void)huart;
+	(void)Threshold;
+	sim_advance(COST_UART_FIFO);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_SetRxFifoThreshold(UART_HandleTypeDef *huart, uint32_t Threshold)
+{
+	(void)huart;
+	(void)Threshold;
+	sim_advance(COST_UART_FIFO);
+	return HAL_OK;
+}
+
+
+// -------------------------------
+// The clock and interrupt logic
+// -------------------------------
+
+void sim_set_trace(FILE *trace)
+{
+	trace_file = trace;
+}
+
+
+void sim_init(uint64_t end)
+{
+	end_cycles = end;
+	hlpuart1.gState = HAL_UART_STATE_READY;
+	hlpuart1.RxState = HAL_UART_STATE_READY;
+	htim14.State = HAL_TIM_STATE_READY;
+}
+
+//the earliest thing the virtual hardware will do by itself
+static uint64_t next_event_at(void)
+{
+	uint64_t next = end_cycles;
+
+	for (unsigned i = 0; i < NUM_TIMERS; i++) {
+		_sim_timer *t = &timers[i];
+		if (t->running && (t->regs->DIER & TIM_DIER_UIE) && timer_due(t) < next)
+			next = timer_due(t);
+		if (timer_compare_due(t) < next)
+			next = timer_compare_due(t);
+		if (timer_cc4_due(t) < next)
+			next = timer_cc4_due(t);
+	}
+	if (adc_done_at && adc_done_at < next) next = adc_done_at;
+	if (rx_next < rx_line_len && rx_due() < next) next = rx_due();
+	if (rx_idle_pending && rx_last_byte_at + uart_char_cycles() < next) next = rx_last_byte_at + uart_char_cycles();
+	if (tx_busy && tx_done_at < next) next = tx_done_at;
+	if (input_next < input_changes_len && input_changes[input_next].at < next) next = input_changes[input_next].at;
+	return next;
+}
+
+//run the peripherals up to sim_cycles, in time order, latching interrupt requests
+static void progress(void)
+{
+	int again;
+
+	inputs_progress();
+	if (sim_cycles - analog_updated_at >= ANALOG_UPDATE_CYCLES) analog_progress();
+	do {
+		again = 0;
+		for (unsigned i = 0; i < NUM_TIMERS; i++) {
+			_sim_timer *t = &timers[i];
+			timer_sync(t);
+			if (t->running) {
+				uint64_t due = timer_due(t);
+				if (due <= sim_cycles) {
+					t->base_cycle = due;
+					t->base_cnt = 0;
+					t->regs->CNT = t->last_cnt = 0;
+					timer_load(t);
+					t->regs->SR |= TIM_SR_UIF;
+					if (t->regs->DIER & TIM_DIER_UIE) t->pending = 1;
+					timer_sync(t);
+					again = 1;
+				}
+				if (timer_cc4_due(t) <= sim_cycles) {
+					t->cc4_at = timer_cc4_due(t);
+					t->regs->SR |= TIM_SR_CC4IF;
+					t->cc4_event = 1;
+					again = 1;
+				}
+			}
+		}
+		if (adc_progress()) again = 1;
+		if (rx_next < rx_line_len && rx_due() <= sim_cycles) {
+			rx_line_free_at = rx_due();
+			rx_byte(rx_line[rx_next++].data);
+			again = 1;
+		}
+		if (rx_idle_pending && rx_last_byte_at + uart_char_cycles() <= sim_cycles
+				&& !(rx_next < rx_line_len && rx_due() <= rx_last_byte_at + uart_char_cycles())) {
+			rx_idle();
+			again = 1;
+		}
+		if (tx_busy && tx_done_at <= sim_cycles) {
+			tx_busy = 0;
+			hlpuart1.gState = HAL_UART_STATE_READY;
+			tx_cplt_pending = 1;
+			again = 1;
+		}
+	} while (again);
+}
+
+static void irq_enter(void)
+{
+	in_isr = 1;
+	sim_advance(COST_IRQ_ENTRY);
+}
+
+static void irq_exit(void)
+{
+	sim_advance(COST_IRQ_EXIT);
+	in_isr = 0;
+}
+
+//take any pending interrupts, in vector order
+static void dispatch(void)
+{
+	int taken;
+
+	if (in_isr || irq_masked) return;
+	do {
+		taken = 0;
+		for (unsigned i = 0; i < NUM_TIMERS; i++) {
+			_sim_timer *t = &timers[i];
+			if (t->pending && t->handle) {
+				t->pending = 0;
+				irq_enter();
+				t->regs->SR &= ~TIM_SR_UIF;
+				HAL_TIM_PeriodElapsedCallback(t->handle);
+				irq_exit();
+				taken = 1;
+			}
+		}
+		if (adc_half_pending) {
+			adc_half_pending = 0;
+			irq_enter();
+			HAL_ADC_ConvHalfCpltCallback(&hadc1);
+			irq_exit();
+			taken = 1;
+		}
+		if (adc_cplt_pending) {
+			adc_cplt_pending = 0;
+			irq_enter();
+			HAL_ADC_ConvCpltCallback(&hadc1);
+			irq_exit();
+			taken = 1;
+		}
+		if (tx_cplt_pending) {
+			tx_cplt_pending = 0;
+			irq_enter();
+			HAL_UART_TxCpltCallback(&hlpuart1);
+			irq_exit();
+			taken = 1;
+		}
+		if (rx_error_pending) {
+			hlpuart1.ErrorCode = rx_error_pending;
+			rx_error_pending = 0;
+			irq_enter();
+			HAL_UART_ErrorCallback(&hlpuart1);
+			irq_exit();
+			taken = 1;
+		}
+		if (rx_events_count) {
+			uint16_t size = rx_events[0].size;
+			hlpuart1.RxEventType = rx_events[0].type;
+			memmove(&rx_events[0], &rx_events[1], (size_t)(--rx_events_count) * sizeof(rx_events[0]));
+			irq_enter();
+			HAL_UARTEx_RxEventCallback(&hlpuart1, size);
+			irq_exit();
+			taken = 1;
+		}
+	} while (taken);
+
+	if (sim_cycles >= end_cycles) longjmp(sim_exit, 1);
+}
+
+//Fast path: if nothing is due before the next event we already worked out, and the firmware hasn't
+//reprogrammed a timer behind our back, all there is to do is keep the counters ticking. quiet_until is up with the host line's
+//state, as holding the line back has to clear it
+#define QUIET_REGS 9
+static uint32_t quiet_regs[NUM_TIMERS][QUIET_REGS];		//CNT is last, the fast path keeps it up to date
+static uint32_t quiet_adc_cr;
+
+static int timer_untouched(const TIM_TypeDef *r, const uint32_t *v)
+{
+	return r->CR1 == v[0] && r->DIER == v[1] && r->ARR == v[2] && r->EGR == v[3]
+			&& r->CCMR1 == v[4] && r->CCER == v[5] && r->CCR1 == v[6] && r->CCR2 == v[7] && r->CNT == v[QUIET_REGS - 1];
+}
+
+static int still_quiet(uint64_t target)
+{
+	if (target >= quiet_until || in_isr || sim_cycles - analog_updated_at >= ANALOG_UPDATE_CYCLES || ADC1->CR != quiet_adc_cr) return 0;
+	for (unsigned i = 0; i < NUM_TIMERS; i++)
+		if (!timer_untouched(timers[i].regs, quiet_regs[i]))
+			return 0;
+	return 1;
+}
+
+static void remember_quiet(void)
+{
+	quiet_until = next_event_at();
+	quiet_adc_cr = ADC1->CR;
+	for (unsigned i = 0; i < NUM_TIMERS; i++) {
+		TIM_TypeDef *r = timers[i].regs;
+		uint32_t *v = quiet_regs[i];
+		v[0] = r->CR1;
+		v[1] = r->DIER;
+		v[2] = r->ARR;
+		v[3] = r->EGR;
+		v[4] = r->CCMR1;
+		v[5] = r->CCER;
+		v[6] = r->CCR1;
+		v[7] = r->CCR2;
+		v[QUIET_REGS - 1] = r->CNT;
+	}
+}
+
+void sim_advance(uint32_t cycles)
+{
+	uint64_t target = sim_cycles + cycles;
+
+	gpio_sync();
+
+	if (still_quiet(target)) {
+		sim_cycles = target;
+		for (unsigned i = 0; i < NUM_TIMERS; i++)
+			if (timers[i].running)
+				quiet_regs[i][QUIET_REGS - 1] = timers[i].last_cnt = timers[i].regs->CNT = timer_cnt_now(&timers[i]);
+		return;
+	}
+
+	for (;;) {
+		uint64_t next = next_event_at();
+		if (next > target) break;
+		if (next == end_cycles && next <= sim_cycles) break;		//the end of the run can only be taken outside interrupts, with them unmasked
+		if (next > sim_cycles) sim_cycles = next;
+		progress();
+		dispatch();
+		if (sim_cycles >= target) break;
+	}
+	if (target > sim_cycles) sim_cycles = target;
+	progress();
+	dispatch();
+	remember_quiet();
+}
+
+
+// -----------------
+// Core / SysTick
+// -----------------
+
+uint32_t HAL_GetTick(void)
+{
+	sim_advance(COST_GETTICK);
+	return (uint32_t)(sim_cycles / SIM_CYCLES_PER_MS);
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+	uint32_t start = HAL_GetTick();
+	while (HAL_GetTick() - start < Delay + 1u)		//HAL_Delay adds a tick to guarantee the minimum wait
+		sim_advance(SIM_CYCLES_PER_MS / 4);
+}
+
+void sim_nop(void)
+{
+	sim_advance(COST_NOP);
+}
+
+//interrupts that come due while masked are taken when they are unmasked
+void sim_disable_irq(void)
+{
+	irq_masked = 1;
+}
+
+void sim_enable_irq(void)
+{
+	irq_masked = 0;
+	sim_advance(COST_NOP);
+	dispatch();		//anything that came in while they were masked
+}
+
+//sleep until the next interrupt. SysTick wakes the core every millisecond, whatever else is going on.
+//Wakes early when a UART byte arrives without raising an interrupt, which just looks like a spurious wake up to the firmware.
+static uint64_t asleep_cycles;
+
+void sim_wfi(void)
+{
+	uint64_t wake = (sim_cycles / SIM_CYCLES_PER_MS + 1) * SIM_CYCLES_PER_MS;
+	uint64_t next = next_event_at();
+
+	sim_advance(COST_WFI);
+	if (next < wake) wake = next;
+	if (wake > sim_cycles) {
+		asleep_cycles += wake - sim_cycles;
+		power_modes[power_mode].asleep_cycles += wake - sim_cycles;
+		sim_advance((uint32_t)(wake - sim_cycles));
+	}
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+	(void)IRQn; (void)PreemptPriority; (void)SubPriority;		//everything is at the same priority here, see the top of the file
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+	(void)IRQn;		//interrupts are gated by the peripherals' own enable bits
+}
+
+// -------
+//  Flash
+// -------
+// Writes follow the real rules: unlocked, 8 bytes at a time to an 8 byte boundary, and only to a double word erased since it
+// was last written. Anything else is an error, like PROGERR on the board. The core stalls while the flash is busy, so
+// interrupts wait until it is done.
+
+uint8_t sim_flash[SIM_FLASH_SIZE];
+uint32_t sim_image_size = 0x9000;		//about what the board's firmware takes
+static int flash_unlocked;
+static uint8_t flash_written[SIM_FLASH_SIZE / 8];		//double words programmed since their page was erased
+static uint64_t flash_erases, flash_programs, flash_errors;
+
+static void flash_stall(uint32_t cycles)
+{
+	int masked = irq_masked;
+
+	irq_masked = 1;
+	sim_advance(cycles);
+	irq_masked = masked;
+	sim_advance(COST_NOP);		//take what came due meanwhile
+}
+
+void sim_flash_load(const char *path)
+{
+	FILE *f = path ? fopen(path, "rb") : NULL;
+
+	memset(sim_flash, 0xFF, sizeof(sim_flash));
+	memset(flash_written, 0, sizeof(flash_written));
+	if (!f) return;
+	if (fread(sim_flash, 1, sizeof(sim_flash), f) != sizeof(sim_flash))
+		fprintf(stderr, "%s: short flash image, the rest is erased\n", path);
+	fclose(f);
+	for (size_t i = 0; i < sizeof(sim_flash); i++)
+		if (sim_flash[i] != 0xFF) flash_written[i / 8] = 1;
+}
+
+int sim_flash_save(const char *path)
+{
+	FILE *f = fopen(path, "wb");
+
+	if (!f || fwrite(sim_flash, 1, sizeof(sim_flash), f) != sizeof(sim_flash)) {
+		perror(path);
+		if (f) fclose(f);
+		return -1;
+	}
+	return fclose(f);
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+{
+	flash_unlocked = 1;
+	sim_advance(COST_GPIO_WRITE * 2);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void)
+{
+	flash_unlocked = 0;
+	sim_advance(COST_GPIO_WRITE);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data)
+{
+	uint32_t offset = Address - (uint32_t)FLASH_BASE;		//mod 2^32, so the top half of the host address doesn't matter
+
+	if (TypeProgram != FLASH_TYPEPROGRAM_DOUBLEWORD || !flash_unlocked || offset >= SIM_FLASH_SIZE || (offset & 7)
+			|| flash_written[offset / 8]) {
+		flash_errors++;
+		return HAL_ERROR;
+	}
+	memcpy(&sim_flash[offset], &Data, 8);
+	flash_written[offset / 8] = 1;
+	flash_programs++;
+	flash_stall(COST_FLASH_PROGRAM);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError)
+{
+	*PageError = 0xFFFFFFFFU;
+	if (!flash_unlocked || pEraseInit->Page + pEraseInit->NbPages > FLASH_PAGE_NB) {
+		flash_errors++;
+		*PageError = pEraseInit->Page;
+		return HAL_ERROR;
+	}
+	for (uint32_t p = pEraseInit->Page; p < pEraseInit->Page + pEraseInit->NbPages; p++) {
+		memset(&sim_flash[p * FLASH_PAGE_SIZE], 0xFF, FLASH_PAGE_SIZE);
+		memset(&flash_written[p * FLASH_PAGE_SIZE / 8], 0, FLASH_PAGE_SIZE / 8);
+		flash_erases++;
+		flash_stall(COST_FLASH_ERASE);
+	}
+	return HAL_OK;
+}
+
+
+void sim_set_msp(uint32_t msp)
+{
+	(void)msp;
+	fprintf(stderr, "firmware tried to jump to the system bootloader\n");
+	longjmp(sim_exit, 2);
+}
+
+
+// --------
+// Report
+// --------
+
+void sim_report(FILE *out, double wall_seconds)
+{
+	double virtual_seconds = (double)sim_cycles / SIM_CORE_HZ;
+
+	fprintf(out, "\n---- NeoDK simulation report ----\n");
+	fprintf(out, "%-16s: %.3f s\n", "virtual time", virtual_seconds);
+	fprintf(out, "%-16s: %.3f s (%.0fx real time)\n", "wall time", wall_seconds,
+			wall_seconds > 0 ? virtual_seconds / wall_seconds : 0.0);
+	fprintf(out, "%-16s: %.1f%% asleep in __WFI\n", "core",
+			sim_cycles ? 100.0 * (double)asleep_cycles / (double)sim_cycles : 0.0);
+	fprintf(out, "%-16s: Q1 %llu  Q2 %llu\n", "pulses",
+			(unsigned long long)q_pulses[0], (unsigned long long)q_pulses[1]);
+	stat_print(out, "on width (us)", &stat_on_us);
+	stat_print(out, "period (us)", &stat_period_us);
+	fprintf(out, "%-16s:", "routes");
+	for (unsigned r = 0; r < 16; r++) {
+		if (!route_pulses[r]) continue;
+		fprintf(out, " %s%s%s%s%s %llu", r ? "" : "none", r & 1 ? "A" : "", r & 2 ? "B" : "", r & 4 ? "C" : "", r & 8 ? "D" : "",
+				(unsigned long long)route_pulses[r]);
+	}
+	fprintf(out, "  (%llu triac changes with the bridge on)\n", (unsigned long long)triacs_under_load);
+	stat_print(out, "route dead (us)", &stat_route_dead_us);
+	fprintf(out, "%-16s: %llu writes, %llu changes, last code %u (%.0f mV)\n", "DAC",
+			(unsigned long long)dac_writes, (unsigned long long)dac_changes, dac_code, dac_code_to_cap_mV(dac_code));
+	fprintf(out, "%-16s: %llu scans, %llu with the bridge on, %llu triggers lost\n", "ADC",
+			(unsigned long long)adc_scans, (unsigned long long)adc_scans_bridge_on, (unsigned long long)adc_triggers_lost);
+	fprintf(out, "%-16s: rx %llu bytes (%llu lost, %llu framing errors), tx %llu bytes. Ended at %lu baud%s\n", "LPUART1",
+			(unsigned long long)rx_bytes, (unsigned long long)rx_lost, (unsigned long long)rx_errors, (unsigned long long)tx_bytes,
+			(unsigned long)hlpuart1.Init.BaudRate, hlpuart1.FifoMode == UART_FIFOMODE_ENABLE ? ", FIFOs on" : "");
+	fprintf(out, "%-16s: %llu page erases, %llu double words written, %llu errors\n", "flash",
+			(unsigned long long)flash_erases, (unsigned long long)flash_programs, (unsigned long long)flash_errors);
+	power_report(out);
+}
@@ -0,0 +1,894 @@
+// ------------------------------------------------------------------
+// Host simulator entry point: stands in for main.c and the host PC
+// ------------------------------------------------------------------
+// Runs Do_User_Code_Begin_While() / Do_User_Code_While_1() from NeoDK.c against the virtual
+// HAL (with the handles from sim_board.c), and plays a scenario file into LPUART1 as if it
+// came from the PC. What the firmware sends back is echoed, with its frames decoded.
+//
+// Scenario file: one command per line, '#' starts a comment. Times are in milliseconds.
+//   <time> burst key=value ...    send a burst frame. keys are the _burst field names, plus type= (frame type, default
+//                                 FRAME_BURST) and seq= (default: one more than the last frame). output_triacs defaults to 1 (AB)
+//   <time> stop                   send a FRAME_STOP frame
+//   <time> stream <n> key=value   send n copies of a burst frame, as fast as the credits from the NeoDK allow. Only one
+//                                 stream, and it goes after anything else in the scenario has been sent
+//   <time> raw <hex bytes>        send these bytes as they are
+//   pattern <instruction>         add an instruction to the pattern (see pattern_line()). No time, they aren't sent on their own
+//   <time> pattern_send           upload the pattern in FRAME_PATTERN_LOAD frames and start it with FRAME_PATTERN_RUN
+//   <time> pattern_save           FRAME_PATTERN_SAVE for the pattern sent (or for none, if there's no pattern in the scenario)
+//   <time> settings key=value     a FRAME_SETTINGS frame. Keys are level, min, med, max, vprim_min and vprim_max (mV),
+//                                 slew (mV per ms) and charge (current sense reading per volt, 0 = off). Any left out are the
+//                                 firmware's defaults
+//   <time> wave <slot> <level> ...  upload a wavetable with FRAME_WAVE_LOAD frames. The levels (0 to 4096) are spread evenly
+//                                 over the cycle, and the WAVE_TABLE_SIZE entries are drawn as straight lines between them
+//   <time> telemetry [interval]   FRAME_TELEMETRY: telemetry every interval ms (0 = stop), or without one, a single one now
+//   <time> profile <stats> [reset]  FRAME_PROFILE: ask for loop, pulse, late, rx or tx stats (PROFILE_), and clear them after
+//   <time> baud <rate> [stay]     FRAME_BAUD. The host goes to the new rate when the ACK comes back, unless it's told to stay
+//   <time> button <0|1>           release or press the pushbutton
+//   <time> pot <percent>          turn the level pot
+//   <time> load <percent>         scale the current sense reading, as a load that conducts better or worse would
+//   end <time>                    stop the run at this time (default: 1s after the last command)
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "sim.h"
+#include "main.h"
+#include "NeoDK.h"
+
+// ---------------------
+//  Host side: frames
+// ---------------------
+
+typedef struct {
+	const char	*name;
+	uint8_t		offset;
+	uint8_t		size;
+	uint16_t	live;		//its LIVE_ bit, for FRAME_LIVE_DELTA. 0 if it can't be changed that way
+} _packet_field;
+
+//the burst frame payload decoded by decode_burst_from_usart(), all little endian. The LIVE_ fields are in the same order
+static const _packet_field packet_fields[] = {
+	{ "duration", 0, 4, 0 },
+	{ "pw", 4, 1, LIVE_PW },
+	{ "period", 5, 2, LIVE_PERIOD },
+	{ "volts", 7, 1, LIVE_VOLTS },
+	{ "v_mod_waveform", 8, 1, LIVE_V_MOD_WAVEFORM },
+	{ "v_mod_freq", 9, 2, LIVE_V_MOD_FREQ },
+	{ "v_mod_min", 11, 1, LIVE_V_MOD_MIN },
+	{ "pw_mod_waveform", 12, 1, LIVE_PW_MOD_WAVEFORM },
+	{ "pw_mod_freq", 13, 2, LIVE_PW_MOD_FREQ },
+	{ "pw_mod_min", 15, 1, LIVE_PW_MOD_MIN },
+	{ "period_mod_waveform", 16, 1, LIVE_PERIOD_MOD_WAVEFORM },
+	{ "period_mod_freq", 17, 2, LIVE_PERIOD_MOD_FREQ },
+	{ "period_mod_min", 19, 2, LIVE_PERIOD_MOD_MIN },
+	{ "pol_mod_freq", 21, 1, LIVE_POL_MOD_FREQ },
+	{ "pause_after", 22, 2, 0 },
+	{ "repetitions", 24, 2, 0 },
+	{ "output_triacs", 26, 1, LIVE_OUTPUT_TRIACS },
+	{ "route_mod_routes", 27, 2, LIVE_ROUTE_MOD_ROUTES },
+	{ "route_mod_pulses", 29, 1, LIVE_ROUTE_MOD_PULSES },
+};
+
+static uint8_t next_seq;
+static uint64_t frames_sent;
+
+//CRC-16/CCITT-FALSE, done the slow obvious way so it checks the firmware's table-less version
+static uint16_t crc16(const uint8_t *data, unsigned len)
+{
+	uint16_t crc = 0xFFFF;
+
+	while (len--) {
+		crc ^= (uint16_t)(*data++ << 8);
+		for (int b = 0; b < 8; b++)
+			crc = (crc & 0x8000) ? (uint16_t)(crc << 1) ^ 0x1021 : (uint16_t)(crc << 1);
+	}
+	return crc;
+}
+
+static int encode_frame(uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t len, uint8_t *frame)
+{
+	uint16_t crc;
+
+	frame[0] = FRAME_SYNC;
+	frame[1] = len;
+	frame[2] = type;
+	frame[3] = seq;
+	memcpy(&frame[4], payload, len);
+	crc = crc16(&frame[1], len + 3u);
+	frame[len + 4] = (uint8_t)crc;
+	frame[len + 5] = (uint8_t)(crc >> 8);
+	next_seq = (uint8_t)(seq + 1);
+	frames_sent++;
+	return len + FRAME_OVERHEAD;
+}
+
+//burst key=value arguments to a payload, and the frame type and sequence number (left as they are if not given)
+static int parse_burst(char *args, uint8_t *payload, uint8_t *type, uint8_t *seq, int line_no)
+{
+	memset(payload, 0, BURST_PAYLOAD_SIZE);
+
+	payload[26] = 1;		//output_triacs: AB, what the NeoDK always used before routes were in the packet
+	for (char *tok = strtok(args, " \t"); tok; tok = strtok(NULL, " \t")) {
+		char *eq = strchr(tok, '=');
+		unsigned i;
+		if (!eq) {
+			fprintf(stderr, "line %d: expected key=value, got '%s'\n", line_no, tok);
+			return -1;
+		}
+		*eq = 0;
+		uint32_t v = (uint32_t)strtoul(eq + 1, NULL, 0);
+		if (!strcmp(tok, "type")) {
+			*type = (uint8_t)v;
+			continue;
+		}
+		if (!strcmp(tok, "seq")) {
+			*seq = (uint8_t)v;
+			continue;
+		}
+		for (i = 0; i < sizeof(packet_fields) / sizeof(packet_fields[0]); i++)
+			if (!strcmp(tok, packet_fields[i].name)) break;
+		if (i == sizeof(packet_fields) / sizeof(packet_fields[0])) {
+			fprintf(stderr, "line %d: unknown burst field '%s'\n", line_no, tok);
+			return -1;
+		}
+		for (uint8_t b = 0; b < packet_fields[i].size; b++)
+			payload[packet_fields[i].offset + b] = (uint8_t)(v >> (8 * b));
+	}
+	return 0;
+}
+
+static int encode_burst(char *args, uint8_t *frame, int line_no)
+{
+	uint8_t payload[BURST_PAYLOAD_SIZE];
+	uint8_t type = FRAME_BURST, seq = next_seq;
+
+	if (parse_burst(args, payload, &type, &seq, line_no) < 0) return -1;
+	return encode_frame(type, seq, payload, BURST_PAYLOAD_SIZE, frame);
+}
+
+//a FRAME_LIVE_DELTA with just the fields given: the bitmap, then their values in packet_fields order
+static int encode_live(char *args, uint8_t *frame, int line_no)
+{
+	uint8_t burst[BURST_PAYLOAD_SIZE], payload[2 + BURST_PAYLOAD_SIZE];
+	uint16_t fields = 0;
+	uint8_t len = 2;
+	unsigned i;
+
+	for (char *tok = strtok(args, " \t"); tok; tok = strtok(NULL, " \t")) {
+		char *eq = strchr(tok, '=');
+		if (!eq) {
+			fprintf(stderr, "line %d: expected key=value, got '%s'\n", line_no, tok);
+			return -1;
+		}
+		*eq = 0;
+		uint32_t v = (uint32_t)strtoul(eq + 1, NULL, 0);
+		for (i = 0; i < sizeof(packet_fields) / sizeof(packet_fields[0]); i++)
+			if (!strcmp(tok, packet_fields[i].name)) break;
+		if (i == sizeof(packet_fields) / sizeof(packet_fields[0]) || !packet_fields[i].live) {
+			fprintf(stderr, "line %d: '%s' can't be changed live\n", line_no, tok);
+			return -1;
+		}
+		fields |= packet_fields[i].live;
+		for (uint8_t b = 0; b < packet_fields[i].size; b++)
+			burst[packet_fields[i].offset + b] = (uint8_t)(v >> (8 * b));
+	}
+	payload[0] = (uint8_t)fields;
+	payload[1] = (uint8_t)(fields >> 8);
+	for (i = 0; i < sizeof(packet_fields) / sizeof(packet_fields[0]); i++)
+		if (fields & packet_fields[i].live) {
+			memcpy(&payload[len], &burst[packet_fields[i].offset], packet_fields[i].size);
+			len += packet_fields[i].size;
+		}
+	return encode_frame(FRAME_LIVE_DELTA, next_seq, payload, len, frame);
+}
+
+// The streaming host keeps track of how many burst queue slots the NeoDK has free (from the last ACK, NAK or
+// credit frame), less the stream frames it has sent that haven't been answered yet, and sends that many more.
+#define HOST_LATENCY_US		2000		//from a reply arriving to the next frame going out. USB serial adapters take a ms or two
+
+static uint8_t stream_payload[BURST_PAYLOAD_SIZE];
+static unsigned stream_left;
+static uint8_t stream_waiting[256];		//by sequence number: 1 = sent, not answered yet
+static unsigned stream_in_flight;
+static uint64_t stream_started_at, stream_last_ack_at;		//cycles, for bursts per second
+static unsigned stream_acked;
+
+static void stream_send(uint64_t at_cycles)
+{
+	uint8_t frame[FRAME_MAX_PAYLOAD + FRAME_OVERHEAD];
+	uint8_t seq = next_seq;
+	int len = encode_frame(FRAME_BURST, seq, stream_payload, BURST_PAYLOAD_SIZE, frame);
+
+	stream_waiting[seq] = 1;
+	stream_in_flight++;
+	stream_left--;
+	sim_uart_inject(at_cycles, frame, (uint16_t)len);
+}
+
+static int encode_stream(char *args, uint8_t *frame, long at_ms, int line_no)
+{
+	uint8_t type = FRAME_BURST, seq = next_seq;
+	char *count_arg = strtok(args, " \t");
+	unsigned count = count_arg ? (unsigned)strtoul(count_arg, NULL, 0) : 0;
+	char *burst_args = strtok(NULL, "");
+
+	if (stream_left || !count) {
+		fprintf(stderr, "line %d: one stream, of at least one burst\n", line_no);
+		return -1;
+	}
+	if (parse_burst(burst_args ? burst_args : (char[]){ "" }, stream_payload, &type, &seq, line_no) < 0) return -1;
+	stream_left = count;
+	stream_started_at = (uint64_t)at_ms * SIM_CYCLES_PER_MS;
+	//the first one goes out at the stream's time, to find out how much room there is
+	stream_waiting[next_seq] = 1;
+	stream_in_flight++;
+	stream_left--;
+	return encode_frame(FRAME_BURST, next_seq, stream_payload, BURST_PAYLOAD_SIZE, frame);
+}
+
+//a reply came back. answered = it was an ACK or NAK for frame seq
+static void stream_reply(int answered, uint8_t seq, int full, uint8_t free_slots)
+{
+	if (answered && stream_waiting[seq]) {
+		stream_waiting[seq] = 0;
+		stream_in_flight--;
+		if (full) stream_left++;		//send it again when there's room
+	}
+	for (int credit = (int)free_slots - (int)stream_in_flight; credit > 0 && stream_left; credit--)
+		stream_send(sim_cycles + (uint64_t)HOST_LATENCY_US * SIM_CYCLES_PER_US);
+}
+
+static int encode_raw(char *args, uint8_t *packet, int max)
+{
+	int n = 0;
+	for (char *tok = strtok(args, " \t"); tok && n < max; tok = strtok(NULL, " \t"))
+		packet[n++] = (uint8_t)strtoul(tok, NULL, 16);
+	return n;
+}
+
+// ---------------------
+//  Host side: patterns
+// ---------------------
+// pattern lines build up the code a line at a time, and pattern_send puts it in frames. Addresses are labels, worked
+// out when it is sent, so a jump can go forwards:
+//   pattern <label>:                  a label for the next instruction
+//   pattern burst key=value ...       OP_BURST, same keys as the burst command (type= and seq= are ignored)
+//   pattern loop <count> / next       OP_LOOP / OP_NEXT
+//   pattern jump <label>              OP_JUMP
+//   pattern random <label> ...        OP_RANDOM
+//   pattern if_button <label>         OP_IF_BUTTON
+//   pattern if_pot_below <level> <label>   OP_IF_POT_BELOW
+//   pattern end                       OP_END
+
+#define PATTERN_LABELS	64
+
+typedef struct {
+	char		name[32];
+	unsigned	at;
+	int			line_no;		//fixups only, for the error message
+} _pattern_label;
+
+static uint8_t pattern_code[PATTERN_CODE_SIZE];
+static unsigned pattern_len;
+static _pattern_label pattern_labels[PATTERN_LABELS];	//where each label is
+static unsigned pattern_label_count;
+static _pattern_label pattern_fixups[PATTERN_LABELS * 4];	//addresses in the code still to fill in
+static unsigned pattern_fixup_count;
+
+static int pattern_byte(uint8_t b, int line_no)
+{
+	if (pattern_len >= PATTERN_CODE_SIZE) {
+		fprintf(stderr, "line %d: pattern is longer than %d bytes\n", line_no, PATTERN_CODE_SIZE);
+		return -1;
+	}
+	pattern_code[pattern_len++] = b;
+	return 0;
+}
+
+static int pattern_address(const char *label, int line_no)
+{
+	if (!label || pattern_fixup_count == sizeof(pattern_fixups) / sizeof(pattern_fixups[0])) {
+		fprintf(stderr, "line %d: missing label, or too many\n", line_no);
+		return -1;
+	}
+	snprintf(pattern_fixups[pattern_fixup_count].name, sizeof(pattern_fixups[0].name), "%s", label);
+	pattern_fixups[pattern_fixup_count].at = pattern_len;
+	pattern_fixups[pattern_fixup_count].line_no = line_no;
+	pattern_fixup_count++;
+	return pattern_byte(0, line_no) | pattern_byte(0, line_no);
+}
+
+static int pattern_line(char *args, int line_no)
+{
+	char *op = strtok(args, " \t");
+	size_t op_len = op ? strlen(op) : 0;
+	uint8_t payload[BURST_PAYLOAD_SIZE], type, seq;
+	int err = 0;
+
+	if (!op) return 0;
+	if (op[op_len - 1] == ':') {
+		if (pattern_label_count == PATTERN_LABELS) {
+			fprintf(stderr, "line %d: too many labels\n", line_no);
+			return -1;
+		}
+		op[op_len - 1] = 0;
+		snprintf(pattern_labels[pattern_label_count].name, sizeof(pattern_labels[0].name), "%s", op);
+		pattern_labels[pattern_label_count++].at = pattern_len;
+	} else if (!strcmp(op, "burst")) {
+		char *burst_args = strtok(NULL, "");
+		if (parse_burst(burst_args ? burst_args : (char[]){ "" }, payload, &type, &seq, line_no) < 0) return -1;
+		err = pattern_byte(OP_BURST, line_no);
+		for (unsigned i = 0; i < BURST_PAYLOAD_SIZE; i++) err |= pattern_byte(payload[i], line_no);
+	} else if (!strcmp(op, "loop")) {
+		char *count = strtok(NULL, " \t");
+		unsigned n = count ? (unsigned)strtoul(count, NULL, 0) : 1;
+		err = pattern_byte(OP_LOOP, line_no) | pattern_byte((uint8_t)n, line_no) | pattern_byte((uint8_t)(n >> 8), line_no);
+	} else if (!strcmp(op, "next")) {
+		err = pattern_byte(OP_NEXT, line_no);
+	} else if (!strcmp(op, "jump")) {
+		err = pattern_byte(OP_JUMP, line_no) | pattern_address(strtok(NULL, " \t"), line_no);
+	} else if (!strcmp(op, "random")) {
+		char *labels[255];
+		unsigned n = 0;
+		while (n < 255 && (labels[n] = strtok(NULL, " \t"))) n++;
+		err = pattern_byte(OP_RANDOM, line_no) | pattern_byte((uint8_t)n, line_no);
+		for (unsigned i = 0; i < n; i++) err |= pattern_address(labels[i], line_no);
+	} else if (!strcmp(op, "if_button")) {
+		err = pattern_byte(OP_IF_BUTTON, line_no) | pattern_address(strtok(NULL, " \t"), line_no);
+	} else if (!strcmp(op, "if_pot_below")) {
+		char *level = strtok(NULL, " \t");
+		err = pattern_byte(OP_IF_POT_BELOW, line_no) | pattern_byte(level ? (uint8_t)atoi(level) : 0, line_no)
+				| pattern_address(strtok(NULL, " \t"), line_no);
+	} else if (!strcmp(op, "end")) {
+		err = pattern_byte(OP_END, line_no);
+	} else {
+		fprintf(stderr, "line %d: unknown pattern instruction '%s'\n", line_no, op);
+		return -1;
+	}
+	return err ? -1 : 0;
+}
+
+//fill in the addresses
+static int pattern_link(void)
+{
+	for (unsigned f = 0; f < pattern_fixup_count; f++) {
+		unsigned l;
+		for (l = 0; l < pattern_label_count; l++)
+			if (!strcmp(pattern_labels[l].name, pattern_fixups[f].name)) break;
+		if (l == pattern_label_count) {
+			fprintf(stderr, "line %d: no label '%s'\n", pattern_fixups[f].line_no, pattern_fixups[f].name);
+			return -1;
+		}
+		pattern_code[pattern_fixups[f].at] = (uint8_t)pattern_labels[l].at;
+		pattern_code[pattern_fixups[f].at + 1] = (uint8_t)(pattern_labels[l].at >> 8);
+	}
+	return 0;
+}
+
+//length and CRC of the code, the payload of the run and save frames
+static void pattern_summary(uint8_t *payload)
+{
+	uint16_t crc = crc16(pattern_code, pattern_len);
+
+	payload[0] = (uint8_t)pattern_len;
+	payload[1] = (uint8_t)(pattern_len >> 8);
+	payload[2] = (uint8_t)crc;
+	payload[3] = (uint8_t)(crc >> 8);
+}
+
+//the pattern as load frames, a run frame at the end
+static int encode_pattern_send(uint8_t *packet, int max, int line_no)
+{
+	uint8_t payload[FRAME_MAX_PAYLOAD];
+	int n = 0;
+
+	if (pattern_link() < 0) return -1;
+	for (unsigned offset = 0; offset < pattern_len; offset += FRAME_MAX_PAYLOAD - 2) {
+		unsigned len = pattern_len - offset < FRAME_MAX_PAYLOAD - 2 ? pattern_len - offset : FRAME_MAX_PAYLOAD - 2;
+		if (n + (int)len + 2 + FRAME_OVERHEAD > max) break;
+		payload[0] = (uint8_t)offset;
+		payload[1] = (uint8_t)(offset >> 8);
+		memcpy(&payload[2], &pattern_code[offset], len);
+		n += encode_frame(FRAME_PATTERN_LOAD, next_seq, payload, (uint8_t)(len + 2), &packet[n]);
+	}
+	if (!pattern_len || n + 4 + FRAME_OVERHEAD > max) {
+		fprintf(stderr, "line %d: no pattern to send\n", line_no);
+		return -1;
+	}
+	pattern_summary(payload);
+	return n + encode_frame(FRAME_PATTERN_RUN, next_seq, payload, 4, &packet[n]);
+}
+
+static int encode_pattern_save(uint8_t *packet)
+{
+	uint8_t payload[4];
+
+	if (pattern_link() < 0) return -1;
+	pattern_summary(payload);
+	return encode_frame(FRAME_PATTERN_SAVE, next_seq, payload, 4, packet);
+}
+
+static int encode_settings(char *args, uint8_t *packet, int line_no)
+{
+	static const char *const keys[] = { "level", "min", "med", "max", "vprim_min", "vprim_max", "slew", "charge" };
+	unsigned values[] = { 1, 10, 30, 50, 1202, 10195, 500, 0 };		//settings_init() defaults
+	uint8_t payload[sizeof(_settings)];
+
+	for (char *tok = strtok(args, " \t"); tok; tok = strtok(NULL, " \t")) {
+		char *eq = strchr(tok, '=');
+		unsigned i;
+		if (eq) *eq = 0;
+		for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+			if (!strcmp(tok, keys[i])) break;
+		if (!eq || i == sizeof(keys) / sizeof(keys[0])) {
+			fprintf(stderr, "line %d: unknown setting '%s'\n", line_no, tok);
+			return -1;
+		}
+		values[i] = (unsigned)strtoul(eq + 1, NULL, 0);
+	}
+	for (unsigned i = 0; i < 4; i++) payload[i] = (uint8_t)values[i];
+	payload[4] = (uint8_t)values[4];
+	payload[5] = (uint8_t)(values[4] >> 8);
+	payload[6] = (uint8_t)values[5];
+	payload[7] = (uint8_t)(values[5] >> 8);
+	payload[8] = (uint8_t)values[6];
+	payload[9] = (uint8_t)(values[6] >> 8);
+	payload[10] = (uint8_t)values[7];
+	payload[11] = (uint8_t)(values[7] >> 8);
+	return encode_frame(FRAME_SETTINGS, next_seq, payload, sizeof(payload), packet);
+}
+
+// The host's side of FRAME_BAUD. It follows the NeoDK to the new rate when the ACK comes in. If it then gets bytes it can't
+// read, having already heard something at the new rate, it takes that as the NeoDK having gone back to BAUD_DEFAULT, and
+// follows it back. Bytes it can't read straight after switching are the NeoDK finishing what it had to send at the old rate
+static uint32_t baud_asked[256];		//by sequence number: the rate in the FRAME_BAUD waiting for its reply, 0 = none
+static uint8_t baud_follow[256];
+static int baud_heard;					//a good frame has come in at sim_host_baud
+static uint64_t baud_switches, baud_fallbacks, baud_unreadable;
+
+static int encode_baud(char *args, uint8_t *packet, int line_no)
+{
+	char *end;
+	unsigned long rate = strtoul(args, &end, 0);
+	char stay[16] = "";
+	uint8_t payload[4] = { (uint8_t)rate, (uint8_t)(rate >> 8), (uint8_t)(rate >> 16), (uint8_t)(rate >> 24) };
+
+	sscanf(end, "%15s", stay);
+	if (end == args || (stay[0] && strcmp(stay, "stay"))) {
+		fprintf(stderr, "line %d: baud <rate> [stay]\n", line_no);
+		return -1;
+	}
+	baud_asked[next_seq] = (uint32_t)rate;
+	baud_follow[next_seq] = !stay[0];
+	return encode_frame(FRAME_BAUD, next_seq, payload, 4, packet);
+}
+
+static const char *const profile_names[PROFILE_STATS] = { "loop", "pulse", "late", "rx", "tx" };		//by PROFILE_
+
+static int encode_profile(char *args, uint8_t *packet, int line_no)
+{
+	char name[16] = "", reset[16] = "";
+	uint8_t which;
+
+	sscanf(args, "%15s %15s", name, reset);
+	for (which = 0; which < PROFILE_STATS && strcmp(name, profile_names[which]); which++)
+		;
+	if (which == PROFILE_STATS || (reset[0] && strcmp(reset, "reset"))) {
+		fprintf(stderr, "line %d: profile loop|pulse|late|rx|tx [reset]\n", line_no);
+		return -1;
+	}
+	if (reset[0]) which |= PROFILE_RESET;
+	return encode_frame(FRAME_PROFILE, next_seq, &which, 1, packet);
+}
+
+//with no interval, a request for one now
+static int encode_telemetry(char *args, uint8_t *packet)
+{
+	char *end;
+	unsigned long interval = strtoul(args, &end, 0);
+	uint8_t payload[2] = { (uint8_t)interval, (uint8_t)(interval >> 8) };
+
+	return encode_frame(FRAME_TELEMETRY, next_seq, payload, end == args ? 0 : 2, packet);
+}
+
+static int encode_wave(char *args, uint8_t *packet, int line_no)
+{
+	uint16_t table[WAVE_TABLE_SIZE];
+	unsigned levels[WAVE_TABLE_SIZE], count = 0, slot;
+	uint8_t payload[FRAME_MAX_PAYLOAD];
+	int n = 0;
+	char *tok = strtok(args, " \t");
+
+	if (!tok) {
+		fprintf(stderr, "line %d: wave needs a slot\n", line_no);
+		return -1;
+	}
+	slot = (unsigned)strtoul(tok, NULL, 0);
+	while ((tok = strtok(NULL, " \t")) && count < WAVE_TABLE_SIZE) levels[count++] = (unsigned)strtoul(tok, NULL, 0);
+	if (!count) {
+		fprintf(stderr, "line %d: wave needs at least one level\n", line_no);
+		return -1;
+	}
+	//level k sits at entry k*WAVE_TABLE_SIZE/count, and the last one heads back to the first
+	for (unsigned i = 0; i < WAVE_TABLE_SIZE; i++) {
+		unsigned pos = i * count, k = pos / WAVE_TABLE_SIZE, frac = pos % WAVE_TABLE_SIZE;
+		long from = levels[k], to = levels[(k + 1) % count];
+		table[i] = (uint16_t)(from + (to - from) * (long)frac / WAVE_TABLE_SIZE);
+	}
+	for (unsigned first = 0; first < WAVE_TABLE_SIZE; first += (FRAME_MAX_PAYLOAD - 2) / 2) {
+		unsigned entries = WAVE_TABLE_SIZE - first < (FRAME_MAX_PAYLOAD - 2) / 2 ? WAVE_TABLE_SIZE - first : (FRAME_MAX_PAYLOAD - 2) / 2;
+		payload[0] = (uint8_t)slot;
+		payload[1] = (uint8_t)first;
+		for (unsigned i = 0; i < entries; i++) {
+			payload[2 + 2 * i] = (uint8_t)table[first + i];
+			payload[3 + 2 * i] = (uint8_t)(table[first + i] >> 8);
+		}
+		n += encode_frame(FRAME_WAVE_LOAD, next_seq, payload, (uint8_t)(2 + 2 * entries), &packet[n]);
+	}
+	return n;
+}
+
+static int input_change(uint8_t *input, const char *args, long at_ms)
+{
+	sim_input_at((uint64_t)at_ms * SIM_CYCLES_PER_MS, input, (uint8_t)atoi(args));
+	return 0;		//nothing to send
+}
+
+//returns the end time in ms, or -1 on error
+static long load_scenario(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[1024];
+	int line_no = 0;
+	long last_ms = 0, end_ms = -1;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char *p, cmd[32];
+		long at_ms;
+		int used;
+		uint8_t packet[1024];
+		int len;
+
+		line_no++;
+		if ((p = strchr(line, '#'))) *p = 0;
+		line[strcspn(line, "\r\n")] = 0;
+		p = line + strspn(line, " \t");
+		if (!strncmp(p, "pattern", 7) && (p[7] == ' ' || p[7] == '\t')) {
+			if (pattern_line(p + 8, line_no) < 0) {
+				fclose(f);
+				return -1;
+			}
+			continue;
+		}
+		if (sscanf(line, " end %ld", &at_ms) == 1) {
+			end_ms = at_ms;
+			continue;
+		}
+		if (sscanf(line, " %ld %31s %n", &at_ms, cmd, &used) < 2) continue;
+
+		if (!strcmp(cmd, "burst")) len = encode_burst(line + used, packet, line_no);
+		else if (!strcmp(cmd, "live")) len = encode_live(line + used, packet, line_no);
+		else if (!strcmp(cmd, "stop")) len = encode_frame(FRAME_STOP, next_seq, NULL, 0, packet);
+		else if (!strcmp(cmd, "stream")) len = encode_stream(line + used, packet, at_ms, line_no);
+		else if (!strcmp(cmd, "raw")) len = encode_raw(line + used, packet, sizeof(packet));
+		else if (!strcmp(cmd, "pattern_send")) len = encode_pattern_send(packet, sizeof(packet), line_no);
+		else if (!strcmp(cmd, "pattern_save")) len = encode_pattern_save(packet);
+		else if (!strcmp(cmd, "settings")) len = encode_settings(line + used, packet, line_no);
+		else if (!strcmp(cmd, "wave")) len = encode_wave(line + used, packet, line_no);
+		else if (!strcmp(cmd, "button")) len = input_change(&sim_inputs.pushbutton, line + used, at_ms);
+		else if (!strcmp(cmd, "pot")) len = input_change(&sim_inputs.pot_percent, line + used, at_ms);
+		else if (!strcmp(cmd, "load")) len = input_change(&sim_inputs.load_percent, line + used, at_ms);
+		else if (!strcmp(cmd, "telemetry")) len = encode_telemetry(line + used, packet);
+		else if (!strcmp(cmd, "profile")) len = encode_profile(line + used, packet, line_no);
+		else if (!strcmp(cmd, "baud")) len = encode_baud(line + used, packet, line_no);
+		else {
+			fprintf(stderr, "%s:%d: unknown command '%s'\n", path, line_no, cmd);
+			len = -1;
+		}
+		if (len < 0) {
+			fclose(f);
+			return -1;
+		}
+		sim_uart_inject((uint64_t)at_ms * SIM_CYCLES_PER_MS, packet, (uint16_t)len);
+		if (at_ms > last_ms) last_ms = at_ms;
+	}
+	fclose(f);
+	return end_ms >= 0 ? end_ms : last_ms + 1000;
+}
+
+
+// What the NeoDK sends: text, with frames in among it. The text is all 7 bit, so a FRAME_SYNC byte is always a frame.
+static int echo = 1;
+static int echo_line_open;		//the timestamp for this TX is out
+static uint8_t rx_frame[FRAME_MAX_PAYLOAD + FRAME_OVERHEAD];
+static unsigned rx_frame_len;
+static uint64_t acks, naks[FRAME_NAK_BAUD + 1], credits, bad_frames;
+static uint64_t statuses[STATUS_SAVE_FAILED - STATUS_BURST_STARTED + 1];		//status codes from the NeoDK, by code
+static uint64_t save_held_at, save_held_most;		//cycles: when the host started holding its frames for a save, and the longest
+static uint64_t telemetry_frames;
+static uint32_t telemetry_last_ms, telemetry_gap_min = UINT32_MAX, telemetry_gap_max;		//from the time in them
+static uint8_t telemetry_last[TELEMETRY_PAYLOAD_SIZE];
+static uint8_t profile_last[PROFILE_STATS][PROFILE_PAYLOAD_SIZE];		//the last FRAME_PROFILE_DATA for each, 0 count if none
+static uint16_t profile_counters[3];		//and the error counters from the last of them
+static uint64_t profile_frames;
+
+static uint32_t le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void echo_stamp(void)
+{
+	if (!echo_line_open) printf("[%10.3f ms] TX ", (double)sim_cycles / SIM_CYCLES_PER_MS);
+	echo_line_open = 1;
+}
+
+static void host_frame(const uint8_t *f, unsigned size)
+{
+	static const char *const nak_reasons[] = { "?", "crc", "full", "type", "length", "pattern", "busy", "settings", "wave", "profile", "baud" };
+	uint8_t len = f[1];
+
+	if (echo) echo_stamp();
+	if (crc16(&f[1], len + 3u) != (f[size - 2] | f[size - 1] << 8)) {
+		bad_frames++;
+		if (echo) printf("<bad frame>");
+		return;
+	}
+	baud_heard = 1;
+	if (f[2] == FRAME_ACK && len == 1) {
+		acks++;
+		if (echo) printf("<ACK %u, %u free>", f[3], f[4]);
+		if (stream_waiting[f[3]]) {
+			stream_acked++;
+			stream_last_ack_at = sim_cycles;
+		}
+		stream_reply(1, f[3], 0, f[4]);
+		if (baud_asked[f[3]] && baud_follow[f[3]] && baud_asked[f[3]] != sim_host_baud) {
+			sim_host_baud = baud_asked[f[3]];
+			baud_switches++;
+			baud_heard = 0;
+			if (echo) printf("<host now at %u baud>", sim_host_baud);
+		}
+		baud_asked[f[3]] = 0;
+	} else if (f[2] == FRAME_NAK && len == 2) {
+		naks[f[4] <= FRAME_NAK_BAUD ? f[4] : 0]++;
+		if (echo) printf("<NAK %u %s, %u free>", f[3], nak_reasons[f[4] <= FRAME_NAK_BAUD ? f[4] : 0], f[5]);
+		baud_asked[f[3]] = 0;
+		stream_reply(1, f[3], f[4] == FRAME_NAK_FULL, f[5]);
+	} else if (f[2] == FRAME_CREDIT && len == 1) {
+		credits++;
+		if (echo) printf("<credit, %u free>", f[4]);
+		stream_reply(0, f[3], 0, f[4]);
+	} else if (f[2] == FRAME_TELEMETRY_DATA && len == TELEMETRY_PAYLOAD_SIZE) {
+		const uint8_t *p = &f[4];
+		uint32_t ms = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+		if (telemetry_frames) {
+			if (ms - telemetry_last_ms < telemetry_gap_min) telemetry_gap_min = ms - telemetry_last_ms;
+			if (ms - telemetry_last_ms > telemetry_gap_max) telemetry_gap_max = ms - telemetry_last_ms;
+		}
+		telemetry_frames++;
+		telemetry_last_ms = ms;
+		memcpy(telemetry_last, p, sizeof(telemetry_last));
+		if (echo) printf("<telemetry %u ms, batt %u cap %u mV, burst %u>", ms, p[4] | p[5] << 8, p[6] | p[7] << 8, p[18] | p[19] << 8);
+	} else if (f[2] == FRAME_PROFILE_DATA && len == PROFILE_PAYLOAD_SIZE && f[4] < PROFILE_STATS) {
+		profile_frames++;
+		memcpy(profile_last[f[4]], &f[4], PROFILE_PAYLOAD_SIZE);
+		for (int i = 0; i < 3; i++) profile_counters[i] = f[45 + 2 * i] | f[46 + 2 * i] << 8;
+		if (echo) printf("<profile %s, %u times>", profile_names[f[4]], (unsigned)le32(&f[5]));
+	} else if (echo) {
+		printf("<frame type 0x%02X seq %u, %u bytes>", f[2], f[3], len);
+	}
+}
+
+void sim_host_receive(const uint8_t *data, uint16_t len)
+{
+	for (uint16_t i = 0; i < len; i++) {
+		uint8_t c = data[i];
+		if (rx_frame_len || c == FRAME_SYNC) {
+			rx_frame[rx_frame_len++] = c;
+			if (rx_frame_len >= 2 && rx_frame[1] > FRAME_MAX_PAYLOAD) {
+				bad_frames++;
+				rx_frame_len = 0;
+			} else if (rx_frame_len >= 2 && rx_frame_len == rx_frame[1] + (unsigned)FRAME_OVERHEAD) {
+				host_frame(rx_frame, rx_frame_len);
+				rx_frame_len = 0;
+			}
+		} else if (c >= STATUS_BURST_STARTED && c <= STATUS_SAVE_FAILED) {
+			static const char *const status_names[] = { "burst started", "burst repeated", "burst done", "baud fallback",
+					"saving", "saved", "save failed" };
+			statuses[c - STATUS_BURST_STARTED]++;
+			//the host holds its frames while the NeoDK writes flash, from when it hears it's about to until it hears it's done
+			if (c == STATUS_SAVING) {
+				save_held_at = sim_cycles + (uint64_t)HOST_LATENCY_US * SIM_CYCLES_PER_US;
+				sim_uart_hold(save_held_at);
+			} else if (c == STATUS_SAVED || c == STATUS_SAVE_FAILED) {
+				uint64_t at = sim_cycles + (uint64_t)HOST_LATENCY_US * SIM_CYCLES_PER_US;
+				if (at - save_held_at > save_held_most) save_held_most = at - save_held_at;
+				sim_uart_release(at);
+			}
+			if (echo) {
+				echo_stamp();
+				printf("<%s>", status_names[c - STATUS_BURST_STARTED]);
+			}
+		} else if (echo) {
+			echo_stamp();
+			if (c >= 0x20 && c < 0x7F) putchar(c);
+			else printf("\\x%02X", c);
+		}
+	}
+	if (echo_line_open) putchar('\n');
+	echo_line_open = 0;
+}
+
+void sim_host_line_error(uint16_t len)
+{
+	baud_unreadable += len;
+	if (echo) printf("[%10.3f ms] TX <%u bytes at another rate>", (double)sim_cycles / SIM_CYCLES_PER_MS, len);
+	if (baud_heard && sim_host_baud != BAUD_DEFAULT) {
+		sim_host_baud = BAUD_DEFAULT;
+		baud_fallbacks++;
+		baud_heard = 0;
+		rx_frame_len = 0;
+		if (echo) printf("<host back to %u baud>", BAUD_DEFAULT);
+	}
+	if (echo) putchar('\n');
+}
+
+//one of the firmware's _profile_stats, in microseconds. The histogram buckets are shown with their upper ends
+static void profile_line(FILE *out, const char *name, const _profile_stats *s)
+{
+	fprintf(out, "%-16s: n %lu  min %.2f  mean %.2f  max %.2f us ", name, (unsigned long)s->count,
+			(double)s->min / SIM_CYCLES_PER_US, s->count ? (double)s->total / s->count / SIM_CYCLES_PER_US : 0.0,
+			(double)s->max / SIM_CYCLES_PER_US);
+	for (int b = 0; b < PROFILE_BUCKETS; b++)
+		if (s->buckets[b]) {
+			if (b < PROFILE_BUCKETS - 1) fprintf(out, " <%u:%u", (1u << (PROFILE_BUCKET0_LOG2 + b)) / SIM_CYCLES_PER_US, s->buckets[b]);
+			else fprintf(out, " more:%u", s->buckets[b]);
+		}
+	fputc('\n', out);
+}
+
+static void host_report(FILE *out)
+{
+	fprintf(out, "%-16s: %llu frames sent, %llu ACK, NAK %llu crc %llu full %llu type %llu length %llu pattern %llu busy %llu settings %llu wave %llu profile %llu baud, %llu credit, %llu bad frames back\n", "host",
+			(unsigned long long)frames_sent, (unsigned long long)acks,
+			(unsigned long long)naks[FRAME_NAK_CRC], (unsigned long long)naks[FRAME_NAK_FULL],
+			(unsigned long long)naks[FRAME_NAK_TYPE], (unsigned long long)naks[FRAME_NAK_LENGTH],
+			(unsigned long long)naks[FRAME_NAK_PATTERN], (unsigned long long)naks[FRAME_NAK_BUSY], (unsigned long long)naks[FRAME_NAK_SETTINGS], (unsigned long long)naks[FRAME_NAK_WAVE],
+			(unsigned long long)naks[FRAME_NAK_PROFILE], (unsigned long long)naks[FRAME_NAK_BAUD],
+			(unsigned long long)credits, (unsigned long long)bad_frames);
+	fprintf(out, "%-16s: %llu bursts started, %llu repeated, %llu done\n", "host status",
+			(unsigned long long)statuses[0], (unsigned long long)statuses[1], (unsigned long long)statuses[2]);
+	if (statuses[STATUS_SAVING - STATUS_BURST_STARTED])
+		fprintf(out, "%-16s: %llu saves, %llu saved, %llu failed, frames held for up to %.1f ms\n", "host save",
+				(unsigned long long)statuses[STATUS_SAVING - STATUS_BURST_STARTED],
+				(unsigned long long)statuses[STATUS_SAVED - STATUS_BURST_STARTED],
+				(unsigned long long)statuses[STATUS_SAVE_FAILED - STATUS_BURST_STARTED], (double)save_held_most / SIM_CYCLES_PER_MS);
+	if (telemetry_frames) {
+		const uint8_t *p = telemetry_last;
+		fprintf(out, "%-16s: %llu frames, %u to %u ms apart. Last: batt %u cap %u setpoint %u mV, current %u (max %u), pot %u, "
+				"%u free, %u queued, burst %u, %u reps left, flags 0x%02X, %u TX dropped\n", "host telemetry",
+				(unsigned long long)telemetry_frames, telemetry_frames > 1 ? telemetry_gap_min : 0, telemetry_gap_max,
+				p[4] | p[5] << 8, p[6] | p[7] << 8, p[8] | p[9] << 8, p[10] | p[11] << 8, p[12] | p[13] << 8, p[14], p[15],
+				p[16] | p[17] << 8, p[18] | p[19] << 8, p[20] | p[21] << 8, p[22], p[23] | p[24] << 8);
+	}
+	if (profile_frames) {
+		for (int i = 0; i < PROFILE_STATS; i++) {
+			const uint8_t *p = profile_last[i];
+			_profile_stats s = { .count = le32(&p[1]), .total = le32(&p[5]) | (uint64_t)le32(&p[9]) << 32,
+					.min = le32(&p[13]), .max = le32(&p[17]) };
+			char name[32];
+
+			if (!s.count) continue;
+			for (int b = 0; b < PROFILE_BUCKETS; b++) s.buckets[b] = p[21 + 2 * b] | p[22 + 2 * b] << 8;
+			snprintf(name, sizeof(name), "host profile %s", profile_names[i]);
+			profile_line(out, name, &s);
+		}
+		fprintf(out, "%-16s: %llu frames. The last said %u RX overruns, %u frames dropped, %u TX messages dropped\n", "host profile",
+				(unsigned long long)profile_frames, profile_counters[0], profile_counters[1], profile_counters[2]);
+	}
+	if (baud_switches || baud_unreadable || statuses[STATUS_BAUD_FALLBACK - STATUS_BURST_STARTED])
+		fprintf(out, "%-16s: at %u, switched %llu times, went back %llu times, %llu bytes it couldn't read, %llu fallback statuses heard\n",
+				"host baud", sim_host_baud, (unsigned long long)baud_switches, (unsigned long long)baud_fallbacks,
+				(unsigned long long)baud_unreadable, (unsigned long long)statuses[STATUS_BAUD_FALLBACK - STATUS_BURST_STARTED]);
+	if (stream_acked)
+		fprintf(out, "%-16s: %u bursts ACKed in %.1f ms, %.0f bursts/s\n", "stream", stream_acked,
+				(double)(stream_last_ack_at - stream_started_at) / SIM_CYCLES_PER_MS,
+				stream_acked * (double)SIM_CORE_HZ / (double)(stream_last_ack_at - stream_started_at));
+	if (stream_left || stream_in_flight)
+		fprintf(out, "%-16s: %u bursts not sent yet, %u not answered\n", "stream", stream_left, stream_in_flight);
+}
+
+//what the firmware measured itself
+static void firmware_report(FILE *out)
+{
+	fprintf(out, "%-16s: %u overruns (bytes the firmware lost because it fell a whole buffer behind)\n", "usart_rx ring", usart_rx.overruns);
+	fprintf(out, "%-16s: %u messages (%lu bytes) dropped for want of room, at most %u of %u bytes waiting\n", "usart_tx ring",
+			usart_tx.dropped, (unsigned long)usart_tx.dropped_bytes, usart_tx.most_waiting, TX_BUFFER_SIZE);
+	profile_line(out, "main loop", &profile.stats[PROFILE_LOOP]);
+	profile_line(out, "pulse isr", &profile.stats[PROFILE_PULSE]);
+	profile_line(out, "pulse late", &profile.stats[PROFILE_PULSE_LATE]);
+	profile_line(out, "usart rx isr", &profile.stats[PROFILE_USART_RX]);
+	profile_line(out, "usart tx isr", &profile.stats[PROFILE_USART_TX]);
+	fprintf(out, "%-16s: %u frames dropped for a bad CRC or length\n", "frame parser", profile.frames_dropped);
+	fprintf(out, "%-16s: %lu scans, %lu in pulses. Last pulse %u, highest in the burst %u. Cap %u mV, batt %u mV, pot %u\n", "adc",
+			(unsigned long)adc.scans, (unsigned long)adc.pulse_scans, adc.current, adc.current_max, adc.cap_mV, adc.batt_mV, adc.pot);
+	if (settings.charge_per_V)
+		fprintf(out, "%-16s: on times x%.3f, aiming for a current reading of %u\n", "constant charge",
+				charge.gain_q12 / 4096.0, charge.target);
+}
+
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+			"usage: %s [options] scenario.txt\n"
+			"  -d ms       run for this long instead of the scenario's end time\n"
+			"  -t file     write a trace of pin edges and DAC changes (t_us,signal,value)\n"
+			"  -q          don't echo what the firmware transmits\n"
+			"  -b mV       battery voltage (default 12000)\n"
+			"  -p percent  level pot position (default 30)\n"
+			"  -f file     flash image: read at the start (erased flash if there's no such file) and written back at the end\n"
+			"  -i bytes    how much flash the firmware image takes (default 0x9000). Into the last two pages, and nothing is saved\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+	long duration_ms = -1, end_ms;
+	FILE *trace = NULL;
+	const char *flash_path = NULL;
+	int opt;
+	struct timespec t0, t1;
+
+	while ((opt = getopt(argc, argv, "d:t:qb:p:f:i:")) != -1) {
+		switch (opt) {
+		case 'd': duration_ms = atol(optarg); break;
+		case 't':
+			if (!(trace = fopen(optarg, "w"))) {
+				perror(optarg);
+				return 1;
+			}
+			fprintf(trace, "t_us,signal,value\n");
+			sim_set_trace(trace);
+			break;
+		case 'q': echo = 0; break;
+		case 'b': sim_inputs.batt_mV = (uint16_t)atoi(optarg); break;
+		case 'p': sim_inputs.pot_percent = (uint8_t)atoi(optarg); break;
+		case 'f': flash_path = optarg; break;
+		case 'i': sim_image_size = (uint32_t)strtoul(optarg, NULL, 0); break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	sim_flash_load(flash_path);
+	sim_mx_init();
+	if ((end_ms = load_scenario(argv[optind])) < 0) return 1;
+	if (duration_ms >= 0) end_ms = duration_ms;
+	sim_init((uint64_t)end_ms * SIM_CYCLES_PER_MS);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (!setjmp(sim_exit)) {
+		Do_User_Code_Begin_While();
+		while (1)
+			Do_User_Code_While_1();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	fflush(stdout);
+	sim_report(stdout, (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9);
+	host_report(stdout);
+	firmware_report(stdout);
+	if (trace) fclose(trace);
+	if (flash_path && sim_flash_save(flash_path) < 0) return 1;
+	return 0;
+}
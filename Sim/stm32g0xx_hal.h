@@ -0,0 +1,554 @@
+// ------------------------------------------------------------------
+// Stand-in for the STM32CubeG0 HAL, used by the host simulator only.
+// ------------------------------------------------------------------
+// Just enough of the HAL types, register blocks and functions for NeoDK.c to compile
+// unchanged on a PC. The peripheral registers are plain structs that sim_hal.c inspects
+// every time the firmware calls into the HAL, so register writes done directly by the
+// firmware (eg htim14.Instance->ARR) still behave like the real thing.
+// Names, values and semantics follow the real HAL so the firmware can't tell the difference.
+
+#ifndef __STM32G0XX_HAL_H
+#define __STM32G0XX_HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define __IO volatile
+
+typedef enum {
+	HAL_OK      = 0x00U,
+	HAL_ERROR   = 0x01U,
+	HAL_BUSY    = 0x02U,
+	HAL_TIMEOUT = 0x03U
+} HAL_StatusTypeDef;
+
+typedef enum {
+	DISABLE = 0U,
+	ENABLE = !DISABLE
+} FunctionalState;
+
+
+// -----------------
+// Register blocks
+// -----------------
+
+typedef struct {
+	__IO uint32_t MODER;
+	__IO uint32_t OTYPER;
+	__IO uint32_t OSPEEDR;
+	__IO uint32_t PUPDR;
+	__IO uint32_t IDR;
+	__IO uint32_t ODR;
+	__IO uint32_t BSRR;
+	__IO uint32_t LCKR;
+	__IO uint32_t AFR[2];
+	__IO uint32_t BRR;
+} GPIO_TypeDef;
+
+typedef struct {
+	__IO uint32_t CR1;
+	__IO uint32_t CR2;
+	__IO uint32_t SMCR;
+	__IO uint32_t DIER;
+	__IO uint32_t SR;
+	__IO uint32_t EGR;
+	__IO uint32_t CCMR1;
+	__IO uint32_t CCMR2;
+	__IO uint32_t CCER;
+	__IO uint32_t CNT;
+	__IO uint32_t PSC;
+	__IO uint32_t ARR;
+	__IO uint32_t RCR;
+	__IO uint32_t CCR1;
+	__IO uint32_t CCR2;
+	__IO uint32_t CCR3;
+	__IO uint32_t CCR4;
+	__IO uint32_t BDTR;
+} TIM_TypeDef;
+
+typedef struct {
+	__IO uint32_t CR1;
+	__IO uint32_t CR2;
+	__IO uint32_t CR3;
+	__IO uint32_t BRR;
+	__IO uint32_t ISR;
+	__IO uint32_t ICR;
+	__IO uint32_t RDR;
+	__IO uint32_t TDR;
+	__IO uint32_t PRESC;
+} USART_TypeDef;
+
+typedef struct {
+	__IO uint32_t CCR;
+	__IO uint32_t CNDTR;
+	__IO uint32_t CPAR;
+	__IO uint32_t CMAR;
+} DMA_Channel_TypeDef;
+
+typedef struct {
+	__IO uint32_t ISR;
+	__IO uint32_t IER;
+	__IO uint32_t CR;
+	__IO uint32_t CFGR1;
+	__IO uint32_t CFGR2;
+	__IO uint32_t SMPR;
+	__IO uint32_t CHSELR;
+	__IO uint32_t DR;
+} ADC_TypeDef;
+
+typedef struct {
+	__IO uint32_t CR;
+	__IO uint32_t DHR12R2;
+	__IO uint32_t DOR2;
+} DAC_TypeDef;
+
+extern GPIO_TypeDef sim_gpioa, sim_gpiob, sim_gpioc;
+extern TIM_TypeDef sim_tim1, sim_tim2, sim_tim14;
+extern USART_TypeDef sim_lpuart1;
+extern DMA_Channel_TypeDef sim_dma1_channel[7];
+extern ADC_TypeDef sim_adc1;
+extern DAC_TypeDef sim_dac1;
+
+#define GPIOA			(&sim_gpioa)
+#define GPIOB			(&sim_gpiob)
+#define GPIOC			(&sim_gpioc)
+#define TIM1			(&sim_tim1)
+#define TIM2			(&sim_tim2)
+#define TIM14			(&sim_tim14)
+#define LPUART1			(&sim_lpuart1)
+#define ADC1			(&sim_adc1)
+#define DAC1			(&sim_dac1)
+#define DMA1_Channel1	(&sim_dma1_channel[0])
+#define DMA1_Channel2	(&sim_dma1_channel[1])
+#define DMA1_Channel3	(&sim_dma1_channel[2])
+
+#define TIM_CR1_CEN		0x0001U
+#define TIM_CR1_URS		0x0004U
+#define TIM_CR1_ARPE	0x0080U
+#define TIM_DIER_UIE	0x0001U
+#define TIM_SR_UIF		0x0001U
+#define TIM_SR_CC4IF	0x0010U
+#define TIM_EGR_UG		0x0001U
+#define TIM_EGR_CC4G	0x0010U
+#define TIM_CCMR1_OC1PE	0x0008U
+#define TIM_CCMR1_OC1M	0x0070U
+#define TIM_CCMR1_OC2PE	0x0800U
+#define TIM_CCMR1_OC2M	0x7000U
+#define TIM_CCMR2_OC3PE	0x0008U
+#define TIM_CCMR2_OC4PE	0x0800U
+#define TIM_CCER_CC1E	0x0001U
+#define TIM_CCER_CC1P	0x0002U
+#define TIM_CCER_CC2E	0x0010U
+#define TIM_CCER_CC2P	0x0020U
+#define TIM_BDTR_MOE	0x8000U
+
+#define DMA_CCR_EN		0x0001U
+#define DMA_CCR_TCIE	0x0002U
+#define DMA_CCR_HTIE	0x0004U
+#define DMA_CCR_CIRC	0x0020U
+
+
+// ------
+// Core
+// ------
+
+void sim_set_msp(uint32_t msp);
+void sim_nop(void);
+void sim_wfi(void);
+void sim_disable_irq(void);
+void sim_enable_irq(void);
+
+typedef enum {
+	TIM1_BRK_UP_TRG_COM_IRQn	= 13,
+	TIM14_IRQn					= 19
+} IRQn_Type;
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority);
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn);
+
+#define __HAL_RCC_TIM1_CLK_ENABLE()		do { } while (0)
+
+#define __set_MSP(x)	sim_set_msp(x)
+#define __NOP()			sim_nop()
+#define __WFI()			sim_wfi()
+#define __disable_irq()	sim_disable_irq()
+#define __enable_irq()	sim_enable_irq()
+#define __DMB()			__sync_synchronize()
+
+void HAL_Delay(uint32_t Delay);
+uint32_t HAL_GetTick(void);
+
+
+// ------
+// GPIO
+// ------
+
+#define GPIO_PIN_0		((uint16_t)0x0001)
+#define GPIO_PIN_1		((uint16_t)0x0002)
+#define GPIO_PIN_2		((uint16_t)0x0004)
+#define GPIO_PIN_3		((uint16_t)0x0008)
+#define GPIO_PIN_4		((uint16_t)0x0010)
+#define GPIO_PIN_5		((uint16_t)0x0020)
+#define GPIO_PIN_6		((uint16_t)0x0040)
+#define GPIO_PIN_7		((uint16_t)0x0080)
+#define GPIO_PIN_8		((uint16_t)0x0100)
+#define GPIO_PIN_9		((uint16_t)0x0200)
+#define GPIO_PIN_10		((uint16_t)0x0400)
+#define GPIO_PIN_11		((uint16_t)0x0800)
+#define GPIO_PIN_12		((uint16_t)0x1000)
+#define GPIO_PIN_13		((uint16_t)0x2000)
+#define GPIO_PIN_14		((uint16_t)0x4000)
+#define GPIO_PIN_15		((uint16_t)0x8000)
+
+typedef enum {
+	GPIO_PIN_RESET = 0U,
+	GPIO_PIN_SET
+} GPIO_PinState;
+
+#define GPIO_MODE_INPUT			0x00000000U
+#define GPIO_MODE_OUTPUT_PP		0x00000001U
+#define GPIO_MODE_OUTPUT_OD		0x00000011U
+#define GPIO_MODE_AF_PP			0x00000002U
+#define GPIO_MODE_ANALOG		0x00000003U
+#define GPIO_NOPULL				0x00000000U
+#define GPIO_PULLUP				0x00000001U
+#define GPIO_PULLDOWN			0x00000002U
+#define GPIO_SPEED_FREQ_LOW		0x00000000U
+#define GPIO_SPEED_FREQ_MEDIUM	0x00000001U
+#define GPIO_SPEED_FREQ_HIGH	0x00000002U
+#define GPIO_AF2_TIM1			0x02U
+
+typedef struct {
+	uint32_t Pin;
+	uint32_t Mode;
+	uint32_t Pull;
+	uint32_t Speed;
+	uint32_t Alternate;
+} GPIO_InitTypeDef;
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init);
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState);
+void HAL_GPIO_TogglePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+
+
+// -----
+// DMA
+// -----
+
+#define DMA_NORMAL		0x00000000U
+#define DMA_CIRCULAR	DMA_CCR_CIRC
+#define DMA_IT_TC		DMA_CCR_TCIE
+#define DMA_IT_HT		DMA_CCR_HTIE
+
+typedef enum {
+	HAL_DMA_STATE_RESET = 0x00U,
+	HAL_DMA_STATE_READY = 0x01U,
+	HAL_DMA_STATE_BUSY  = 0x02U
+} HAL_DMA_StateTypeDef;
+
+typedef struct {
+	uint32_t Request;
+	uint32_t Direction;
+	uint32_t Mode;
+	uint32_t Priority;
+} DMA_InitTypeDef;
+
+typedef struct __DMA_HandleTypeDef {
+	DMA_Channel_TypeDef		*Instance;
+	DMA_InitTypeDef			Init;
+	HAL_DMA_StateTypeDef	State;
+	void					*Parent;
+} DMA_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma);
+
+#define __HAL_DMA_ENABLE_IT(__HANDLE__, __INTERRUPT__)	((__HANDLE__)->Instance->CCR |= (__INTERRUPT__))
+#define __HAL_DMA_DISABLE_IT(__HANDLE__, __INTERRUPT__)	((__HANDLE__)->Instance->CCR &= ~(__INTERRUPT__))
+#define __HAL_DMA_GET_COUNTER(__HANDLE__)				((__HANDLE__)->Instance->CNDTR)
+
+
+// -----
+// TIM
+// -----
+
+typedef enum {
+	HAL_TIM_STATE_RESET = 0x00U,
+	HAL_TIM_STATE_READY = 0x01U,
+	HAL_TIM_STATE_BUSY  = 0x02U
+} HAL_TIM_StateTypeDef;
+
+typedef struct {
+	uint32_t Prescaler;
+	uint32_t CounterMode;
+	uint32_t Period;
+	uint32_t ClockDivision;
+	uint32_t RepetitionCounter;
+	uint32_t AutoReloadPreload;
+} TIM_Base_InitTypeDef;
+
+typedef struct {
+	uint32_t OCMode;
+	uint32_t Pulse;
+	uint32_t OCPolarity;
+	uint32_t OCNPolarity;
+	uint32_t OCFastMode;
+	uint32_t OCIdleState;
+	uint32_t OCNIdleState;
+} TIM_OC_InitTypeDef;
+
+typedef struct {
+	TIM_TypeDef				*Instance;
+	TIM_Base_InitTypeDef	Init;
+	__IO HAL_TIM_StateTypeDef	State;
+} TIM_HandleTypeDef;
+
+#define TIM_COUNTERMODE_UP				0x00000000U
+#define TIM_CLOCKDIVISION_DIV1			0x00000000U
+#define TIM_AUTORELOAD_PRELOAD_DISABLE	0x00000000U
+#define TIM_AUTORELOAD_PRELOAD_ENABLE	TIM_CR1_ARPE
+#define TIM_OCMODE_PWM1					0x00000060U
+#define TIM_OCMODE_PWM2					0x00000070U
+#define TIM_OCPOLARITY_HIGH				0x00000000U
+#define TIM_OCPOLARITY_LOW				TIM_CCER_CC1P
+#define TIM_OCNPOLARITY_HIGH			0x00000000U
+#define TIM_OCFAST_DISABLE				0x00000000U
+#define TIM_OCIDLESTATE_RESET			0x00000000U
+#define TIM_OCNIDLESTATE_RESET			0x00000000U
+#define TIM_CHANNEL_1					0x00000000U
+#define TIM_CHANNEL_2					0x00000004U
+#define TIM_CHANNEL_3					0x00000008U
+#define TIM_CHANNEL_4					0x0000000CU
+#define TIM_IT_UPDATE					TIM_DIER_UIE
+#define TIM_FLAG_UPDATE					TIM_SR_UIF
+
+#define __HAL_TIM_ENABLE_IT(__HANDLE__, __INTERRUPT__)	((__HANDLE__)->Instance->DIER |= (__INTERRUPT__))
+#define __HAL_TIM_DISABLE_IT(__HANDLE__, __INTERRUPT__)	((__HANDLE__)->Instance->DIER &= ~(__INTERRUPT__))
+#define __HAL_TIM_CLEAR_FLAG(__HANDLE__, __FLAG__)		((__HANDLE__)->Instance->SR = ~(__FLAG__))
+#define __HAL_TIM_GET_COUNTER(__HANDLE__)				((__HANDLE__)->Instance->CNT)
+#define __HAL_TIM_SET_COUNTER(__HANDLE__, __COUNTER__)	((__HANDLE__)->Instance->CNT = (__COUNTER__))
+#define __HAL_TIM_SET_AUTORELOAD(__HANDLE__, __AUTORELOAD__)	((__HANDLE__)->Instance->ARR = (__AUTORELOAD__))
+
+HAL_StatusTypeDef HAL_TIM_Base_Start(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_Base_Stop(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_Base_Stop_IT(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_PWM_Init(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_PWM_ConfigChannel(TIM_HandleTypeDef *htim, const TIM_OC_InitTypeDef *sConfig, uint32_t Channel);
+HAL_StatusTypeDef HAL_TIM_PWM_Start(TIM_HandleTypeDef *htim, uint32_t Channel);
+void HAL_TIM_IRQHandler(TIM_HandleTypeDef *htim);
+void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim);
+
+
+// -----
+// ADC
+// -----
+
+#define ADC_IT_EOC		0x0004U
+#define ADC_IT_EOS		0x0008U
+#define ADC_IT_OVR		0x0010U
+
+#define ADC_CR_ADSTART		0x0004U
+
+//sampling times are the SMPR codes, ratios and shifts the CFGR2 fields, as on the target
+#define ADC_SAMPLETIME_1CYCLE_5			0x0U
+#define ADC_SAMPLETIME_3CYCLES_5		0x1U
+#define ADC_SAMPLETIME_7CYCLES_5		0x2U
+#define ADC_SAMPLETIME_12CYCLES_5		0x3U
+#define ADC_SAMPLETIME_19CYCLES_5		0x4U
+#define ADC_SAMPLETIME_39CYCLES_5		0x5U
+#define ADC_SAMPLETIME_79CYCLES_5		0x6U
+#define ADC_SAMPLETIME_160CYCLES_5		0x7U
+#define ADC_SAMPLINGTIME_COMMON_1		0x00000000U
+#define ADC_SAMPLINGTIME_COMMON_2		0x80000000U
+#define ADC_OVERSAMPLING_RATIO_2		0x00000000U
+#define ADC_OVERSAMPLING_RATIO_4		0x00000004U
+#define ADC_OVERSAMPLING_RATIO_8		0x00000008U
+#define ADC_OVERSAMPLING_RATIO_16		0x0000000CU
+#define ADC_RIGHTBITSHIFT_NONE			0x00000000U
+#define ADC_RIGHTBITSHIFT_1				0x00000020U
+#define ADC_RIGHTBITSHIFT_2				0x00000040U
+#define ADC_RIGHTBITSHIFT_3				0x00000060U
+#define ADC_RIGHTBITSHIFT_4				0x00000080U
+#define ADC_TRIGGEREDMODE_SINGLE_TRIGGER	0x00000000U
+#define ADC_SOFTWARE_START				0x000001C1U
+#define ADC_EXTERNALTRIG_T1_CC4			0x00000040U
+#define ADC_EXTERNALTRIGCONVEDGE_NONE	0x00000000U
+#define ADC_EXTERNALTRIGCONVEDGE_RISING	0x00000400U
+#define ADC_CHANNEL_0					0U		//just the channel numbers here
+#define ADC_CHANNEL_1					1U
+#define ADC_CHANNEL_6					6U
+#define ADC_CHANNEL_7					7U
+#define ADC_REGULAR_RANK_1				1U
+#define ADC_REGULAR_RANK_2				2U
+#define ADC_REGULAR_RANK_3				3U
+#define ADC_REGULAR_RANK_4				4U
+
+typedef struct {
+	uint32_t Ratio;
+	uint32_t RightBitShift;
+	uint32_t TriggeredMode;
+} ADC_OversamplingTypeDef;
+
+typedef struct {
+	uint32_t ContinuousConvMode;
+	uint32_t NbrOfConversion;
+	uint32_t ExternalTrigConv;
+	uint32_t ExternalTrigConvEdge;
+	uint32_t SamplingTimeCommon1;
+	uint32_t SamplingTimeCommon2;
+	uint32_t OversamplingMode;
+	ADC_OversamplingTypeDef Oversampling;
+} ADC_InitTypeDef;
+
+typedef struct {
+	uint32_t Channel;
+	uint32_t Rank;
+	uint32_t SamplingTime;
+} ADC_ChannelConfTypeDef;
+
+typedef struct __ADC_HandleTypeDef {
+	ADC_TypeDef			*Instance;
+	ADC_InitTypeDef		Init;
+	DMA_HandleTypeDef	*DMA_Handle;
+} ADC_HandleTypeDef;
+
+#define __HAL_ADC_ENABLE_IT(__HANDLE__, __INTERRUPT__)	((__HANDLE__)->Instance->IER |= (__INTERRUPT__))
+#define __HAL_ADC_DISABLE_IT(__HANDLE__, __INTERRUPT__)	((__HANDLE__)->Instance->IER &= ~(__INTERRUPT__))
+
+//from stm32g0xx_ll_adc.h, which the HAL ADC header pulls in on the target
+static inline void LL_ADC_REG_StartConversion(ADC_TypeDef *ADCx)
+{
+	ADCx->CR |= ADC_CR_ADSTART;
+}
+
+HAL_StatusTypeDef HAL_ADC_Init(ADC_HandleTypeDef *hadc);
+HAL_StatusTypeDef HAL_ADC_ConfigChannel(ADC_HandleTypeDef *hadc, const ADC_ChannelConfTypeDef *sConfig);
+HAL_StatusTypeDef HAL_ADCEx_Calibration_Start(ADC_HandleTypeDef *hadc);
+HAL_StatusTypeDef HAL_ADC_Start_DMA(ADC_HandleTypeDef *hadc, uint32_t *pData, uint32_t Length);
+HAL_StatusTypeDef HAL_ADC_Stop_DMA(ADC_HandleTypeDef *hadc);
+void HAL_ADC_ConvHalfCpltCallback(ADC_HandleTypeDef *hadc);
+void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef *hadc);
+
+
+// -----
+// DAC
+// -----
+
+#define DAC_CHANNEL_1		0x00000000U
+#define DAC_CHANNEL_2		0x00000010U
+#define DAC_ALIGN_12B_R		0x00000000U
+
+typedef struct {
+	DAC_TypeDef		*Instance;
+} DAC_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_DAC_Start(DAC_HandleTypeDef *hdac, uint32_t Channel);
+HAL_StatusTypeDef HAL_DAC_SetValue(DAC_HandleTypeDef *hdac, uint32_t Channel, uint32_t Alignment, uint32_t Data);
+
+
+// ------
+// UART
+// ------
+
+typedef enum {
+	HAL_UART_STATE_RESET   = 0x00U,
+	HAL_UART_STATE_READY   = 0x20U,
+	HAL_UART_STATE_BUSY_TX = 0x21U,
+	HAL_UART_STATE_BUSY_RX = 0x22U
+} HAL_UART_StateTypeDef;
+
+#define HAL_UART_RXEVENT_TC		0x00000000U
+#define HAL_UART_RXEVENT_HT		0x00000001U
+#define HAL_UART_RXEVENT_IDLE	0x00000002U
+
+#define HAL_UART_ERROR_NONE		0x00000000U
+#define HAL_UART_ERROR_PE		0x00000001U
+#define HAL_UART_ERROR_NE		0x00000002U
+#define HAL_UART_ERROR_FE		0x00000004U
+#define HAL_UART_ERROR_ORE		0x00000008U
+
+#define UART_FIFOMODE_DISABLE	0x00000000U
+#define UART_FIFOMODE_ENABLE	0x20000000U		//USART_CR1_FIFOEN
+#define UART_TXFIFO_THRESHOLD_1_8	0x00000000U
+#define UART_TXFIFO_THRESHOLD_1_2	0x40000000U
+#define UART_RXFIFO_THRESHOLD_1_8	0x00000000U
+#define UART_RXFIFO_THRESHOLD_1_2	0x04000000U
+
+typedef struct {
+	uint32_t BaudRate;
+	uint32_t WordLength;
+	uint32_t StopBits;
+	uint32_t Parity;
+	uint32_t Mode;
+	uint32_t HwFlowCtl;
+} UART_InitTypeDef;
+
+typedef struct __UART_HandleTypeDef {
+	USART_TypeDef			*Instance;
+	UART_InitTypeDef		Init;
+	uint8_t					*pRxBuffPtr;
+	uint16_t				RxXferSize;
+	__IO uint32_t			RxEventType;
+	DMA_HandleTypeDef		*hdmatx;
+	DMA_HandleTypeDef		*hdmarx;
+	__IO HAL_UART_StateTypeDef	gState;
+	__IO HAL_UART_StateTypeDef	RxState;
+	__IO uint32_t			ErrorCode;
+	uint32_t				FifoMode;
+} UART_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_Abort(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UARTEx_EnableFifoMode(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UARTEx_SetTxFifoThreshold(UART_HandleTypeDef *huart, uint32_t Threshold);
+HAL_StatusTypeDef HAL_UARTEx_SetRxFifoThreshold(UART_HandleTypeDef *huart, uint32_t Threshold);
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size);
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
+
+
+// -------
+// Flash
+// -------
+// Flash is an array in sim_hal.c, so FLASH_BASE is wherever that is. Addresses passed as uint32_t (as the real HAL has them)
+// are only the low half of a host pointer, and sim_hal.c works the offset out from that.
+
+#define SIM_FLASH_SIZE					0x10000U		//64K, like an STM32G031x8
+extern uint8_t sim_flash[SIM_FLASH_SIZE];
+
+#define FLASH_BASE						((uintptr_t)sim_flash)
+#define FLASH_SIZE						SIM_FLASH_SIZE
+#define FLASH_PAGE_SIZE					0x00000800U
+#define FLASH_PAGE_NB					(FLASH_SIZE / FLASH_PAGE_SIZE)
+//the firmware's code isn't in sim_flash, so where its image would end there is made up (-i sets it)
+extern uint32_t sim_image_size;
+#define IMAGE_END						(FLASH_BASE + sim_image_size)
+#define FLASH_BANK_1					0x00000004U
+#define FLASH_TYPEERASE_PAGES			0x00000002U
+#define FLASH_TYPEPROGRAM_DOUBLEWORD	0x00000001U
+
+typedef struct {
+	uint32_t TypeErase;
+	uint32_t Banks;
+	uint32_t Page;
+	uint32_t NbPages;
+} FLASH_EraseInitTypeDef;
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_Lock(void);
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data);
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __STM32G0XX_HAL_H */
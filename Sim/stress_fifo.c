@@ -0,0 +1,159 @@
+// -----------------------------------------------------------
+// Stress test: the burst queue's producer and consumer at once
+// -----------------------------------------------------------
+// The burst queue in NeoDK.c is a single producer/single consumer ring: the frame handler reserves room, writes a record
+// straight in and commits it, and the burst player peeks at the oldest record and releases it. On the board they never
+// run at the same instant, but either can be cut short at any point by the other (a frame handled from the event pump
+// while a burst is being unpacked, say). Here they run on two threads, so every interleaving the host's cores can make
+// gets tried, many millions of times.
+//
+// Each record is made from its sequence number, with a random mix of modulation and route parts so the sizes vary and
+// records keep landing on the end of the buffer, where the producer leaves a skip marker and starts again at the front.
+// The consumer makes the same record from the number it expects next and checks what it took off the queue against it,
+// so a record lost, repeated, out of order or torn shows up as a mismatch.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "NeoDK.h"
+
+//nothing is sent over the UART here
+void sim_host_receive(const uint8_t *data, uint16_t len)
+{
+	(void)data;
+	(void)len;
+}
+
+void sim_host_line_error(uint16_t len)
+{
+	(void)len;
+}
+
+#define RECORDS		5000000u
+
+static BURST_FIFO_Buffer fifo;
+static unsigned long producer_full, producer_skips, consumer_empty, consumer_skips, mismatches;
+static volatile int give_up;		//the consumer has seen enough wrong records, and the queue can't be trusted to run dry any more
+
+//the burst frame payload for record n: duration is n, everything else follows from it
+static void make_payload(uint32_t n, uint8_t *payload)
+{
+	uint32_t h = n * 2654435761u;
+
+	for (int i = 0; i < BURST_PAYLOAD_SIZE; i++) {
+		h ^= h << 13;
+		h ^= h >> 17;
+		h ^= h << 5;
+		payload[i] = (uint8_t)h;
+	}
+	payload[0] = (uint8_t)n;
+	payload[1] = (uint8_t)(n >> 8);
+	payload[2] = (uint8_t)(n >> 16);
+	payload[3] = (uint8_t)(n >> 24);
+	//each part there or not, from the bits of n, so every size of record comes round
+	if (!(n & 1)) payload[8] = 0;
+	if (!(n & 2)) payload[12] = 0;
+	if (!(n & 4)) payload[16] = 0;
+	if (!(n & 8)) payload[27] = payload[28] = 0;
+}
+
+static void expected_burst(uint32_t n, _burst *burst)
+{
+	uint8_t payload[BURST_PAYLOAD_SIZE];
+	uint32_t record[BURST_RECORD_MAX / 4];
+
+	make_payload(n, payload);
+	decode_burst_from_usart(payload, (_burst_record *)record);
+	memset(burst, 0, sizeof(*burst));
+	burst_record_unpack((_burst_record *)record, burst);
+}
+
+static void *producer(void *arg)
+{
+	uint8_t payload[BURST_PAYLOAD_SIZE];
+	_burst_record *slot;
+
+	(void)arg;
+	for (uint32_t n = 0; n < RECORDS && !give_up; n++) {
+		make_payload(n, payload);
+		while (!(slot = burst_fifo_reserve(&fifo, burst_record_size(payload)))) {
+			if (give_up) return NULL;
+			producer_full++;
+			sched_yield();
+		}
+		if (fifo.skip) producer_skips++;
+		decode_burst_from_usart(payload, slot);
+		burst_fifo_commit(&fifo);
+	}
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	_burst_record *record;
+	_burst got, want;
+
+	(void)arg;
+	for (uint32_t n = 0; n < RECORDS; n++) {
+		uint16_t tail = fifo.tail;
+		while (!(record = burst_fifo_peek(&fifo))) {
+			consumer_empty++;
+			sched_yield();
+			tail = fifo.tail;
+		}
+		if (fifo.tail != tail) consumer_skips++;		//peek stepped over a skip marker to the front of the buffer
+		memset(&got, 0, sizeof(got));
+		burst_record_unpack(record, &got);
+		burst_fifo_release(&fifo);
+		expected_burst(n, &want);
+		if (memcmp(&got, &want, sizeof(got))) {
+			fprintf(stderr, "record %u: got the burst of duration %u\n", n, got.duration);
+			if (++mismatches == 10) {
+				give_up = 1;
+				return NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+static double seconds(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	pthread_t p, c;
+	double t0;
+
+	burst_fifo_init(&fifo);
+	t0 = seconds();
+	pthread_create(&c, NULL, consumer, NULL);
+	pthread_create(&p, NULL, producer, NULL);
+	pthread_join(p, NULL);
+	pthread_join(c, NULL);
+
+	printf("records         : %u in %.2f s, %lu wrong\n", RECORDS, seconds() - t0, mismatches);
+	printf("skip markers    : %lu left by the producer, %lu stepped over by the consumer\n", producer_skips, consumer_skips);
+	printf("waits           : producer found it full %lu times, consumer found it empty %lu times\n", producer_full, consumer_empty);
+	if (give_up) {
+		printf("gave up after %lu wrong records\n", mismatches);
+		return 1;
+	}
+	if (!fifo_is_empty(&fifo)) {
+		printf("queue not empty at the end\n");
+		return 1;
+	}
+	if (producer_skips != consumer_skips) {
+		printf("skip markers don't match\n");
+		return 1;
+	}
+	return mismatches != 0;
+}